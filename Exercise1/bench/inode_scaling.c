@@ -0,0 +1,99 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+This benchmark measures how opening and reading small files scales with the
+number of threads. Each thread works on files of its own, created one after
+the other so that their inodes are neighbours in the inode table: threads
+contend on nothing but the cache lines those inodes (and their locks) share.
+It is also built against TécnicoFS with TFS_INODE_PACKED (as
+inode_scaling_packed), to compare the inode layouts.
+
+Usage: inode_scaling [operations per thread]
+*/
+
+#define MAX_THREADS 16
+#define FILES_PER_THREAD 4
+#define CONTENTS "small file contents"
+
+static size_t operations = 200000;
+
+static void *worker(void *arg) {
+    size_t id = (size_t)arg;
+    char names[FILES_PER_THREAD][32];
+    for (size_t i = 0; i < FILES_PER_THREAD; i++) {
+        snprintf(names[i], sizeof(names[i]), "/f%zu", i * MAX_THREADS + id);
+    }
+
+    char buffer[sizeof(CONTENTS)];
+    for (size_t op = 0; op < operations; op++) {
+        int f = tfs_open(names[op % FILES_PER_THREAD], 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(CONTENTS));
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+static double run(size_t threads) {
+    pthread_t tids[MAX_THREADS];
+    struct timespec start, end;
+
+    assert(clock_gettime(CLOCK_MONOTONIC, &start) == 0);
+    for (size_t i = 0; i < threads; i++) {
+        assert(pthread_create(&tids[i], NULL, worker, (void *)i) == 0);
+    }
+    for (size_t i = 0; i < threads; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+    assert(clock_gettime(CLOCK_MONOTONIC, &end) == 0);
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    return (double)(threads * operations) / seconds;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        operations = strtoul(argv[1], NULL, 10);
+    }
+
+    // The root directory must fit every file.
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 128;
+    params.block_size = 4096;
+    assert(tfs_init(&params) != -1);
+
+    // Files of different threads interleave in the inode table.
+    for (size_t i = 0; i < FILES_PER_THREAD * MAX_THREADS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/f%zu", i);
+        int f = tfs_open(name, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, CONTENTS, sizeof(CONTENTS)) == sizeof(CONTENTS));
+        assert(tfs_close(f) != -1);
+    }
+
+#ifdef TFS_INODE_PACKED
+    printf("packed inodes\n");
+#else
+    printf("split inodes\n");
+#endif
+    printf("threads  open+read+close/s  speedup\n");
+    double base = 0;
+    for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double rate = run(threads);
+        if (threads == 1) {
+            base = rate;
+        }
+        printf("%7zu  %17.0f  %7.2f\n", threads, rate, rate / base);
+    }
+
+    assert(tfs_destroy() != -1);
+    return 0;
+}
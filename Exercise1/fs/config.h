@@ -6,6 +6,59 @@
 
 #define MAX_FILE_NAME (40)
 
-#define DELAY (5000)
+// Maximum length of an absolute path name (including the terminating '\0').
+#define MAX_PATH_NAME (256)
+
+// Number of direct block references kept in each inode (the remaining blocks
+// of a file are reached through a single and a double indirect block).
+#define INODE_DIRECT_BLOCKS (10)
+
+// Number of extents (runs of contiguous blocks) recorded in each inode.
+#define INODE_EXTENTS (8)
+
+// The inode table, the data blocks and the open file table grow (up to the
+// limits in tfs_params) by chunks of these many entries. Chunks of blocks are
+// a multiple of 64 blocks, so they cover whole words of the block bitmap.
+#define INODE_TABLE_CHUNK (64)
+#define DATA_BLOCKS_CHUNK (256)
+#define OPEN_FILE_TABLE_CHUNK (16)
+
+// Size of a CPU cache line: structures written by different threads are kept
+// on cache lines of their own.
+#define CACHE_LINE_SIZE (64)
+
+// Data blocks are split into these many fragments, so that files smaller than
+// a block (but too large to be kept inline in their inode) can share blocks.
+#define FRAGMENTS_PER_BLOCK (8)
+
+// Number of blocks with free fragments remembered for allocations.
+#define FRAGMENT_PARTIAL_BLOCKS (16)
+
+// Number of blocks prefetched after a read through a file handle (only when
+// the data blocks are mapped from an image).
+#define DATA_READAHEAD_BLOCKS (32)
+
+// Number of shards of the open file table, each with its own free list and
+// lock (threads allocate handles from a shard of their own).
+#define OPEN_FILE_SHARDS (8)
+
+// Number of optimistic (seqlock) attempts to read a small file before
+// falling back to taking the inode's lock.
+#define SEQLOCK_READ_ATTEMPTS (4)
+
+// Maximum number of segments (runs of contiguous blocks) in a read view.
+#define TFS_VIEW_SEGMENTS (16)
+
+// Number of entries in the name lookup (dentry) cache, and of locks guarding
+// them.
+#define DCACHE_ENTRIES (512)
+#define DCACHE_LOCKS (32)
+
+// Maximum number of snapshots of the FS kept at a time.
+#define MAX_SNAPSHOTS (8)
+
+// Number of shards of the lock that changes to the FS hold (each thread holds
+// one of its own) and that taking a snapshot holds whole.
+#define MUTATION_BARRIER_SHARDS (16)
 
 #endif // CONFIG_H
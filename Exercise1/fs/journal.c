@@ -0,0 +1,317 @@
+#include "journal.h"
+#include "betterassert.h"
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The journal file holds a header followed by records, each made of a
+ * journal_record_t and its name and target (without terminating '\0's).
+ * Appended records are kept in a buffer; the first thread to commit one
+ * becomes the leader, and writes (and fsyncs) the whole buffer while other
+ * threads keep appending, or wait for their records to be flushed.
+ */
+#define JOURNAL_MAGIC UINT64_C(0x314c4e524a534654) // "TFSJRNL1"
+
+typedef struct {
+    uint64_t jh_magic;
+    uint64_t jh_generation;
+} journal_header_t;
+
+typedef struct {
+    uint32_t jr_op;
+    uint32_t jr_name_len;
+    uint32_t jr_target_len;
+    uint32_t jr_checksum; // of the rest of the record
+} journal_record_t;
+
+static int journal_fd = -1;
+static bool journal_recording;
+static bool journal_failed;
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_flushed = PTHREAD_COND_INITIALIZER;
+
+// Records appended but not yet handed to a leader.
+static char *journal_buffer;
+static size_t journal_buffer_len;
+static size_t journal_buffer_size;
+
+// Sequence numbers of the last record appended and of the last one known to
+// be durable; a leader is flushing while journal_flushing is set.
+static uint64_t journal_appended;
+static uint64_t journal_durable;
+static bool journal_flushing;
+
+/**
+ * Checksum a record (32-bit FNV-1a of its fields and strings).
+ */
+static uint32_t journal_checksum(journal_record_t const *record, char const *name,
+                                 char const *target) {
+    uint32_t hash = 2166136261u;
+    uint32_t fields[] = {record->jr_op, record->jr_name_len, record->jr_target_len};
+    unsigned char const *parts[] = {(unsigned char const *)fields,
+                                    (unsigned char const *)name,
+                                    (unsigned char const *)target};
+    size_t lengths[] = {sizeof(fields), record->jr_name_len, record->jr_target_len};
+
+    for (size_t p = 0; p < 3; p++) {
+        for (size_t i = 0; i < lengths[p]; i++) {
+            hash ^= parts[p][i];
+            hash *= 16777619u;
+        }
+    }
+    return hash;
+}
+
+/**
+ * Write a whole buffer at the end of the journal (retrying partial writes).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_write(char const *bytes, size_t len) {
+    while (len > 0) {
+        ssize_t done = write(journal_fd, bytes, len);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return -1;
+        }
+        bytes += done;
+        len -= (size_t)done;
+    }
+    return 0;
+}
+
+int journal_open(char const *path) {
+    journal_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journal_fd == -1) {
+        return -1;
+    }
+
+    journal_recording = false;
+    journal_failed = false;
+    journal_buffer_len = 0;
+    journal_appended = 0;
+    journal_durable = 0;
+    journal_flushing = false;
+    return 0;
+}
+
+int journal_replay(uint64_t generation,
+                   void (*apply)(journal_op_t op, char const *name, char const *target)) {
+    struct stat st;
+    if (fstat(journal_fd, &st) != 0) {
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(journal_header_t)) {
+        return 0; // Empty journal.
+    }
+
+    char *contents = malloc(size);
+    if (contents == NULL) {
+        return -1;
+    }
+    size_t read_len = 0;
+    while (read_len < size) {
+        ssize_t done = pread(journal_fd, contents + read_len, size - read_len,
+                             (off_t)read_len);
+        if (done == -1 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            free(contents);
+            return -1;
+        }
+        read_len += (size_t)done;
+    }
+
+    // Records of another checkpoint are already in the image (or belong to
+    // another image).
+    journal_header_t header;
+    memcpy(&header, contents, sizeof(header));
+    if (header.jh_magic != JOURNAL_MAGIC || header.jh_generation != generation) {
+        free(contents);
+        return 0;
+    }
+
+    int replayed = 0;
+    size_t pos = sizeof(header);
+    char name[MAX_PATH_NAME];
+    char target[MAX_PATH_NAME];
+    while (size - pos >= sizeof(journal_record_t)) {
+        journal_record_t record;
+        memcpy(&record, contents + pos, sizeof(record));
+        pos += sizeof(record);
+
+        if (record.jr_name_len >= MAX_PATH_NAME ||
+            record.jr_target_len >= MAX_PATH_NAME ||
+            size - pos < (size_t)record.jr_name_len + record.jr_target_len) {
+            break; // Torn record.
+        }
+        memcpy(name, contents + pos, record.jr_name_len);
+        name[record.jr_name_len] = '\0';
+        pos += record.jr_name_len;
+        memcpy(target, contents + pos, record.jr_target_len);
+        target[record.jr_target_len] = '\0';
+        pos += record.jr_target_len;
+
+        if (journal_checksum(&record, name, target) != record.jr_checksum) {
+            break; // Torn record.
+        }
+
+        apply((journal_op_t)record.jr_op, name,
+              record.jr_target_len > 0 ? target : NULL);
+        replayed++;
+    }
+
+    free(contents);
+    return replayed;
+}
+
+int journal_reset(uint64_t generation) {
+    if (journal_fd == -1) {
+        return 0;
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&journal_lock) == 0,
+                "The journal's lock could not be locked.");
+
+    // Records not flushed yet are in the checkpoint already.
+    journal_buffer_len = 0;
+    journal_durable = journal_appended;
+
+    journal_header_t header = {.jh_magic = JOURNAL_MAGIC, .jh_generation = generation};
+    int result = -1;
+    if (ftruncate(journal_fd, 0) == 0 &&
+        journal_write((char const *)&header, sizeof(header)) == 0 &&
+        fsync(journal_fd) == 0) {
+        result = 0;
+    }
+    journal_recording = result == 0;
+    journal_failed = result != 0;
+
+    ALWAYS_ASSERT(pthread_mutex_unlock(&journal_lock) == 0,
+                "The journal's lock could not be unlocked.");
+    return result;
+}
+
+void journal_close(void) {
+    if (journal_fd == -1) {
+        return;
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&journal_lock) == 0,
+                "The journal's lock could not be locked.");
+    close(journal_fd);
+    journal_fd = -1;
+    journal_recording = false;
+    free(journal_buffer);
+    journal_buffer = NULL;
+    journal_buffer_len = 0;
+    journal_buffer_size = 0;
+    ALWAYS_ASSERT(pthread_mutex_unlock(&journal_lock) == 0,
+                "The journal's lock could not be unlocked.");
+}
+
+uint64_t journal_append(journal_op_t op, char const *name, char const *target) {
+    if (target == NULL) {
+        target = "";
+    }
+
+    journal_record_t record = {
+        .jr_op = (uint32_t)op,
+        .jr_name_len = (uint32_t)strnlen(name, MAX_PATH_NAME - 1),
+        .jr_target_len = (uint32_t)strnlen(target, MAX_PATH_NAME - 1),
+    };
+    record.jr_checksum = journal_checksum(&record, name, target);
+    size_t len = sizeof(record) + record.jr_name_len + record.jr_target_len;
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&journal_lock) == 0,
+                "The journal's lock could not be locked.");
+    if (!journal_recording) {
+        ALWAYS_ASSERT(pthread_mutex_unlock(&journal_lock) == 0,
+                    "The journal's lock could not be unlocked.");
+        return 0;
+    }
+
+    if (journal_buffer_len + len > journal_buffer_size) {
+        size_t size = journal_buffer_size == 0 ? 4096 : journal_buffer_size;
+        while (journal_buffer_len + len > size) {
+            size *= 2;
+        }
+        char *buffer = realloc(journal_buffer, size);
+        ALWAYS_ASSERT(buffer != NULL, "journal_append: could not grow the buffer");
+        journal_buffer = buffer;
+        journal_buffer_size = size;
+    }
+
+    char *dest = journal_buffer + journal_buffer_len;
+    memcpy(dest, &record, sizeof(record));
+    memcpy(dest + sizeof(record), name, record.jr_name_len);
+    memcpy(dest + sizeof(record) + record.jr_name_len, target, record.jr_target_len);
+    journal_buffer_len += len;
+    uint64_t seq = ++journal_appended;
+
+    ALWAYS_ASSERT(pthread_mutex_unlock(&journal_lock) == 0,
+                "The journal's lock could not be unlocked.");
+    return seq;
+}
+
+int journal_commit(uint64_t seq) {
+    if (seq == 0) {
+        return 0; // Nothing was recorded.
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&journal_lock) == 0,
+                "The journal's lock could not be locked.");
+
+    while (journal_durable < seq && !journal_failed) {
+        if (journal_flushing) {
+            ALWAYS_ASSERT(pthread_cond_wait(&journal_flushed, &journal_lock) == 0,
+                        "The journal's condition could not be waited on.");
+            continue;
+        }
+
+        // Becomes the leader: flushes everything appended so far, letting
+        // other threads append to a new buffer meanwhile.
+        char *buffer = journal_buffer;
+        size_t len = journal_buffer_len;
+        uint64_t last = journal_appended;
+        journal_buffer = NULL;
+        journal_buffer_len = 0;
+        journal_buffer_size = 0;
+        journal_flushing = true;
+        ALWAYS_ASSERT(pthread_mutex_unlock(&journal_lock) == 0,
+                    "The journal's lock could not be unlocked.");
+
+        bool ok = journal_write(buffer, len) == 0 && fdatasync(journal_fd) == 0;
+        free(buffer);
+
+        ALWAYS_ASSERT(pthread_mutex_lock(&journal_lock) == 0,
+                    "The journal's lock could not be locked.");
+        journal_flushing = false;
+        if (ok) {
+            if (last > journal_durable) {
+                journal_durable = last;
+            }
+        } else {
+            journal_failed = true;
+        }
+        ALWAYS_ASSERT(pthread_cond_broadcast(&journal_flushed) == 0,
+                    "The journal's condition could not be broadcast.");
+    }
+
+    int result = journal_durable >= seq ? 0 : -1;
+    ALWAYS_ASSERT(pthread_mutex_unlock(&journal_lock) == 0,
+                "The journal's lock could not be unlocked.");
+    return result;
+}
@@ -0,0 +1,92 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Redo journal of the metadata operations done since the FS image was last
+ * written back (checkpointed). Each operation is recorded by name, so that
+ * recovery can redo it on top of the image. File contents are not journaled;
+ * they reach the image when it is checkpointed.
+ */
+
+/**
+ * Journaled operations.
+ */
+typedef enum {
+    JOURNAL_CREATE = 1, // name: file created by tfs_open
+    JOURNAL_TRUNCATE,   // name: file truncated by tfs_open
+    JOURNAL_MKDIR,      // name: directory created
+    JOURNAL_RMDIR,      // name: directory removed
+    JOURNAL_LINK,       // name: hard link created to target
+    JOURNAL_SYMLINK,    // name: symbolic link created to target
+    JOURNAL_UNLINK,     // name: link removed
+} journal_op_t;
+
+/**
+ * Open (or create) a journal. Nothing is recorded until journal_reset is
+ * called, so that its records can be replayed first.
+ *
+ * Input:
+ *   - path: the journal's path
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_open(char const *path);
+
+/**
+ * Redo the records of the journal, if they belong to a given checkpoint.
+ * Replay stops at the first incomplete (torn) record.
+ *
+ * Input:
+ *   - generation: the checkpoint the image is at
+ *   - apply: redoes an operation (target is NULL unless the operation has one)
+ *
+ * Returns the number of records replayed, or -1 if the journal could not be
+ * read.
+ */
+int journal_replay(uint64_t generation,
+                   void (*apply)(journal_op_t op, char const *name, char const *target));
+
+/**
+ * Empty the journal after a checkpoint, and start recording operations.
+ *
+ * Input:
+ *   - generation: the checkpoint the image is now at
+ *
+ * Returns 0 if successful (or if there is no journal), -1 otherwise.
+ */
+int journal_reset(uint64_t generation);
+
+/**
+ * Close the journal (operations are no longer recorded).
+ */
+void journal_close(void);
+
+/**
+ * Record an operation. It must be called while the operation still holds the
+ * locks that order it with conflicting operations, and the record only
+ * becomes durable after journal_commit.
+ *
+ * Input:
+ *   - op: the operation
+ *   - name: the path name it changed
+ *   - target: its target (for links), or NULL
+ *
+ * Returns the record's sequence number (0 if no journal is recording).
+ */
+uint64_t journal_append(journal_op_t op, char const *name, char const *target);
+
+/**
+ * Wait until a record (and every record before it) is durable. Records of
+ * concurrent operations are flushed together, with a single fsync.
+ *
+ * Input:
+ *   - seq: the sequence number returned by journal_append
+ *
+ * Returns 0 if successful, -1 if the journal could not be written.
+ */
+int journal_commit(uint64_t seq);
+
+#endif // JOURNAL_H
@@ -1,6 +1,7 @@
 #include "operations.h"
 #include "config.h"
 #include "state.h"
+#include "journal.h"
 #include "betterassert.h"
 
 #include <pthread.h>
@@ -17,10 +18,95 @@ tfs_params tfs_default_params() {
         .max_block_count = 1024,
         .max_open_files_count = 16,
         .block_size = 1024,
+        .image_path = NULL,
+        .data_mode = TFS_DATA_IN_MEMORY,
+        .data_populate = false,
+        .data_hugepages = false,
+        .latency = tfs_fixed_latency(TFS_LATENCY_NONE, 0),
+        .block_cache_blocks = 0,
     };
     return params;
 }
 
+tfs_latency_model tfs_fixed_latency(tfs_latency_mode mode, unsigned long ns) {
+    tfs_latency_model latency = {
+        .mode = mode,
+        .inode_ns = ns,
+        .directory_ns = ns,
+        .bitmap_ns = ns,
+        .block_ns = ns,
+    };
+    return latency;
+}
+
+/**
+ * Redoes an operation recorded in the journal. Those that fail were already
+ * in the image.
+ */
+static void tfs_journal_apply(journal_op_t op, char const *name, char const *target) {
+    int fd;
+    switch (op) {
+    case JOURNAL_CREATE:
+    case JOURNAL_TRUNCATE:
+        fd = tfs_open(name, op == JOURNAL_CREATE ? TFS_O_CREAT : TFS_O_TRUNC);
+        if (fd != -1) {
+            tfs_close(fd);
+        }
+        break;
+    case JOURNAL_MKDIR:
+        tfs_mkdir(name);
+        break;
+    case JOURNAL_RMDIR:
+        tfs_rmdir(name);
+        break;
+    case JOURNAL_LINK:
+        tfs_link(target, name);
+        break;
+    case JOURNAL_SYMLINK:
+        tfs_sym_link(target, name);
+        break;
+    case JOURNAL_UNLINK:
+        tfs_unlink(name);
+        break;
+    default:
+        break; // Unknown operation (from a newer version).
+    }
+}
+
+/**
+ * Opens the journal kept next to an image, redoes the operations it recorded
+ * since the image's last checkpoint, and starts recording new ones.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int tfs_journal_recover(char const *image_path) {
+    char *path = malloc(strlen(image_path) + sizeof(".journal"));
+    if (path == NULL) {
+        return -1;
+    }
+    strcpy(path, image_path);
+    strcat(path, ".journal");
+    int opened = journal_open(path);
+    free(path);
+    if (opened != 0) {
+        return -1;
+    }
+
+    int replayed = 0;
+    if (state_image_loaded()) {
+        replayed = journal_replay(state_image_generation(), tfs_journal_apply);
+        if (replayed == -1) {
+            return -1;
+        }
+    }
+
+    // A new image, or one with operations redone, is checkpointed right away.
+    if (!state_image_loaded() || replayed > 0) {
+        return tfs_sync();
+    }
+    return journal_reset(state_image_generation());
+}
+
 int tfs_init(tfs_params const *params_ptr) {
     tfs_params params;
     if (params_ptr != NULL) {
@@ -33,10 +119,19 @@ int tfs_init(tfs_params const *params_ptr) {
     if (state_init(params) != 0) {
         return -1;
     }
-    
-    // Create root inode.
-    int root = inode_create(T_DIRECTORY);
-    if (root != ROOT_DIR_INUM) {
+
+    // A mounted image already has its root directory.
+    if (!state_image_loaded()) {
+        // Create root inode.
+        int root = inode_create(T_DIRECTORY);
+        if (root != ROOT_DIR_INUM) {
+            return -1;
+        }
+    }
+
+    if (params.image_path != NULL && tfs_journal_recover(params.image_path) != 0) {
+        journal_close();
+        state_destroy();
         return -1;
     }
 
@@ -44,85 +139,195 @@ int tfs_init(tfs_params const *params_ptr) {
 }
 
 int tfs_destroy() {
-    if (state_destroy() != 0) {
+    // Snapshots are not part of the image: the blocks only they refer to are
+    // freed before it is written back.
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        snapshot_delete(i);
+    }
+
+    int synced = tfs_sync();
+    journal_close();
+    if (state_destroy() != 0 || synced != 0) {
         return -1;
     }
     return 0;
 }
 
+int tfs_sync(void) {
+    // The records in the journal are part of the new checkpoint.
+    if (state_sync() != 0) {
+        return -1;
+    }
+    return journal_reset(state_image_generation());
+}
+
 static bool valid_pathname(char const *name) {
     return name != NULL && strlen(name) > 1 && name[0] == '/'
-                && strlen(name) <= (MAX_FILE_NAME + 1);
+                && strlen(name) < MAX_PATH_NAME;
 }
 
 /**
- * Looks for a file.
+ * Copies the next component of a path name.
+ *
+ * Input:
+ *   - path: the path name, at the '/' that precedes the component
+ *   - component: destination buffer (with room for MAX_FILE_NAME characters)
+ *
+ * Returns a pointer to the rest of the path name (at the next '/', or at the
+ * end), or NULL if the component is empty or too long.
+ */
+static char const *next_path_component(char const *path, char *component) {
+    // Skip the '/' character.
+    path++;
+
+    size_t len = strcspn(path, "/");
+    if (len == 0 || len > MAX_FILE_NAME - 1) {
+        return NULL;
+    }
+
+    memcpy(component, path, len);
+    component[len] = '\0';
+    return path + len;
+}
+
+/**
+ * Looks for the directory that contains a file, and locks it.
  *
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported.
+ * The path is walked from the root directory one component at a time, with
+ * hand-over-hand locking: each directory is locked before the directory that
+ * contains it is unlocked, so no directory on the path can be removed during
+ * the walk, while operations in other subtrees proceed in parallel. The
+ * directories along the way are locked for reading; the one that contains the
+ * file is locked in the requested mode.
+ *
+ * Input:
+ *   - name: absolute path name of the file
+ *   - mode: true for read; false for write;
+ *   - file_name: where to store the file's name inside the directory (with
+ *     room for MAX_FILE_NAME characters)
+ *
+ * Returns the locked directory inode, or NULL if unsuccessful.
+ */
+static inode_t *tfs_lookup_dir(char const *name, bool mode, char *file_name) {
+    if (!valid_pathname(name)) {
+        return NULL;
+    }
+
+    char const *rest = next_path_component(name, file_name);
+    if (rest == NULL) {
+        return NULL;
+    }
+
+    inode_t *dir = root_inode(*rest == '\0' ? mode : true);
+
+    // While there are components left, the last one names a sub directory.
+    while (*rest != '\0') {
+        int sub_inumber = find_in_dir(dir, file_name);
+        char const *next = next_path_component(rest, file_name);
+        if (sub_inumber == -1 || next == NULL) {
+            inode_unlock(dir);
+            return NULL;
+        }
+
+        inode_t *sub_dir = inode_get(sub_inumber, *next == '\0' ? mode : true);
+        inode_unlock(dir);
+        if (sub_dir->i_node_type != T_DIRECTORY) {
+            inode_unlock(sub_dir);
+            return NULL;
+        }
+
+        dir = sub_dir;
+        rest = next;
+    }
+
+    return dir;
+}
+
+/**
+ * Looks for a file.
  *
  * Input:
  *   - name: absolute path name
- *   - root_inode: the root directory inode
  * Returns the inumber of the file, -1 if unsuccessful.
  */
-static int tfs_lookup(char const *name, inode_t const *root_inode) {
-
-    ALWAYS_ASSERT(root_inode->i_data_block == 0, 
-                "The inode_t argument does not correspond to the root inode.");
+static int tfs_lookup(char const *name) {
+    char file_name[MAX_FILE_NAME];
 
-    if (!valid_pathname(name)) {
+    inode_t *dir = tfs_lookup_dir(name, true, file_name);
+    if (dir == NULL) {
         return -1;
     }
 
-    // Skip the initial '/' character.
-    name++;
-    return find_in_dir(root_inode, name);
+    int inum = find_in_dir(dir, file_name);
+    inode_unlock(dir);
+    return inum;
 }
 
 int tfs_open(char const *name, tfs_file_mode_t mode) {
-
-    // Checks if the path name is valid.
-    if (!valid_pathname(name)) {
+    char file_name[MAX_FILE_NAME];
+
+    // Finds (and locks) the directory that contains the file. Also checks if
+    // the path name is valid. Opening an existing file does not change the
+    // directory, so it is only locked for reading; if the file has to be
+    // created, it is locked again for writing.
+    inode_t *dir = tfs_lookup_dir(name, true, file_name);
+    if (dir == NULL) {
         return -1;
     }
 
-    inode_t * root = root_inode(false);
+    int inum = find_in_dir(dir, file_name);
+    if (inum == -1 && (mode & TFS_O_CREAT)) {
+        inode_unlock(dir);
+
+        dir = tfs_lookup_dir(name, false, file_name);
+        if (dir == NULL) {
+            return -1;
+        }
+
+        // Another thread may have created the file in the meantime.
+        inum = find_in_dir(dir, file_name);
+    }
 
-    int inum = tfs_lookup(name, root);
     size_t offset;
+    uint64_t seq = 0; // Journal record of the change made (if any).
 
     if (inum >= 0) {
 
-        // The file already exists.
-        inode_t *inode = inode_get(inum, false);
+        // The file already exists. Its inode only changes if it is truncated.
+        inode_t *inode = inode_get(inum, !(mode & TFS_O_TRUNC));
         ALWAYS_ASSERT(inode != NULL, "tfs_open: directory files must have an inode");
 
         // Checks if the inode belongs to a symbolic link and recursively
         // looks for the final target.
         if (inode->i_node_type == T_SYMLINK) {
+            char target[MAX_PATH_NAME];
+            strcpy(target, inode_sym_path(inode));
 
-            ALWAYS_ASSERT(pthread_rwlock_unlock(&inode->inode_lock) == 0, 
-                        "Could not unlock the inode.");
+            inode_unlock(inode);
+            inode_unlock(dir);
 
-            if (tfs_lookup(inode->sym_path, root) == -1) {
+            if (tfs_lookup(target) == -1) {
                 fprintf(stderr, "The file linked to this symbolic link has been deleted!.\n");
-                ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                            "Could not unlock the root inode.");
                 return -1;
             }
 
-            ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                        "Could not unlock the root inode.");
-            return tfs_open(inode->sym_path, mode);
+            return tfs_open(target, mode);
+        }
+
+        // Directories can not be opened.
+        if (inode->i_node_type == T_DIRECTORY) {
+            inode_unlock(inode);
+            inode_unlock(dir);
+            return -1;
         }
 
         // Truncate (if requested).
         if (mode & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                data_block_free(inode->i_data_block);
-                inode->i_size = 0;
-            }
+            inode_seq_write_begin(inode);
+            inode_blocks_free(inode);
+            INODE_SEQ_STORE(inode->i_size, 0);
+            inode_seq_write_end(inode);
+            seq = journal_append(JOURNAL_TRUNCATE, name, NULL);
         }
 
         // Determine initial offset.
@@ -133,42 +338,49 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
             offset = 0;
         }
         
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&inode->inode_lock) == 0, "Could not unlock the inode.");
+        inode_unlock(inode);
     }
     else if (mode & TFS_O_CREAT) {
 
         // The file does not exist; the mode specified that it should be created.
         // Create inode.
+        state_mutation_begin();
         inum = inode_create(T_FILE);
         if (inum == -1)
         {
-            ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                        "Could not unlock the root inode.");
+            state_mutation_end();
+            inode_unlock(dir);
             return -1; // No space in inode table.
         }
 
-        // Add entry in the root directory
-        if (add_dir_entry(root, name + 1, inum) == -1)
+        // Add entry in the directory
+        if (add_dir_entry(dir, file_name, inum) == -1)
         {
             inode_delete(inum);
-            ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                        "Could not unlock the root inode.");
+            state_mutation_end();
+            inode_unlock(dir);
             return -1; // No space in directory.
         }
+        state_mutation_end();
+        seq = journal_append(JOURNAL_CREATE, name, NULL);
         offset = 0;
     }
     else {
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                    "Could not unlock the root inode.");
+        inode_unlock(dir);
         return -1;
     }
 
-    ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                "Could not unlock the root inode.");
-
     // Finally, add entry to the open file table and return the corresponding
-    // handle.
-    return add_to_open_file_table(inum, offset);
+    // handle. This is done before unlocking the directory, so tfs_unlink
+    // (which locks it for writing) sees the file as open.
+    int fhandle = add_to_open_file_table(inum, offset);
+    inode_unlock(dir);
+
+    if (journal_commit(seq) != 0 && fhandle != -1) {
+        tfs_close(fhandle);
+        return -1;
+    }
+    return fhandle;
 
     // Note: for simplification, if file was created with TFS_O_CREAT and there
     // is an error adding an entry to the open file table, the file is not
@@ -176,33 +388,28 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
 }
 
 int tfs_sym_link(char const *target, char const *link_name) {
-    
-    inode_t * root = root_inode(false);
-    
-    // Checks if this link already exists.
-    if (tfs_lookup(link_name, root) == 0) {
-        fprintf(stderr, "This file already exists. Please try a different name.\n");
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                    "Could not unlock the root inode.");
+
+    // Checks if the target file exists.
+    if (tfs_lookup(target) == -1) {
+        fprintf(stderr, "The target was not found. "
+                    "Please make sure you entered the correct path name.\n");
         return -1;
     }
 
-    // Checks is the link name is valid.
-    if (!valid_pathname(link_name)) {
+    // Finds (and locks) the directory where the link will be created. Also
+    // checks if the link name is valid.
+    char file_name[MAX_FILE_NAME];
+    inode_t *dir = tfs_lookup_dir(link_name, false, file_name);
+    if (dir == NULL) {
         fprintf(stderr, "The link name you entered in invalid. "
                     "Please try using the following format: /...\n");
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                    "Could not unlock the root inode.");
         return -1;
     }
-    // Checks if the target file is in the root directory.
-    if (tfs_lookup(target, root) == -1) {
-
-        fprintf(stderr, "The target was not found in the root directory. "
-                    "Please make sure you entered the correct path name.\n");
 
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                    "Could not unlock the root inode.");
+    // Checks if this link already exists.
+    if (find_in_dir(dir, file_name) != -1) {
+        fprintf(stderr, "This file already exists. Please try a different name.\n");
+        inode_unlock(dir);
         return -1;
     }
 
@@ -211,8 +418,7 @@ int tfs_sym_link(char const *target, char const *link_name) {
     int link_inumber = inode_create(T_SYMLINK);
     if (link_inumber == -1) {
         fprintf(stderr, "There are no more free slots in the inode table.\n");
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                    "Could not unlock the root inode.");
+        inode_unlock(dir);
         return -1;
     }
 
@@ -220,111 +426,130 @@ int tfs_sym_link(char const *target, char const *link_name) {
     inode_t *link_inode = inode_get(link_inumber, false);
     ALWAYS_ASSERT(link_inode != NULL, "Couldn't fetch link's inode.");
 
-    // Copy the target path to the sym_path variable in the inode.
-    link_inode->sym_path = (char *)malloc(strlen(target));
-    strcpy(link_inode->sym_path, target);
-    ALWAYS_ASSERT(pthread_rwlock_unlock(&link_inode->inode_lock) == 0, 
-                "Could not unlock the link inode.");
-
-    // Remove the '/' from the link name
-    link_name++;
-    // Add the symbolic link to the root directory while checking it any
-    // errors occured.
-    if (add_dir_entry(root, link_name, link_inumber) == -1) {
-        fprintf(stderr, "There was a problem adding %s to the root directory.\n", link_name);
+    // Copy the target path to the link's inode.
+    ALWAYS_ASSERT(inode_set_sym_path(link_inode, target) == 0,
+                "Couldn't allocate the link's path.");
+    inode_unlock(link_inode);
+
+    // Add the symbolic link to the directory while checking it any errors
+    // occured (the mutation barrier is taken after the inode locks).
+    state_mutation_begin();
+    if (add_dir_entry(dir, file_name, link_inumber) == -1) {
+        fprintf(stderr, "There was a problem adding %s to the directory.\n", file_name);
+        inode_delete(link_inumber);
+        state_mutation_end();
+        inode_unlock(dir);
+        return -1;
     }
+    state_mutation_end();
 
-    ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                "Could not unlock the root inode.");
+    uint64_t seq = journal_append(JOURNAL_SYMLINK, link_name, target);
+    inode_unlock(dir);
 
-    return 0;
+    return journal_commit(seq);
 }
 
 int tfs_link(char const *target, char const *link_name) {
 
-    inode_t * root = root_inode(false);
+    // Finds (and locks) the directory that contains the target, and retrieves
+    // the number of the inode (inumber) of the target file.
+    char file_name[MAX_FILE_NAME];
+    inode_t *target_dir = tfs_lookup_dir(target, true, file_name);
+    int target_inumber = target_dir == NULL ? -1 : find_in_dir(target_dir, file_name);
+    if (target_inumber == -1) {
+        fprintf(stderr, "The target file %s couldn't be found in the TécnicoFS. "
+                    "Please check if you inserted the correct path.\n", target);
+        if (target_dir != NULL) {
+            inode_unlock(target_dir);
+        }
+        return -1;
+    }
 
-    // Checks if this link already exists.
-    if (tfs_lookup(link_name, root) == 0) {
-        fprintf(stderr, "This file already exists. Please try a different name.\n");
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                    "Could not unlock the root inode.");
+    // Checks if the target inode is a symbolic link or a directory before
+    // the link's directory is locked (a directory may be that one, or one
+    // above it, which are locked before it on the way down).
+    inode_t *target_inode = inode_get(target_inumber, true);
+    inode_type target_type = target_inode->i_node_type;
+    inode_unlock(target_inode);
+    if (target_type == T_SYMLINK) {
+        fprintf(stderr, "Unable to proceed. Reason: target file is a soft link.\n");
+        inode_unlock(target_dir);
         return -1;
     }
-    
-    // Checks is the link name is valid.
-    if (!valid_pathname(link_name)) {
-        fprintf(stderr, "The link name you entered in invalid. "
-                    "Please try using the following format: /...\n");
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                    "Could not unlock the root inode.");
+    if (target_type == T_DIRECTORY) {
+        fprintf(stderr, "Unable to proceed. Reason: target file is a directory.\n");
+        inode_unlock(target_dir);
         return -1;
     }
 
-    // Retrieves the number of the inode (inumber) of the target file.
-    // Also checks if any errors occured while looking for the inumber.
-    int target_inumber = tfs_lookup(target, root);
-    if (target_inumber == -1) {
-        fprintf(stderr, "The target file %s couldn't be found in the TécnicoFS. "
-                    "Please check if you inserted the correct path.\n", target);
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                    "Could not unlock the root inode.");
+    // The target's directory is unlocked before the link's is locked (either
+    // may be above the other), so the target is pinned meanwhile: it can not
+    // be deleted, and its inode reused for another file.
+    inode_pin(target_inumber);
+    inode_unlock(target_dir);
+
+    // Finds (and locks) the directory where the link will be created. Also
+    // checks if the link name is valid.
+    inode_t *dir = tfs_lookup_dir(link_name, false, file_name);
+    if (dir == NULL) {
+        fprintf(stderr, "The link name you entered in invalid. "
+                    "Please try using the following format: /...\n");
+        inode_unpin(target_inumber);
         return -1;
     }
 
-    // Retrieves the target inode and checks if it could be found.
-    inode_t *target_inode = inode_get(target_inumber, false);
-    ALWAYS_ASSERT(target_inode != NULL, "Target inode was not found.");
-
-    // Checks if the target inode is a symbolic link.
-    if (target_inode->i_node_type == T_SYMLINK) {
-        fprintf(stderr, "Unable to proceed. Reason: target file is a soft link.\n");
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&target_inode->inode_lock) == 0, 
-                    "Could not unlock the target inode.");
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                    "Could not unlock the root inode.");
+    // Checks if this link already exists.
+    if (find_in_dir(dir, file_name) != -1) {
+        fprintf(stderr, "This file already exists. Please try a different name.\n");
+        inode_unlock(dir);
+        inode_unpin(target_inumber);
         return -1;
     }
 
-    // Removes the "/" from the link_name.
-    link_name++;
+    // Retrieves the target inode (still the file found above).
+    target_inode = inode_get(target_inumber, false);
+    ALWAYS_ASSERT(target_inode->hard_link_counter > 0, "tfs_link: the target was deleted");
 
-    // Adds an entry to the root directory with the altered link_name and sets
-    // its inumber (d_inumber) to the target's inumber.
+    // Adds an entry to the directory with the link's name and sets its
+    // inumber (d_inumber) to the target's inumber.
     // Also checks if any problems occured.
-    if (add_dir_entry(root, link_name, target_inumber) == -1) {
-        fprintf(stderr, "There was a problem adding %s to the root directory.\n", link_name);
-
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&target_inode->inode_lock) == 0, 
-                    "Could not unlock the target inode.");
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                    "Could not unlock the root inode.");
+    state_mutation_begin();
+    if (add_dir_entry(dir, file_name, target_inumber) == -1) {
+        fprintf(stderr, "There was a problem adding %s to the directory.\n", file_name);
+        state_mutation_end();
+        inode_unlock(target_inode);
+        inode_unlock(dir);
+        inode_unpin(target_inumber);
         return -1;
     }
 
     // Increases the target file's hard link count by 1.
     target_inode->hard_link_counter++;
-    ALWAYS_ASSERT(pthread_rwlock_unlock(&target_inode->inode_lock) == 0, 
-                "Could not unlock the target inode.");
+    state_mutation_end();
+    inode_unlock(target_inode);
+    inode_unpin(target_inumber);
 
-    ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                "Could not unlock the root inode.");
+    uint64_t seq = journal_append(JOURNAL_LINK, link_name, target);
+    inode_unlock(dir);
 
-    return 0;
+    return journal_commit(seq);
 }
 
 int tfs_unlink(char const *target) {
 
-    inode_t * root = root_inode(false);
-    
+    // Finds (and locks) the directory that contains the target.
+    char file_name[MAX_FILE_NAME];
+    inode_t *dir = tfs_lookup_dir(target, false, file_name);
+
     // Retrieves the number of the inode (inumber) of the target file.
     // Also checks if any errors occured while looking for the inumber.
-    int target_inumber = tfs_lookup(target, root);
+    int target_inumber = dir == NULL ? -1 : find_in_dir(dir, file_name);
     if (target_inumber == -1) {
         fprintf(stderr, "The target file %s couldn't be found in the TécnicoFS. "
                     "Please check if you inserted the correct path.\n", target);
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                    "Could not unlock the root inode.");
+        if (dir != NULL) {
+            inode_unlock(dir);
+        }
         return -1;
     }
 
@@ -332,6 +557,24 @@ int tfs_unlink(char const *target) {
     inode_t *target_inode = inode_get(target_inumber, false);
     ALWAYS_ASSERT(target_inode != NULL, "Target inode was not found.\n");
 
+    // Directories are removed with tfs_rmdir.
+    if (target_inode->i_node_type == T_DIRECTORY) {
+        fprintf(stderr, "The target %s is a directory.\n", target);
+        inode_unlock(target_inode);
+        inode_unlock(dir);
+        return -1;
+    }
+
+    // The directory's entries are copied first if they are shared with a
+    // snapshot, so that removing the entry can not fail after the file is.
+    state_mutation_begin();
+    if (!inode_block_unshare(dir, 0)) {
+        state_mutation_end();
+        inode_unlock(target_inode);
+        inode_unlock(dir);
+        return -1;
+    }
+
     // Option where the file is completely removed and won't be accesible
     // anymore.
     if (target_inode->hard_link_counter == 1 &&
@@ -339,55 +582,125 @@ int tfs_unlink(char const *target) {
          if (is_file_open(target_inumber)) {
             fprintf(stderr, "The file you are trying to delete is currently open. "
                         "Please close it and try again.\n");
-            ALWAYS_ASSERT(pthread_rwlock_unlock(&target_inode->inode_lock) == 0,
-                        "Could not unlock the target inode.");
-            ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                        "Could not unlock the root inode.");
+            state_mutation_end();
+            inode_unlock(target_inode);
+            inode_unlock(dir);
             return -1;
         }
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&target_inode->inode_lock) == 0, 
-                    "Could not unlock the target inode.");
+        inode_unlock(target_inode);
         inode_delete(target_inumber);
 
     // Checks if the target inode is a symbolic link.
     } else if (target_inode->i_node_type == T_SYMLINK) {
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&target_inode->inode_lock) == 0, 
-                    "Could not unlock the target inode.");
+        inode_unlock(target_inode);
         inode_delete(target_inumber);
 
     // Else, if the target inode still has multiple hard links, decreases its
     // count by 1.
     } else if (target_inode->hard_link_counter > 1) {
         target_inode->hard_link_counter--;
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&target_inode->inode_lock) == 0, 
-                    "Could not unlock the target inode.");
+        inode_unlock(target_inode);
     } else {
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&target_inode->inode_lock) == 0, 
-                    "Could not unlock the target inode.");
-        ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                    "Could not unlock the root inode.");
+        state_mutation_end();
+        inode_unlock(target_inode);
+        inode_unlock(dir);
         return -1;
     }
 
-    // Removes the "/" from the target name.
-    target++;
-
     // Removes the target entry from the directory's entries while
     // assessing if it has been done correctly.
-    ALWAYS_ASSERT(clear_dir_entry(root, target) == 0, 
+    ALWAYS_ASSERT(clear_dir_entry(dir, file_name) == 0, 
                 "Could not remove the link file from the directory.");
+    state_mutation_end();
     
-    ALWAYS_ASSERT(pthread_rwlock_unlock(&root->inode_lock) == 0, 
-                "Could not unlock the root inode.");
+    uint64_t seq = journal_append(JOURNAL_UNLINK, target, NULL);
+    inode_unlock(dir);
 
-    return 0;
+    return journal_commit(seq);
+}
+
+int tfs_mkdir(char const *name) {
+    char file_name[MAX_FILE_NAME];
+
+    // Finds (and locks) the directory where the new one will be created. Also
+    // checks if the path name is valid.
+    inode_t *dir = tfs_lookup_dir(name, false, file_name);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    // Checks if the name is already taken.
+    if (find_in_dir(dir, file_name) != -1) {
+        inode_unlock(dir);
+        return -1;
+    }
+
+    state_mutation_begin();
+    int inum = inode_create(T_DIRECTORY);
+    if (inum == -1) {
+        state_mutation_end();
+        inode_unlock(dir);
+        return -1; // No space in inode table or no free data blocks.
+    }
+
+    if (add_dir_entry(dir, file_name, inum) == -1) {
+        inode_delete(inum);
+        state_mutation_end();
+        inode_unlock(dir);
+        return -1; // No space in directory.
+    }
+    state_mutation_end();
+
+    uint64_t seq = journal_append(JOURNAL_MKDIR, name, NULL);
+    inode_unlock(dir);
+    return journal_commit(seq);
+}
+
+int tfs_rmdir(char const *name) {
+    char file_name[MAX_FILE_NAME];
+
+    // Finds (and locks) the directory that contains the one to remove.
+    inode_t *dir = tfs_lookup_dir(name, false, file_name);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int inum = find_in_dir(dir, file_name);
+    if (inum == -1) {
+        inode_unlock(dir);
+        return -1;
+    }
+
+    // Waits for any walk that is still inside the directory to leave it.
+    inode_t *inode = inode_get(inum, false);
+    if (inode->i_node_type != T_DIRECTORY || !dir_is_empty(inode)) {
+        inode_unlock(inode);
+        inode_unlock(dir);
+        return -1;
+    }
+    inode_unlock(inode);
+
+    // The parent's entries are copied first if they are shared with a
+    // snapshot, so that removing the entry can not fail.
+    state_mutation_begin();
+    if (!inode_block_unshare(dir, 0)) {
+        state_mutation_end();
+        inode_unlock(dir);
+        return -1;
+    }
+    ALWAYS_ASSERT(clear_dir_entry(dir, file_name) == 0, 
+                "Could not remove the directory from its parent.");
+    inode_delete(inum);
+    state_mutation_end();
+
+    uint64_t seq = journal_append(JOURNAL_RMDIR, name, NULL);
+    inode_unlock(dir);
+    return journal_commit(seq);
 }
 
 int tfs_close(int fhandle) {
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
-        ALWAYS_ASSERT(pthread_mutex_unlock(&file->open_file_lock) == 0, 
-                    "Could not unlock the file's lock.");
         return -1; // Invalid fd.
     }
 
@@ -395,11 +708,459 @@ int tfs_close(int fhandle) {
     return 0;
 }
 
+/**
+ * Obtains the contents of a file kept in its inode or in fragments.
+ *
+ * Input:
+ *   - inode: the file's inode (locked)
+ *   - dirty: whether the caller changes the contents
+ *
+ * Returns a pointer to the first byte of the file, or NULL if its contents are
+ * kept in data blocks.
+ */
+static char *inode_small_contents(inode_t const *inode, bool dirty) {
+    if (inode->i_inline_data) {
+        return (char *)inode->i_inline;
+    }
+    if (inode->i_fragment_count > 0) {
+        return inode_fragments_get(inode, dirty);
+    }
+    return NULL;
+}
+
+/**
+ * Makes room for a file to grow to a given size: contents that outgrow the
+ * inode move to fragments, and contents that outgrow their fragments move to
+ * more fragments (extending them in place if possible) or to data blocks.
+ * Contents in data blocks never move back (until the file is truncated).
+ *
+ * Input:
+ *   - inode: the file's inode (locked for writing)
+ *   - size: the size the file must be able to grow to
+ *
+ * Returns true if successful, false if the file system ran out of data blocks
+ * or memory (in which case the contents were left where they were).
+ */
+static bool inode_make_room(inode_t *inode, size_t size) {
+    size_t fragment_size = state_fragment_size();
+    size_t fragments = fragment_size == 0 ? FRAGMENTS_PER_BLOCK
+                                          : (size + fragment_size - 1) / fragment_size;
+
+    if (inode->i_inline_data ? size <= INODE_INLINE_SIZE
+                             : inode->i_fragment_count == 0 ||
+                                   fragments <= inode->i_fragment_count) {
+        return true;
+    }
+
+    int block = inode->i_direct_blocks[0];
+    size_t first = inode->i_first_fragment;
+    size_t count = inode->i_fragment_count;
+    if (count > 0 && fragments < FRAGMENTS_PER_BLOCK &&
+        data_fragments_extend(block, first, count, fragments)) {
+        inode->i_fragment_count = (uint8_t)fragments;
+        return true;
+    }
+
+    // Fragments that are alone in their block take all of it.
+    if (count > 0 && fragments >= FRAGMENTS_PER_BLOCK &&
+        data_fragments_promote(block, first, count)) {
+        char *contents = data_block_get(block, true);
+        seq_copy_in(contents, contents + first * fragment_size, inode->i_size);
+        inode->i_fragment_count = 0;
+        INODE_SEQ_STORE(inode->i_first_fragment, 0);
+        return true;
+    }
+
+    // Saves the contents, as the block map takes the place of inline contents.
+    char *saved = malloc(inode->i_size > 0 ? inode->i_size : 1);
+    if (saved == NULL) {
+        return false;
+    }
+    bool was_inline = inode->i_inline_data;
+    size_t used = inode->i_size;
+    memcpy(saved, inode_small_contents(inode, false), used);
+
+    INODE_SEQ_STORE(inode->i_inline_data, false);
+    inode->i_fragment_count = 0;
+    INODE_SEQ_STORE(inode->i_first_fragment, 0);
+    INODE_SEQ_STORE(inode->i_direct_blocks[0], -1);
+    if (fragments < FRAGMENTS_PER_BLOCK) {
+        size_t new_first;
+        int new_block = data_fragments_alloc(fragments, &new_first);
+        if (new_block != -1) {
+            INODE_SEQ_STORE(inode->i_direct_blocks[0], new_block);
+            INODE_SEQ_STORE(inode->i_first_fragment, (uint8_t)new_first);
+            inode->i_fragment_count = (uint8_t)fragments;
+        }
+    } else {
+        inode_blocks_reserve(inode, 0, 1);
+    }
+
+    if (inode->i_direct_blocks[0] == -1) {
+        // Puts the contents back.
+        INODE_SEQ_STORE(inode->i_inline_data, was_inline);
+        if (was_inline) {
+            seq_copy_in(inode->i_inline, saved, used);
+        } else {
+            INODE_SEQ_STORE(inode->i_direct_blocks[0], block);
+            INODE_SEQ_STORE(inode->i_first_fragment, (uint8_t)first);
+            inode->i_fragment_count = (uint8_t)count;
+        }
+        free(saved);
+        return false;
+    }
+
+    char *contents = inode->i_fragment_count > 0
+                         ? inode_fragments_get(inode, true)
+                         : data_block_get(inode->i_direct_blocks[0], true);
+    seq_copy_in(contents, saved, used);
+    free(saved);
+    if (count > 0) {
+        data_fragments_free(block, first, count);
+    }
+    return true;
+}
+
+/**
+ * Copies bytes into a file, allocating its blocks as needed.
+ *
+ * Input:
+ *   - inode: the file's inode (locked for writing)
+ *   - buffer: the bytes to copy, or NULL to write zeros
+ *   - to_write: number of bytes to copy
+ *   - offset: where to start writing (at most the file's size)
+ *
+ * Returns the number of bytes that were written (lower than 'to_write' if the
+ * file system runs out of data blocks).
+ */
+static size_t inode_copy_in(inode_t *inode, void const *buffer, size_t to_write,
+                            size_t offset) {
+    if (!inode_make_room(inode, offset + to_write)) {
+        return 0; // no space
+    }
+
+    // Fragments in a block shared with a snapshot move before they are written.
+    if (!inode_fragments_unshare(inode)) {
+        return 0; // no space
+    }
+
+    char *contents = inode_small_contents(inode, true);
+    if (contents != NULL) {
+        seq_copy_in(contents + offset, buffer, to_write);
+        if (offset + to_write > inode->i_size) {
+            INODE_SEQ_STORE(inode->i_size, offset + to_write);
+        }
+        return to_write;
+    }
+
+    // Allocates the blocks needed for the whole write up front, so that they
+    // are contiguous whenever possible. If not all of them can be allocated,
+    // the write stops at the first missing block.
+    size_t block_size = state_block_size();
+    if (to_write > 0) {
+        size_t first_block = offset / block_size;
+        size_t last_block = (offset + to_write - 1) / block_size;
+        size_t end = offset + to_write;
+
+        // Holes that the write only covers in part must read as zeros around
+        // it once they are allocated (past the end of the file, they need not).
+        size_t run;
+        bool zero_first = offset % block_size != 0 &&
+                          inode_block_run(inode, first_block, &run) == -1;
+        bool zero_last = end % block_size != 0 && end < inode->i_size &&
+                         (last_block != first_block || !zero_first) &&
+                         inode_block_run(inode, last_block, &run) == -1;
+
+        inode_blocks_reserve(inode, first_block, last_block - first_block + 1);
+
+        int bnum = inode_block_run(inode, first_block, &run);
+        if (zero_first && bnum != -1) {
+            memset(data_block_get(bnum, true), 0, block_size);
+        }
+        bnum = inode_block_run(inode, last_block, &run);
+        if (zero_last && bnum != -1) {
+            memset(data_block_get(bnum, true), 0, block_size);
+        }
+    }
+
+    // Walks the block map, one run of contiguous blocks at a time (or one
+    // block at a time, while blocks may be shared with snapshots: those are
+    // copied before they are written).
+    bool shared = state_blocks_shared();
+    size_t written = 0;
+    while (written < to_write) {
+        if (shared && !inode_block_unshare(inode, offset / block_size)) {
+            break; // no space
+        }
+
+        size_t run;
+        int bnum = inode_block_run(inode, offset / block_size, &run);
+        if (bnum == -1) {
+            break; // no space
+        }
+        if (shared) {
+            run = 1;
+        }
+
+        size_t block_offset = offset % block_size;
+        size_t chunk = run * block_size - block_offset;
+        if (chunk > to_write - written) {
+            chunk = to_write - written;
+        }
+
+        size_t blocks = (block_offset + chunk + block_size - 1) / block_size;
+        void *block = data_blocks_get(bnum, blocks, true);
+        ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
+
+        // Perform the actual write (the first block may be read optimistically
+        // meanwhile, if the file is small).
+        size_t shared_bytes = offset < block_size ? block_size - offset : 0;
+        if (shared_bytes > chunk) {
+            shared_bytes = chunk;
+        }
+        seq_copy_in(block + block_offset,
+                    buffer != NULL ? buffer + written : NULL, shared_bytes);
+        if (buffer != NULL) {
+            memcpy(block + block_offset + shared_bytes,
+                   buffer + written + shared_bytes, chunk - shared_bytes);
+        } else {
+            memset(block + block_offset + shared_bytes, 0, chunk - shared_bytes);
+        }
+        written += chunk;
+
+        offset += chunk;
+        if (offset > inode->i_size) {
+            INODE_SEQ_STORE(inode->i_size, offset);
+        }
+    }
+
+    return written;
+}
+
+/**
+ * Grows a file with zeros, ahead of a write past its end. Only the contents
+ * kept inline or in fragments and the block holding the end of the file are
+ * filled: the blocks past it are left as holes, allocated when written.
+ *
+ * Input:
+ *   - inode: the file's inode (locked for writing)
+ *   - size: the new size of the file (greater than its current size)
+ *   - write_end: where the write that follows ends
+ *
+ * Returns true if successful, false if the file system ran out of data blocks.
+ */
+static bool inode_grow(inode_t *inode, size_t size, size_t write_end) {
+    size_t block_size = state_block_size();
+    size_t old_size = inode->i_size;
+
+    if (inode->i_inline_data || inode->i_fragment_count > 0) {
+        // Files that stay within a block are small enough to be filled.
+        if (write_end <= block_size) {
+            return inode_copy_in(inode, NULL, size - old_size, old_size) ==
+                   size - old_size;
+        }
+
+        // Otherwise, their contents move to the first block (empty files have
+        // none to move).
+        if (old_size == 0) {
+            INODE_SEQ_STORE(inode->i_inline_data, false);
+        } else if (!inode_make_room(inode, block_size)) {
+            return false;
+        }
+    }
+
+    // The block holding the end of the file may have stale bytes past it.
+    size_t block_offset = old_size % block_size;
+    if (block_offset != 0 && !inode_block_unshare(inode, old_size / block_size)) {
+        return false;
+    }
+    size_t run;
+    int bnum = inode_block_run(inode, old_size / block_size, &run);
+    if (block_offset != 0 && bnum != -1) {
+        size_t stop = block_size;
+        if (size - old_size < block_size - block_offset) {
+            stop = block_offset + (size - old_size);
+        }
+        seq_copy_in((char *)data_block_get(bnum, true) + block_offset, NULL,
+                    stop - block_offset);
+    }
+
+    INODE_SEQ_STORE(inode->i_size, size);
+    return true;
+}
+
+/**
+ * Writes to a file at a given offset.
+ *
+ * Input:
+ *   - inode: the file's inode (locked for writing)
+ *   - buffer: buffer containing the contents to write
+ *   - to_write: length of the buffer contents (in bytes)
+ *   - offset: where to start writing; if past the end of the file, the gap
+ *     reads as zeros (as a hole, for whole blocks)
+ *
+ * Returns the number of bytes that were written, or -1 if none could be
+ * written for lack of space.
+ */
+static ssize_t inode_write_at(inode_t *inode, void const *buffer, size_t to_write,
+                              size_t offset) {
+    // Determine how many bytes to write
+    size_t max_file_size = state_max_file_size();
+    if (offset >= max_file_size) {
+        to_write = 0;
+    } else if (to_write > max_file_size - offset) {
+        to_write = max_file_size - offset;
+    }
+
+    if (to_write == 0) {
+        return 0;
+    }
+
+    inode_seq_write_begin(inode);
+
+    if (offset > inode->i_size && !inode_grow(inode, offset, offset + to_write)) {
+        inode_seq_write_end(inode);
+        return -1; // no space
+    }
+
+    size_t written = inode_copy_in(inode, buffer, to_write, offset);
+    inode_seq_write_end(inode);
+    if (written == 0) {
+        return -1; // no space
+    }
+
+    return (ssize_t)written;
+}
+
+/**
+ * Reads from a file at a given offset.
+ *
+ * Input:
+ *   - inode: the file's inode (locked)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: where to start reading
+ *
+ * Returns the number of bytes that were read (0 if the offset is at or past
+ * the end of the file).
+ */
+static size_t inode_read_at(inode_t const *inode, void *buffer, size_t len,
+                            size_t offset) {
+    // Determine how many bytes to read
+    if (offset >= inode->i_size) {
+        return 0;
+    }
+    size_t to_read = inode->i_size - offset;
+    if (to_read > len) {
+        to_read = len;
+    }
+
+    char const *contents = inode_small_contents(inode, false);
+    if (contents != NULL) {
+        memcpy(buffer, contents + offset, to_read);
+        return to_read;
+    }
+
+    // Walks the block map, one run of contiguous blocks at a time.
+    size_t block_size = state_block_size();
+    size_t done = 0;
+    while (done < to_read) {
+        size_t run;
+        int bnum = inode_block_run(inode, offset / block_size, &run);
+
+        size_t block_offset = offset % block_size;
+        size_t chunk = run * block_size - block_offset;
+        if (chunk > to_read - done) {
+            chunk = to_read - done;
+        }
+
+        // Perform the actual read (holes read as zeros, without touching any
+        // data block)
+        if (bnum == -1) {
+            memset(buffer + done, 0, chunk);
+        } else {
+            size_t blocks = (block_offset + chunk + block_size - 1) / block_size;
+            void *block = data_blocks_get(bnum, blocks, false);
+            ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
+            memcpy(buffer + done, block + block_offset, chunk);
+        }
+        done += chunk;
+        offset += chunk;
+    }
+
+    return to_read;
+}
+
+/**
+ * Reads from a small file (at most one block long) at a given offset, without
+ * locking its inode.
+ *
+ * The read is validated with the inode's sequence counter and retried if a
+ * writer was active meanwhile, so concurrent readers do not contend on the
+ * inode's lock.
+ *
+ * Input:
+ *   - inumber: the file's inumber
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: where to start reading
+ *   - read: where to store the number of bytes that were read
+ *
+ * Returns true if successful, false if the file is not small or the read kept
+ * overlapping with writers (then it must be done under the inode's lock).
+ */
+static bool inode_read_optimistic(int inumber, void *buffer, size_t len,
+                                  size_t offset, size_t *read) {
+    inode_t const *inode = inode_get_unlocked(inumber);
+    size_t block_size = state_block_size();
+
+    for (int attempt = 0; attempt < SEQLOCK_READ_ATTEMPTS; attempt++) {
+        unsigned seq = inode_seq_read_begin(inode);
+
+        // Writers may be changing any of these fields meanwhile, so they can
+        // be inconsistent with each other until the read is validated.
+        size_t size = __atomic_load_n(&inode->i_size, __ATOMIC_RELAXED);
+        if (size > block_size) {
+            return false; // Not a small file.
+        }
+
+        size_t to_read = offset < size ? size - offset : 0;
+        if (to_read > len) {
+            to_read = len;
+        }
+
+        // Contents are either inline, in fragments or in the first block, and
+        // are only read if they are within the inode or the block (otherwise a
+        // writer is changing them, and the read is retried).
+        bool found = true;
+        if (to_read > 0 && __atomic_load_n(&inode->i_inline_data, __ATOMIC_RELAXED)) {
+            found = offset + to_read <= INODE_INLINE_SIZE;
+            if (found) {
+                seq_copy_out(buffer, inode->i_inline + offset, to_read);
+            }
+        } else if (to_read > 0) {
+            int bnum = __atomic_load_n(&inode->i_direct_blocks[0], __ATOMIC_RELAXED);
+            size_t start = __atomic_load_n(&inode->i_first_fragment, __ATOMIC_RELAXED) *
+                           state_fragment_size();
+            found = bnum != -1 && start + size <= block_size;
+            if (found) {
+                seq_copy_out(buffer, data_block_get(bnum, false) + start + offset,
+                             to_read);
+            }
+        }
+
+        if (!inode_seq_read_retry(inode, seq) && found) {
+            *read = to_read;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
-        ALWAYS_ASSERT(pthread_mutex_unlock(&file->open_file_lock) == 0, 
-                    "Could not unlock the file's lock.");
         return -1;
     }
 
@@ -407,84 +1168,378 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
     inode_t *inode = inode_get(file->of_inumber, false);
     ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
 
-    // Determine how many bytes to write
-    size_t block_size = state_block_size();
-    if (to_write + file->of_offset > block_size) {
-        to_write = block_size - file->of_offset;
+    ssize_t written = inode_write_at(inode, buffer, to_write, file->of_offset);
+
+    // The offset associated with the file handle is incremented accordingly
+    if (written > 0) {
+        file->of_offset += (size_t)written;
     }
 
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            // If empty file, allocate new block
-            int bnum = data_block_alloc();
-            if (bnum == -1) {
-                ALWAYS_ASSERT(pthread_rwlock_unlock(&inode->inode_lock) == 0, 
-                            "Could not unlock the inode lock.");
-                ALWAYS_ASSERT(pthread_mutex_unlock(&file->open_file_lock) == 0, 
-                            "Could not unlock the file's lock.");
-                return -1; // no space
-            }
+    inode_unlock(inode);
+    ALWAYS_ASSERT(pthread_mutex_unlock(&file->open_file_lock) == 0, 
+                "Could not unlock the file's lock.");
 
-            inode->i_data_block = bnum;
-        }
+    return written;
+}
 
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
 
-        // Perform the actual write
-        memcpy(block + file->of_offset, buffer, to_write);
+    // From the open file table entry, we get the inode (only locking it if
+    // the file is not small).
+    size_t to_read;
+    if (!inode_read_optimistic(file->of_inumber, buffer, len, file->of_offset,
+                               &to_read)) {
+        inode_t const *inode = inode_get(file->of_inumber, true);
+        ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
 
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
-        }
+        to_read = inode_read_at(inode, buffer, len, file->of_offset);
+
+        // Reads through a handle tend to go on from where they stopped.
+        inode_read_ahead(inode, file->of_offset + to_read);
+        inode_unlock(inode);
     }
 
-    ALWAYS_ASSERT(pthread_rwlock_unlock(&inode->inode_lock) == 0, 
-                "Could not unlock the inode lock.");
+    // The offset associated with the file handle is incremented accordingly
+    file->of_offset += to_read;
+
     ALWAYS_ASSERT(pthread_mutex_unlock(&file->open_file_lock) == 0, 
                 "Could not unlock the file's lock.");
 
-    return (ssize_t)to_write;
+    return (ssize_t)to_read;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+ssize_t tfs_read_view(int fhandle, size_t len, tfs_view_t *view) {
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
-        ALWAYS_ASSERT(pthread_mutex_unlock(&file->open_file_lock) == 0, 
-                    "Could not unlock the file's lock.");
         return -1;
     }
 
-    // From the open file table entry, we get the inode
+    // The read lock is kept until the view is released, which pins the
+    // viewed blocks.
     inode_t const *inode = inode_get(file->of_inumber, true);
-    ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+    ALWAYS_ASSERT(inode != NULL, "tfs_read_view: inode of open file deleted");
 
-    // Determine how many bytes to read
-    size_t to_read = inode->i_size - file->of_offset;
+    view->tv_count = 0;
+    view->tv_length = 0;
+    view->tv_pin = inode;
+
+    // Determine how many bytes to view
+    size_t to_read = 0;
+    if (file->of_offset < inode->i_size) {
+        to_read = inode->i_size - file->of_offset;
+    }
     if (to_read > len) {
         to_read = len;
     }
 
-    if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
+    // Contents kept inline or in fragments make up a single segment.
+    char *contents = inode_small_contents(inode, false);
+    if (to_read > 0 && contents != NULL) {
+        view->tv_segments[0].iov_base = contents + file->of_offset;
+        view->tv_segments[0].iov_len = to_read;
+        view->tv_count = 1;
+        view->tv_length = to_read;
+        file->of_offset += to_read;
+    }
+
+    // Each run of contiguous blocks becomes one segment.
+    size_t block_size = state_block_size();
+    while (view->tv_length < to_read && view->tv_count < TFS_VIEW_SEGMENTS) {
+        size_t run;
+        int bnum = inode_block_run(inode, file->of_offset / block_size, &run);
+
+        size_t block_offset = file->of_offset % block_size;
+        size_t chunk = run * block_size - block_offset;
+        if (chunk > to_read - view->tv_length) {
+            chunk = to_read - view->tv_length;
+        }
+
+        // Holes are viewed (one block at a time) as a block of zeros.
+        void const *block = data_block_zeros();
+        if (bnum != -1) {
+            size_t blocks = (block_offset + chunk + block_size - 1) / block_size;
+            block = data_blocks_get(bnum, blocks, false);
+            ALWAYS_ASSERT(block != NULL, "tfs_read_view: data block deleted mid-read");
+        }
+
+        view->tv_segments[view->tv_count].iov_base = (char *)block + block_offset;
+        view->tv_segments[view->tv_count].iov_len = chunk;
+        view->tv_count++;
+        view->tv_length += chunk;
 
-        // Perform the actual read
-        memcpy(buffer, block + file->of_offset, to_read);
         // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_read;
+        file->of_offset += chunk;
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_unlock(&file->open_file_lock) == 0, 
+                "Could not unlock the file's lock.");
+
+    return (ssize_t)view->tv_length;
+}
+
+int tfs_release_view(tfs_view_t *view) {
+    if (view == NULL || view->tv_pin == NULL) {
+        return -1;
+    }
+
+    inode_unlock(view->tv_pin);
+    view->tv_pin = NULL;
+    view->tv_count = 0;
+    view->tv_length = 0;
+    return 0;
+}
+
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+    if (iovcnt < 0) {
+        return -1;
+    }
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    // The whole vector is written under a single acquisition of the locks,
+    // so it is not interleaved with other writes.
+    inode_t *inode = inode_get(file->of_inumber, false);
+    ALWAYS_ASSERT(inode != NULL, "tfs_writev: inode of open file deleted");
+
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        ssize_t written = inode_write_at(inode, iov[i].iov_base, iov[i].iov_len,
+                                         file->of_offset);
+        if (written == -1) {
+            if (total == 0) {
+                total = -1; // no space
+            }
+            break;
+        }
+
+        file->of_offset += (size_t)written;
+        total += written;
+        if ((size_t)written < iov[i].iov_len) {
+            break; // maximum file size reached, or no space
+        }
     }
 
-    ALWAYS_ASSERT(pthread_rwlock_unlock((pthread_rwlock_t *)&inode->inode_lock) == 0, 
+    inode_unlock(inode);
+    ALWAYS_ASSERT(pthread_mutex_unlock(&file->open_file_lock) == 0, 
+                "Could not unlock the file's lock.");
+
+    return total;
+}
+
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
+    if (iovcnt < 0) {
+        return -1;
+    }
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    inode_t const *inode = inode_get(file->of_inumber, true);
+    ALWAYS_ASSERT(inode != NULL, "tfs_readv: inode of open file deleted");
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t done = inode_read_at(inode, iov[i].iov_base, iov[i].iov_len,
+                                    file->of_offset);
+        file->of_offset += done;
+        total += done;
+        if (done < iov[i].iov_len) {
+            break; // end of file
+        }
+    }
+
+    inode_unlock(inode);
+    ALWAYS_ASSERT(pthread_mutex_unlock(&file->open_file_lock) == 0, 
                 "Could not unlock the file's lock.");
+
+    return (ssize_t)total;
+}
+
+/**
+ * Finds where the data or the hole containing an offset, or following it,
+ * starts. Holes are made of whole unallocated blocks, and the end of a file
+ * counts as one; contents kept inline or in fragments have none.
+ *
+ * Input:
+ *   - inode: the file's inode (locked)
+ *   - offset: where to start looking (before the end of the file)
+ *   - data: whether to look for data (or for a hole)
+ *
+ * Returns the offset that was found (the file's size if there is no data at or
+ * after 'offset').
+ */
+static size_t inode_seek_extent(inode_t const *inode, size_t offset, bool data) {
+    if (inode->i_inline_data || inode->i_fragment_count > 0) {
+        return data ? offset : inode->i_size;
+    }
+
+    size_t block_size = state_block_size();
+    size_t file_block = offset / block_size;
+    while (file_block * block_size < inode->i_size) {
+        size_t run;
+        bool allocated = inode_block_run(inode, file_block, &run) != -1;
+        if (allocated == data) {
+            size_t found = file_block * block_size;
+            return found > offset ? found : offset;
+        }
+        file_block += run;
+    }
+
+    return inode->i_size;
+}
+
+off_t tfs_lseek(int fhandle, off_t offset, tfs_seek_whence_t whence) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    inode_t const *inode = inode_get(file->of_inumber, true);
+    ALWAYS_ASSERT(inode != NULL, "tfs_lseek: inode of open file deleted");
+
+    off_t size = (off_t)inode->i_size;
+    off_t result = -1;
+    switch (whence) {
+    case TFS_SEEK_SET:
+        result = offset;
+        break;
+    case TFS_SEEK_CUR:
+        result = (off_t)file->of_offset + offset;
+        break;
+    case TFS_SEEK_END:
+        result = size + offset;
+        break;
+    case TFS_SEEK_DATA:
+    case TFS_SEEK_HOLE:
+        // There is neither data nor a hole to find at or past the end.
+        if (offset >= 0 && offset < size) {
+            result = (off_t)inode_seek_extent(inode, (size_t)offset,
+                                              whence == TFS_SEEK_DATA);
+            if (result == size && whence == TFS_SEEK_DATA) {
+                result = -1;
+            }
+        }
+        break;
+    default:
+        break; // Invalid whence.
+    }
+
+    inode_unlock(inode);
+
+    if (result >= 0) {
+        file->of_offset = (size_t)result;
+    }
+
     ALWAYS_ASSERT(pthread_mutex_unlock(&file->open_file_lock) == 0, 
                 "Could not unlock the file's lock.");
 
+    return result < 0 ? -1 : result;
+}
+
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset) {
+    int inumber = get_open_file_inumber(fhandle);
+    if (inumber == -1) {
+        return -1;
+    }
+
+    inode_t *inode = inode_get(inumber, false);
+    ALWAYS_ASSERT(inode != NULL, "tfs_pwrite: inode of open file deleted");
+
+    ssize_t written = inode_write_at(inode, buffer, len, offset);
+
+    inode_unlock(inode);
+    inode_unpin(inumber);
+    return written;
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    int inumber = get_open_file_inumber(fhandle);
+    if (inumber == -1) {
+        return -1;
+    }
+
+    // Readers of the same file (even through the same handle) share the
+    // inode's lock, or do not take it at all if the file is small.
+    size_t to_read;
+    if (!inode_read_optimistic(inumber, buffer, len, offset, &to_read)) {
+        inode_t const *inode = inode_get(inumber, true);
+        ALWAYS_ASSERT(inode != NULL, "tfs_pread: inode of open file deleted");
+
+        to_read = inode_read_at(inode, buffer, len, offset);
+        inode_unlock(inode);
+    }
+
+    inode_unpin(inumber);
     return (ssize_t)to_read;
 }
 
+int tfs_snapshot_create(void) {
+    return snapshot_create();
+}
+
+int tfs_snapshot_mount(int snapshot, char const *name) {
+    char file_name[MAX_FILE_NAME];
+
+    // The copy is made before any inode is locked (snapshot_create holds the
+    // snapshots while it locks inodes).
+    int root = snapshot_clone(snapshot);
+    if (root == -1) {
+        return -1; // No such snapshot, or no room for the copy.
+    }
+
+    // Finds (and locks) the directory where the copy will be mounted. Also
+    // checks if the path name is valid.
+    inode_t *dir = tfs_lookup_dir(name, false, file_name);
+    if (dir == NULL) {
+        inode_tree_delete(root);
+        return -1;
+    }
+
+    // Checks if the name is already taken.
+    if (find_in_dir(dir, file_name) != -1) {
+        inode_unlock(dir);
+        inode_tree_delete(root);
+        return -1;
+    }
+
+    state_mutation_begin();
+    if (add_dir_entry(dir, file_name, root) == -1) {
+        state_mutation_end();
+        inode_unlock(dir);
+        inode_tree_delete(root);
+        return -1; // No space in directory.
+    }
+    state_mutation_end();
+
+    inode_unlock(dir);
+    return 0;
+}
+
+int tfs_snapshot_delete(int snapshot) {
+    return snapshot_delete(snapshot);
+}
+
+tfs_dcache_stats_t tfs_dcache_stats(void) {
+    tfs_dcache_stats_t stats;
+    dcache_stats(&stats.hits, &stats.misses);
+    return stats;
+}
+
+tfs_block_cache_stats_t tfs_block_cache_stats(void) {
+    tfs_block_cache_stats_t stats;
+    block_cache_stats(&stats.hits, &stats.misses, &stats.write_backs);
+    return stats;
+}
+
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
 
     // Creates a buffer to store the copied data from the source file,
@@ -4,7 +4,43 @@
 #define SIZE_OF_BUFFER 512
 
 #include "config.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * How the data blocks of an FS image are kept in memory.
+ */
+typedef enum {
+    // Read into memory when the image is mounted, written back by tfs_sync.
+    TFS_DATA_IN_MEMORY = 0,
+    // Mapped from the image (so mounting reads nothing up front and cold
+    // blocks are served by the page cache). Changes reach the image with
+    // tfs_sync, as with blocks kept in memory.
+    TFS_DATA_MAPPED = 1,
+} tfs_data_mode;
+
+/**
+ * How the latency of accesses to the FS structures is emulated (as if they
+ * were kept in secondary memory).
+ */
+typedef enum {
+    TFS_LATENCY_NONE = 0, // no artificial latency
+    TFS_LATENCY_SPIN = 1, // busy wait (keeps the thread on its CPU)
+    TFS_LATENCY_SLEEP = 2, // sleep (lets other threads run meanwhile)
+} tfs_latency_mode;
+
+/**
+ * Emulated latency of an access to each kind of FS structure, in nanoseconds.
+ */
+typedef struct {
+    tfs_latency_mode mode;
+    unsigned long inode_ns;     // an inode
+    unsigned long directory_ns; // the entries of a directory
+    unsigned long bitmap_ns;    // a block of the inode or data block bitmap
+    unsigned long block_ns;     // a data block
+} tfs_latency_model;
 
 /**
  * TécnicoFS parameters.
@@ -15,6 +51,26 @@ typedef struct {
     size_t max_open_files_count;
 
     size_t block_size;
+
+    // Path of the file that holds the FS image, or NULL to keep the FS in
+    // memory only. An existing image is mounted (with the limits and block
+    // size it was created with); otherwise a new one is created.
+    char const *image_path;
+
+    // How the data blocks of the image are kept (TFS_DATA_MAPPED requires an
+    // image), and, for mapped blocks, whether to prefault them when they are
+    // mapped and to ask for huge pages.
+    tfs_data_mode data_mode;
+    bool data_populate;
+    bool data_hugepages;
+
+    // Emulated latency of accesses to the FS structures (none by default).
+    tfs_latency_model latency;
+
+    // Number of data blocks kept in the block cache, which spares accesses to
+    // them the emulated latency (0, the default, disables the cache: without
+    // an emulated latency it would only add work to every block access).
+    size_t block_cache_blocks;
 } tfs_params;
 
 /**
@@ -22,6 +78,15 @@ typedef struct {
  */
 tfs_params tfs_default_params();
 
+/**
+ * Return a latency model where every access costs the same.
+ *
+ * Input:
+ *   - mode: how the latency is emulated
+ *   - ns: cost of an access (in nanoseconds)
+ */
+tfs_latency_model tfs_fixed_latency(tfs_latency_mode mode, unsigned long ns);
+
 /**
  * Initialize tecnicofs, optionally with a given configuration.
  * Returns 0 if successful, -1 otherwise.
@@ -29,11 +94,21 @@ tfs_params tfs_default_params();
 int tfs_init(tfs_params const *params);
 
 /**
- * Destroy tecnicofs.
+ * Destroy tecnicofs, writing it back to its image first (if it has one).
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_destroy();
 
+/**
+ * Write tecnicofs back to its image (if it has one) and flush the image to
+ * storage, as a whole: a crash leaves the image as it was before or after.
+ * It must not run concurrently with other operations, as it takes no locks
+ * while it replaces the image and remaps its blocks: debug builds (without
+ * NDEBUG) abort if an inode is locked when it starts.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_sync(void);
+
 /**
  * TécnicoFS file opening modes.
  */
@@ -79,6 +154,27 @@ int tfs_sym_link(char const *target, char const *link_name);
  */
 int tfs_link(char const *target_file, char const *link_name);
 
+/**
+ * Create a directory.
+ *
+ * Input:
+ *   - name: absolute path name of the directory to be created (every
+ *     directory in the path must already exist)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_mkdir(char const *name);
+
+/**
+ * Remove an empty directory.
+ *
+ * Input:
+ *   - name: absolute path name of the directory
+ *
+ * Returns 0 if successful, -1 otherwise (e.g. if the directory is not empty).
+ */
+int tfs_rmdir(char const *name);
+
 /**
  * Close a file.
  *
@@ -98,7 +194,8 @@ int tfs_close(int fhandle);
  *   - len: length of the buffer contents (in bytes)
  *
  * Returns the number of bytes that were written (can be lower than 'len' if the
- * maximum file size is exceeded), or -1 in case of error.
+ * maximum file size is exceeded or the file system runs out of data blocks),
+ * or -1 in case of error.
  */
 ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
 
@@ -115,6 +212,145 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Read-only view of part of a file, pointing straight into the file system's
+ * data blocks.
+ */
+typedef struct {
+    struct iovec tv_segments[TFS_VIEW_SEGMENTS]; // contents, in file order
+    int tv_count;                                // number of segments
+    size_t tv_length;                            // total length of the segments
+
+    void const *tv_pin; // private: the file whose contents are pinned
+} tfs_view_t;
+
+/**
+ * Obtain a view of the contents of an open file, starting at the current
+ * offset, without copying them (the offset is moved past the viewed bytes).
+ *
+ * The file's blocks stay pinned until the view is released with
+ * tfs_release_view: writes to the file, truncating it and unlinking it wait
+ * until then. So the thread holding a view must release it before doing any of
+ * those itself.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - len: maximum number of bytes to view
+ *   - view: where to store the view
+ *
+ * Returns the number of bytes in the view (can be lower than 'len' if the file
+ * size was reached or the bytes span more than TFS_VIEW_SEGMENTS runs of
+ * blocks), or -1 in case of error (in which case there is nothing to release).
+ */
+ssize_t tfs_read_view(int fhandle, size_t len, tfs_view_t *view);
+
+/**
+ * Release a view obtained with tfs_read_view. Its segments must no longer be
+ * used.
+ *
+ * Input:
+ *   - view: the view
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_release_view(tfs_view_t *view);
+
+/**
+ * Write the contents of several buffers to an open file, in order, starting at
+ * the current offset. The buffers are written as one operation: no other write
+ * to the file is interleaved with them.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: array of buffers (iov_base) and their lengths (iov_len)
+ *   - iovcnt: number of buffers
+ *
+ * Returns the total number of bytes that were written (can be lower than the
+ * sum of the lengths if the maximum file size is exceeded or the file system
+ * runs out of data blocks), or -1 in case of error.
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Read from an open file into several buffers, filling each one before the
+ * next, starting at the current offset.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: array of destination buffers (iov_base) and their lengths (iov_len)
+ *   - iovcnt: number of buffers
+ *
+ * Returns the total number of bytes that were copied from the file to the
+ * buffers (can be lower than the sum of the lengths if the file size was
+ * reached), or -1 in case of error.
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Write to an open file, starting at a given offset (the file handle's offset
+ * is neither used nor changed).
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: buffer containing the contents to write
+ *   - len: length of the buffer contents (in bytes)
+ *   - offset: where to start writing; if it is past the end of the file, the
+ *     gap reads as zeros (see tfs_lseek)
+ *
+ * Returns the number of bytes that were written (can be lower than 'len' if the
+ * maximum file size is exceeded or the file system runs out of data blocks),
+ * or -1 in case of error.
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/**
+ * Read from an open file, starting at a given offset (the file handle's offset
+ * is neither used nor changed). Unlike tfs_read, concurrent calls on the same
+ * file handle do not exclude each other.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: where to start reading
+ *
+ * Returns the number of bytes that were copied from the file to the buffer (can
+ * be lower than 'len' if the file size was reached), or -1 in case of error.
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/**
+ * Where tfs_lseek measures an offset from (or, for TFS_SEEK_DATA and
+ * TFS_SEEK_HOLE, what it looks for from the offset on).
+ */
+typedef enum {
+    TFS_SEEK_SET,  // the start of the file
+    TFS_SEEK_CUR,  // the file handle's current offset
+    TFS_SEEK_END,  // the end of the file
+    TFS_SEEK_DATA, // the next bytes of the file that are not in a hole
+    TFS_SEEK_HOLE, // the next hole (the end of the file counts as one)
+} tfs_seek_whence_t;
+
+/**
+ * Move the offset of an open file. It may be moved past the end of the file:
+ * writing there leaves a gap that reads as zeros, without allocating the
+ * blocks that the gap covers whole (holes).
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - offset: the new offset, relative to where 'whence' says
+ *   - whence: what 'offset' is relative to
+ *
+ * Returns the new offset (from the start of the file) if successful, -1
+ * otherwise (in which case the offset is left unchanged).
+ *
+ * Possible errors:
+ *   - The new offset would be negative.
+ *   - (TFS_SEEK_DATA and TFS_SEEK_HOLE) 'offset' is not within the file, or
+ *     there is no data at or after it.
+ */
+off_t tfs_lseek(int fhandle, off_t offset, tfs_seek_whence_t whence);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
@@ -152,4 +388,167 @@ int tfs_unlink(char const *target);
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
 
+/**
+ * Take a snapshot of TécnicoFS: a frozen copy of all of its files and
+ * directories, taken at once. It costs a copy of the inodes; the data blocks
+ * are shared, and copied when the FS (or a mounted snapshot) changes them.
+ * Writes to files go on while it is taken (a file is copied before it is
+ * first changed); operations that create or remove names only wait while
+ * the snapshot takes note of the inodes in use.
+ * Snapshots are kept in memory only: tfs_destroy deletes them.
+ *
+ * Returns the snapshot's id if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - MAX_SNAPSHOTS snapshots are kept already.
+ */
+int tfs_snapshot_create(void);
+
+/**
+ * Mount a snapshot: make a copy of its tree appear as a new directory, where
+ * it can be read and changed independently of the rest of the FS (and of the
+ * snapshot, which can be mounted again). Like the contents written to files,
+ * the copy only reaches the image with the next tfs_sync: it is not recorded
+ * in the journal, so it is not crash-consistent. If the FS stops before the
+ * next tfs_sync, recovery leaves the copy out, and with it the operations
+ * done inside it (links made from elsewhere to its files included).
+ *
+ * Input:
+ *   - snapshot: the snapshot's id (obtained from tfs_snapshot_create)
+ *   - name: absolute path name of the new directory
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - There is no such snapshot.
+ *   - The path name is invalid or already exists.
+ *   - No space in the inode table, in the directory, or in the data blocks
+ *     (directories, and files kept in fragments, are copied).
+ */
+int tfs_snapshot_mount(int snapshot, char const *name);
+
+/**
+ * Delete a snapshot, freeing the data blocks that only it still refers to
+ * (its mounted copies stay).
+ *
+ * Input:
+ *   - snapshot: the snapshot's id (obtained from tfs_snapshot_create)
+ *
+ * Returns 0 if successful, -1 if there is no such snapshot.
+ */
+int tfs_snapshot_delete(int snapshot);
+
+/**
+ * Name lookup (dentry) cache statistics.
+ */
+typedef struct {
+    size_t hits;   // lookups answered by the cache
+    size_t misses; // lookups that had to search the directory
+} tfs_dcache_stats_t;
+
+/**
+ * Obtain the name lookup cache statistics (since tfs_init).
+ */
+tfs_dcache_stats_t tfs_dcache_stats(void);
+
+/**
+ * Block cache statistics.
+ */
+typedef struct {
+    size_t hits;        // block accesses served by the cache
+    size_t misses;      // block accesses that brought a block in
+    size_t write_backs; // changed blocks written back when evicted
+} tfs_block_cache_stats_t;
+
+/**
+ * Obtain the block cache statistics (since tfs_init).
+ */
+tfs_block_cache_stats_t tfs_block_cache_stats(void);
+
+/**
+ * Asynchronous operations: a ring accepts submissions of operations, which a
+ * pool of worker threads runs, and hands back their completions in batches.
+ * Submitted operations run concurrently and may complete in any order; an
+ * operation that depends on another (e.g. a read on a file being opened) must
+ * only be submitted after the completion of the first one is reaped.
+ */
+typedef enum {
+    TFS_OP_OPEN,   // tfs_open(name, mode)
+    TFS_OP_CLOSE,  // tfs_close(fhandle)
+    TFS_OP_READ,   // tfs_read(fhandle, buffer, len)
+    TFS_OP_WRITE,  // tfs_write(fhandle, buffer, len)
+    TFS_OP_PREAD,  // tfs_pread(fhandle, buffer, len, offset)
+    TFS_OP_PWRITE, // tfs_pwrite(fhandle, buffer, len, offset)
+} tfs_op_t;
+
+/**
+ * A submitted operation. The name and buffer must stay valid until the
+ * operation completes.
+ */
+typedef struct {
+    tfs_op_t sqe_op;
+    char const *sqe_name;
+    tfs_file_mode_t sqe_mode;
+    int sqe_fhandle;
+    void *sqe_buffer;
+    size_t sqe_len;
+    size_t sqe_offset;
+    uint64_t sqe_user_data; // handed back in the completion
+} tfs_sqe_t;
+
+/**
+ * The completion of an operation.
+ */
+typedef struct {
+    uint64_t cqe_user_data;
+    ssize_t cqe_result; // what the operation returned
+} tfs_cqe_t;
+
+typedef struct tfs_ring tfs_ring_t;
+
+/**
+ * Create a ring.
+ *
+ * Input:
+ *   - entries: maximum number of operations in flight (submitted and not
+ *     reaped yet)
+ *   - workers: number of worker threads running operations
+ *
+ * Returns the ring, or NULL in case of error.
+ */
+tfs_ring_t *tfs_ring_create(size_t entries, size_t workers);
+
+/**
+ * Submit operations to a ring, without waiting for them.
+ *
+ * Input:
+ *   - ring: the ring
+ *   - sqes: the operations
+ *   - count: number of operations
+ *
+ * Returns the number of operations submitted (lower than 'count' if the ring
+ * has no room for the others).
+ */
+size_t tfs_ring_submit(tfs_ring_t *ring, tfs_sqe_t const *sqes, size_t count);
+
+/**
+ * Reap completions from a ring.
+ *
+ * Input:
+ *   - ring: the ring
+ *   - cqes: where to store the completions
+ *   - max: room in cqes
+ *   - wait_for: number of completions to wait for (at most 'max', and at most
+ *     the number of operations in flight)
+ *
+ * Returns the number of completions stored in cqes.
+ */
+size_t tfs_ring_reap(tfs_ring_t *ring, tfs_cqe_t *cqes, size_t max, size_t wait_for);
+
+/**
+ * Destroy a ring, after waiting for the operations in flight to complete
+ * (their completions are discarded).
+ */
+void tfs_ring_destroy(tfs_ring_t *ring);
+
 #endif // OPERATIONS_H
@@ -0,0 +1,216 @@
+#include "operations.h"
+#include "betterassert.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/*
+ * The submission queue and the completion queue are circular arrays with room
+ * for every operation in flight, so neither can overflow. Both are guarded by
+ * the ring's lock: workers wait on 'submitted' for operations, and reapers
+ * wait on 'completed' for completions.
+ */
+struct tfs_ring {
+    size_t r_entries;
+    size_t r_in_flight; // submitted and not reaped yet
+
+    tfs_sqe_t *r_sq;
+    size_t r_sq_head;
+    size_t r_sq_count;
+
+    tfs_cqe_t *r_cq;
+    size_t r_cq_head;
+    size_t r_cq_count;
+
+    pthread_mutex_t r_lock;
+    pthread_cond_t r_submitted;
+    pthread_cond_t r_completed;
+    bool r_stopping;
+
+    pthread_t *r_workers;
+    size_t r_worker_count;
+};
+
+/**
+ * Run an operation.
+ *
+ * Returns what the operation returned.
+ */
+static ssize_t ring_run(tfs_sqe_t const *sqe) {
+    switch (sqe->sqe_op) {
+    case TFS_OP_OPEN:
+        return tfs_open(sqe->sqe_name, sqe->sqe_mode);
+    case TFS_OP_CLOSE:
+        return tfs_close(sqe->sqe_fhandle);
+    case TFS_OP_READ:
+        return tfs_read(sqe->sqe_fhandle, sqe->sqe_buffer, sqe->sqe_len);
+    case TFS_OP_WRITE:
+        return tfs_write(sqe->sqe_fhandle, sqe->sqe_buffer, sqe->sqe_len);
+    case TFS_OP_PREAD:
+        return tfs_pread(sqe->sqe_fhandle, sqe->sqe_buffer, sqe->sqe_len,
+                         sqe->sqe_offset);
+    case TFS_OP_PWRITE:
+        return tfs_pwrite(sqe->sqe_fhandle, sqe->sqe_buffer, sqe->sqe_len,
+                          sqe->sqe_offset);
+    default:
+        return -1; // Unknown operation.
+    }
+}
+
+static void *ring_worker(void *arg) {
+    tfs_ring_t *ring = arg;
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&ring->r_lock) == 0,
+                "The ring's lock could not be locked.");
+    while (true) {
+        while (ring->r_sq_count == 0 && !ring->r_stopping) {
+            ALWAYS_ASSERT(pthread_cond_wait(&ring->r_submitted, &ring->r_lock) == 0,
+                        "The ring's condition could not be waited on.");
+        }
+        if (ring->r_sq_count == 0) {
+            break; // Stopping, with nothing left to run.
+        }
+
+        tfs_sqe_t sqe = ring->r_sq[ring->r_sq_head];
+        ring->r_sq_head = (ring->r_sq_head + 1) % ring->r_entries;
+        ring->r_sq_count--;
+
+        // The operation runs without the ring's lock.
+        ALWAYS_ASSERT(pthread_mutex_unlock(&ring->r_lock) == 0,
+                    "The ring's lock could not be unlocked.");
+        ssize_t result = ring_run(&sqe);
+        ALWAYS_ASSERT(pthread_mutex_lock(&ring->r_lock) == 0,
+                    "The ring's lock could not be locked.");
+
+        tfs_cqe_t *cqe = &ring->r_cq[(ring->r_cq_head + ring->r_cq_count) % ring->r_entries];
+        cqe->cqe_user_data = sqe.sqe_user_data;
+        cqe->cqe_result = result;
+        ring->r_cq_count++;
+        ALWAYS_ASSERT(pthread_cond_broadcast(&ring->r_completed) == 0,
+                    "The ring's condition could not be broadcast.");
+    }
+    ALWAYS_ASSERT(pthread_mutex_unlock(&ring->r_lock) == 0,
+                "The ring's lock could not be unlocked.");
+
+    return NULL;
+}
+
+tfs_ring_t *tfs_ring_create(size_t entries, size_t workers) {
+    if (entries == 0 || workers == 0) {
+        return NULL;
+    }
+
+    tfs_ring_t *ring = calloc(1, sizeof(tfs_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->r_entries = entries;
+    ring->r_sq = malloc(entries * sizeof(tfs_sqe_t));
+    ring->r_cq = malloc(entries * sizeof(tfs_cqe_t));
+    ring->r_workers = malloc(workers * sizeof(pthread_t));
+    if (ring->r_sq == NULL || ring->r_cq == NULL || ring->r_workers == NULL) {
+        free(ring->r_sq);
+        free(ring->r_cq);
+        free(ring->r_workers);
+        free(ring);
+        return NULL;
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_init(&ring->r_lock, NULL) == 0,
+                "The ring's lock could not be initialized.");
+    ALWAYS_ASSERT(pthread_cond_init(&ring->r_submitted, NULL) == 0,
+                "The ring's condition could not be initialized.");
+    ALWAYS_ASSERT(pthread_cond_init(&ring->r_completed, NULL) == 0,
+                "The ring's condition could not be initialized.");
+
+    for (size_t i = 0; i < workers; i++) {
+        if (pthread_create(&ring->r_workers[i], NULL, ring_worker, ring) != 0) {
+            break;
+        }
+        ring->r_worker_count++;
+    }
+    if (ring->r_worker_count == 0) {
+        tfs_ring_destroy(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+size_t tfs_ring_submit(tfs_ring_t *ring, tfs_sqe_t const *sqes, size_t count) {
+    ALWAYS_ASSERT(pthread_mutex_lock(&ring->r_lock) == 0,
+                "The ring's lock could not be locked.");
+
+    size_t submitted = 0;
+    while (submitted < count && ring->r_in_flight < ring->r_entries) {
+        ring->r_sq[(ring->r_sq_head + ring->r_sq_count) % ring->r_entries] =
+            sqes[submitted++];
+        ring->r_sq_count++;
+        ring->r_in_flight++;
+    }
+
+    // A single wake up call covers one operation; more workers are woken up
+    // for a batch.
+    if (submitted == 1) {
+        ALWAYS_ASSERT(pthread_cond_signal(&ring->r_submitted) == 0,
+                    "The ring's condition could not be signaled.");
+    } else if (submitted > 1) {
+        ALWAYS_ASSERT(pthread_cond_broadcast(&ring->r_submitted) == 0,
+                    "The ring's condition could not be broadcast.");
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_unlock(&ring->r_lock) == 0,
+                "The ring's lock could not be unlocked.");
+    return submitted;
+}
+
+size_t tfs_ring_reap(tfs_ring_t *ring, tfs_cqe_t *cqes, size_t max, size_t wait_for) {
+    ALWAYS_ASSERT(pthread_mutex_lock(&ring->r_lock) == 0,
+                "The ring's lock could not be locked.");
+
+    if (wait_for > max) {
+        wait_for = max;
+    }
+    if (wait_for > ring->r_in_flight) {
+        wait_for = ring->r_in_flight;
+    }
+    while (ring->r_cq_count < wait_for) {
+        ALWAYS_ASSERT(pthread_cond_wait(&ring->r_completed, &ring->r_lock) == 0,
+                    "The ring's condition could not be waited on.");
+    }
+
+    size_t reaped = 0;
+    while (reaped < max && ring->r_cq_count > 0) {
+        cqes[reaped++] = ring->r_cq[ring->r_cq_head];
+        ring->r_cq_head = (ring->r_cq_head + 1) % ring->r_entries;
+        ring->r_cq_count--;
+        ring->r_in_flight--;
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_unlock(&ring->r_lock) == 0,
+                "The ring's lock could not be unlocked.");
+    return reaped;
+}
+
+void tfs_ring_destroy(tfs_ring_t *ring) {
+    // Workers run what is left in the submission queue before leaving.
+    ALWAYS_ASSERT(pthread_mutex_lock(&ring->r_lock) == 0,
+                "The ring's lock could not be locked.");
+    ring->r_stopping = true;
+    ALWAYS_ASSERT(pthread_cond_broadcast(&ring->r_submitted) == 0,
+                "The ring's condition could not be broadcast.");
+    ALWAYS_ASSERT(pthread_mutex_unlock(&ring->r_lock) == 0,
+                "The ring's lock could not be unlocked.");
+
+    for (size_t i = 0; i < ring->r_worker_count; i++) {
+        pthread_join(ring->r_workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&ring->r_completed);
+    pthread_cond_destroy(&ring->r_submitted);
+    pthread_mutex_destroy(&ring->r_lock);
+    free(ring->r_sq);
+    free(ring->r_cq);
+    free(ring->r_workers);
+    free(ring);
+}
@@ -1,11 +1,21 @@
+// For MAP_POPULATE and MADV_HUGEPAGE (used only where available).
+#define _DEFAULT_SOURCE
+
 #include "state.h"
 #include "betterassert.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 
@@ -16,24 +26,265 @@
  */
 static tfs_params fs_params;
 
-// Inode table
-static inode_t *inode_table;
-static allocation_state_t *freeinode_ts;
+/*
+ * A table that grows by chunks (up to a hard limit), so that its entries never
+ * move once they exist. chunked_table_grow adds a chunk: init_chunk
+ * initializes its entries, which are then published (counted in ct_capacity)
+ * and finally handed to the table's allocator by release_chunk.
+ */
+typedef struct {
+    void **ct_chunks; // one pointer per chunk, NULL if not allocated yet
+    size_t ct_chunk_entries;
+    size_t ct_entry_size;
+    size_t ct_limit;
+    atomic_size_t ct_capacity; // entries in allocated chunks
+    pthread_mutex_t ct_grow_lock;
+    // Obtain and release the memory of a chunk (malloc and free by default).
+    void *(*ct_alloc_chunk)(size_t first, size_t size);
+    void (*ct_free_chunk)(void *chunk, size_t size);
+} chunked_table_t;
+
+// Inode table. Each chunk holds three arrays of INODE_TABLE_CHUNK entries:
+// the inodes (inode_t, hot), their locks (inode_lock_t, padded to cache
+// lines, as they are written by every thread that takes them) and their
+// seldom used fields (inode_cold_t). With TFS_INODE_PACKED, a chunk holds a
+// single array of the three packed together (inode_packed_t), unpadded.
+static chunked_table_t inode_table;
+
+typedef struct {
+    INODE_ALIGNAS pthread_rwlock_t il_lock;
+    // Number of open file table entries referring to the inode.
+    atomic_int il_open_count;
+} inode_lock_t;
+
+typedef struct {
+    char *ic_sym_path; // target of a symbolic link (NULL otherwise)
+} inode_cold_t;
+
+#ifdef TFS_INODE_PACKED
+typedef struct {
+    inode_t ip_inode;
+    inode_lock_t ip_lock;
+    inode_cold_t ip_cold;
+} inode_packed_t;
+
+#define INODE_ENTRY_SIZE (sizeof(inode_packed_t))
+#define INODE_CHUNK_SIZE (INODE_TABLE_CHUNK * sizeof(inode_packed_t))
+#else
+#define INODE_ENTRY_SIZE (sizeof(inode_t))
+#define INODE_CHUNK_SIZE \
+    (INODE_TABLE_CHUNK * (sizeof(inode_t) + sizeof(inode_lock_t) + sizeof(inode_cold_t)))
+#endif
+// One bit per inode (set when taken), packed in 64-bit words. Inodes are
+// claimed with compare-and-swap, so allocation takes no lock. Bits of inodes
+// past the table's capacity are set.
+static _Atomic uint64_t *freeinode_ts;
+// Word where the next search for a free inode starts (a hint only).
+static atomic_size_t freeinode_ts_hint;
+
+// Data blocks (entries of BLOCK_SIZE bytes)
+static chunked_table_t fs_data;
+// One bit per block (set when taken), packed in 64-bit words. Bits of blocks
+// past the capacity of fs_data are set.
+static uint64_t *free_blocks;
+// Next-fit cursor: where the next search for a free block starts.
+static size_t free_blocks_cursor;
+// One byte per block split into fragments, with a bit set for each fragment
+// in use (0 for blocks that are not split). Blocks with free fragments that
+// allocations try first are remembered in fragment_partial (which may hold
+// stale entries, or -1). Both are guarded by data_block_table_lock, as is
+// free_blocks.
+static uint8_t *fragment_maps;
+static int fragment_partial[FRAGMENT_PARTIAL_BLOCKS];
+static size_t fragment_partial_next;
+
+// A block of zeros, standing for the holes of sparse files in views (which
+// point into blocks instead of copying them).
+static char *zero_block;
+
+// Number of owners of each data block besides the first: blocks that more
+// than one file or snapshot (or indirect block) refer to are shared, and are
+// copied before they are changed. The blocks referenced by a shared indirect
+// block are shared along with it (they only count the indirect blocks
+// referencing them). Guarded by data_block_table_lock; shared_blocks counts
+// the blocks with other owners, so that there is nothing to check while there
+// are none.
+static uint16_t *block_refs;
+static atomic_size_t shared_blocks;
 
-// Data blocks
-static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks;
+/*
+ * FS image: when the FS has one, the persistent state above is loaded from it
+ * by state_init and written back to it by state_sync. The image holds, in
+ * order:
+ *   - the superblock (in the first IMAGE_ALIGNMENT bytes);
+ *   - one image_inode_t per inode (up to the inode limit);
+ *   - the inode bitmap and the block bitmap (sized for the limits);
+ *   - the data blocks (starting at a multiple of IMAGE_ALIGNMENT).
+ * Only the inodes and blocks within the tables' capacity are stored.
+ *
+ * A checkpoint is written whole to a new image (image_new_path), which then
+ * replaces the old one by a rename, so a crash leaves one or the other. For
+ * the same reason, mapped blocks are mapped privately: changes only reach the
+ * image with the next checkpoint.
+ */
+#define IMAGE_MAGIC UINT64_C(0x3347414d49534654) // "TFSIMAG3"
+#define IMAGE_ALIGNMENT (4096)
+
+typedef struct {
+    uint64_t sb_magic;
+    uint64_t sb_block_size;
+    uint64_t sb_max_inode_count;
+    uint64_t sb_max_block_count;
+    uint64_t sb_inode_capacity;
+    uint64_t sb_block_capacity;
+    uint64_t sb_generation; // number of the checkpoint the image holds
+} image_superblock_t;
+
+typedef struct {
+    int32_t ii_node_type;
+    int32_t ii_hard_link_counter;
+    uint64_t ii_size;
+    int32_t ii_direct_blocks[INODE_DIRECT_BLOCKS];
+    int32_t ii_indirect_block;
+    int32_t ii_double_indirect_block;
+    uint64_t ii_extent_count;
+    struct {
+        uint64_t ie_file_block;
+        int64_t ie_start;
+        uint64_t ie_length;
+    } ii_extents[INODE_EXTENTS];
+    uint32_t ii_inline_data;
+    uint32_t ii_fragment_count;
+    uint32_t ii_first_fragment;
+    // Symbolic link target, or inline contents of a file (empty otherwise).
+    char ii_inline[MAX_PATH_NAME];
+} image_inode_t;
+
+static int image_fd = -1;
+static char *image_path;
+static char *image_new_path;
+static bool image_loaded;
+static uint64_t image_generation;
 
 /*
  * Volatile FS state
  */
-static open_file_entry_t *open_file_table;
-static allocation_state_t *free_open_file_entries;
+static chunked_table_t open_file_table;
+// An entry is filled while it is free, and then published by marking it
+// taken (so that filling it needs no lock, whatever the opener holds).
+static _Atomic(allocation_state_t) *free_open_file_entries;
+
+/*
+ * The open file table is split in shards: handle i belongs to shard
+ * i % open_file_shard_count, whose free entries are kept in a list linked
+ * through open_file_next_free. Each thread allocates handles from a home
+ * shard (only looking at the others when it is empty), so threads opening
+ * files do not contend on a single lock and never scan the table.
+ */
+typedef struct {
+    pthread_mutex_t ofs_lock;
+    int ofs_free_head; // -1 if the shard has no free entries
+} open_file_shard_t;
+
+static open_file_shard_t open_file_shards[OPEN_FILE_SHARDS];
+static size_t open_file_shard_count;
+static int *open_file_next_free;
+static atomic_size_t open_file_next_home;
+static _Thread_local int open_file_home_shard = -1;
+
+
+/*
+ * Name lookup (dentry) cache: maps (directory inumber, name) to the inumber
+ * found in the directory, or to -1 if the name is known not to be there. It
+ * is direct-mapped, and kept up to date by add_dir_entry and clear_dir_entry.
+ * Since those run with the directory locked for writing and find_in_dir runs
+ * with it locked (at least) for reading, an entry never goes stale; the cache
+ * locks only protect the entries themselves, which are shared by directories.
+ */
+typedef struct {
+    int dc_dir_inumber; // -1 if the entry is unused
+    uint32_t dc_hash;
+    char dc_name[MAX_FILE_NAME];
+    int dc_inumber;
+} dcache_entry_t;
+
+static dcache_entry_t dcache[DCACHE_ENTRIES];
+static pthread_mutex_t dcache_locks[DCACHE_LOCKS];
+static atomic_size_t dcache_hits;
+static atomic_size_t dcache_misses;
+
+/*
+ * Block cache: the set of data blocks deemed to be in memory (rather than in
+ * secondary memory), bounded by tfs_params.block_cache_blocks. Accessing a
+ * cached block costs nothing; any other block pays the emulated latency of a
+ * block access to be brought in, evicting another one chosen by the CLOCK
+ * algorithm, which pays it again to be written back if it was changed.
+ *
+ * The contents of blocks always stay in fs_data (the cache only decides what
+ * an access costs), so a hit that races with the eviction of its block only
+ * skews the emulated costs. block_cache_index maps each block to the slot
+ * holding it, so hits take no lock; misses and evictions take
+ * block_cache_lock.
+ */
+typedef struct {
+    atomic_int bc_block; // -1 if the slot is unused
+    atomic_bool bc_referenced;
+    atomic_bool bc_dirty;
+} block_cache_slot_t;
+
+static block_cache_slot_t *block_cache;
+static size_t block_cache_size;
+static atomic_int *block_cache_index;
+static size_t block_cache_hand;
+static pthread_mutex_t block_cache_lock;
+static atomic_size_t block_cache_hits;
+static atomic_size_t block_cache_misses;
+static atomic_size_t block_cache_write_backs;
 
+/*
+ * Snapshots: frozen copies of the inode table, sharing their blocks with the
+ * FS (see block_refs). Changes to the names of the FS (which involve more than
+ * one inode) run between state_mutation_begin and state_mutation_end, holding
+ * one shard of the mutation barrier for reading; snapshot_create holds every
+ * shard for writing only to take the inode bitmap. It then copies the inodes
+ * one at a time, under their locks, while whoever changes an inode it has not
+ * copied yet (locking it for writing, or deleting it) copies it first.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t mb_lock;
+} mutation_barrier_shard_t;
+
+static mutation_barrier_shard_t mutation_barrier[MUTATION_BARRIER_SHARDS];
+static atomic_size_t mutation_next_shard;
+static _Thread_local int mutation_shard = -1;
+
+// The inodes a thread holds locked for writing (a directory and a file, at
+// most), which a snapshot started while it waited for the barrier has not
+// copied yet.
+#define WRITE_LOCKS_HELD_MAX (4)
+static _Thread_local int write_locks_held[WRITE_LOCKS_HELD_MAX];
+static _Thread_local size_t write_locks_held_count;
+
+typedef struct {
+    bool sn_taken;
+    size_t sn_inode_count;     // capacity of the inode table when taken
+    uint64_t *sn_inodes_taken; // the inode bitmap when taken
+    uint64_t *sn_inodes_copied; // inodes copied already (while being taken)
+    bool sn_failed;            // a link target could not be copied
+    inode_t *sn_inodes;
+    char **sn_sym_paths;       // link targets not kept in their inodes
+} snapshot_t;
+
+static snapshot_t snapshots[MAX_SNAPSHOTS];
+static pthread_mutex_t snapshots_lock;
+
+// The snapshot being taken, if any (snapshot_taking lets changes skip its
+// lock while there is none).
+static snapshot_t *snapshot_pending;
+static atomic_bool snapshot_taking;
+static pthread_mutex_t snapshot_pending_lock;
 
 // Mutex locks for thread_safety.
-static pthread_mutex_t inode_table_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t open_file_table_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t data_block_table_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Convenience macros
@@ -42,412 +293,2548 @@ static pthread_mutex_t data_block_table_lock = PTHREAD_MUTEX_INITIALIZER;
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
 #define BLOCK_SIZE (fs_params.block_size)
 #define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+#define INDIRECT_ENTRIES (BLOCK_SIZE / sizeof(int))
+#define BITMAP_WORD_BITS (64)
+#define BLOCK_BITMAP_WORDS ((DATA_BLOCKS + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+#define INODE_BITMAP_WORDS ((INODE_TABLE_SIZE + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+static inline size_t chunked_table_capacity(chunked_table_t *table) {
+    return atomic_load_explicit(&table->ct_capacity, memory_order_acquire);
+}
+
+static inline void *chunked_table_at(chunked_table_t const *table, size_t index) {
+    return (char *)table->ct_chunks[index / table->ct_chunk_entries] +
+           (index % table->ct_chunk_entries) * table->ct_entry_size;
+}
 
 static inline bool valid_inumber(int inumber) {
-    return inumber >= 0 && inumber < INODE_TABLE_SIZE;
+    return inumber >= 0 && (size_t)inumber < chunked_table_capacity(&inode_table);
 }
 
 static inline bool valid_block_number(int block_number) {
-    return block_number >= 0 && block_number < DATA_BLOCKS;
+    return block_number >= 0 && (size_t)block_number < chunked_table_capacity(&fs_data);
 }
 
 static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+    return file_handle >= 0 &&
+           (size_t)file_handle < chunked_table_capacity(&open_file_table);
+}
+
+static inline bool fs_data_mapped(void) {
+    return fs_params.data_mode == TFS_DATA_MAPPED;
+}
+
+static inline inode_t *inode_at(int inumber) {
+    return chunked_table_at(&inode_table, (size_t)inumber);
+}
+
+#ifdef TFS_INODE_PACKED
+static inline inode_lock_t *inode_lock_at(int inumber) {
+    return &((inode_packed_t *)chunked_table_at(&inode_table, (size_t)inumber))->ip_lock;
+}
+
+static inline inode_cold_t *inode_cold_at(int inumber) {
+    return &((inode_packed_t *)chunked_table_at(&inode_table, (size_t)inumber))->ip_cold;
+}
+#else
+static inline inode_lock_t *inode_lock_at(int inumber) {
+    char *chunk = inode_table.ct_chunks[inumber / INODE_TABLE_CHUNK];
+    inode_lock_t *locks = (inode_lock_t *)(chunk + INODE_TABLE_CHUNK * sizeof(inode_t));
+    return &locks[inumber % INODE_TABLE_CHUNK];
+}
+
+static inline inode_cold_t *inode_cold_at(int inumber) {
+    char *chunk = inode_table.ct_chunks[inumber / INODE_TABLE_CHUNK];
+    inode_cold_t *colds = (inode_cold_t *)(chunk + INODE_TABLE_CHUNK * (sizeof(inode_t) +
+                                                                        sizeof(inode_lock_t)));
+    return &colds[inumber % INODE_TABLE_CHUNK];
+}
+#endif
+
+static inline open_file_entry_t *open_file_at(int fhandle) {
+    return chunked_table_at(&open_file_table, (size_t)fhandle);
 }
 
 size_t state_block_size(void) { return BLOCK_SIZE; }
 
-/**
- * Do nothing, while preventing the compiler from performing any optimizations.
- *
- * We need to defeat the optimizer for the insert_delay() function.
- * Under optimization, the empty loop would be completely optimized away.
- * This function tells the compiler that the assembly code being run (which is
- * none) might potentially change *all memory in the process*.
- *
- * This prevents the optimizer from optimizing this code away, because it does
- * not know what it does and it may have side effects.
- *
- * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
- *
- * Exercise: try removing this function and look at the assembly generated to
- * compare.
- */
-static void touch_all_memory(void) { __asm volatile(""
-                                                    :
-                                                    :
-                                                    : "memory"); }
+size_t state_fragment_size(void) {
+    return BLOCK_SIZE % FRAGMENTS_PER_BLOCK == 0 ? BLOCK_SIZE / FRAGMENTS_PER_BLOCK : 0;
+}
+
+size_t state_max_file_size(void) {
+    return (INODE_DIRECT_BLOCKS + INDIRECT_ENTRIES +
+            INDIRECT_ENTRIES * INDIRECT_ENTRIES) * BLOCK_SIZE;
+}
 
 /**
- * Artifically delay execution (busy loop).
+ * Artificially delay execution by the cost of an access to a FS structure.
  *
- * Auxiliary function to insert a delay.
  * Used in accesses to persistent FS state as a way of emulating access
- * latencies as if such data structures were really stored in secondary memory.
+ * latencies as if such data structures were really stored in secondary memory
+ * (see tfs_latency_model).
  */
-static void insert_delay(void)
-{
-    for (int i = 0; i < DELAY; i++) {
-        touch_all_memory();
-    }
-}
-
-int state_init(tfs_params params)
+static void insert_delay(unsigned long ns)
 {
-    fs_params = params;
-    if (inode_table != NULL) {
-        return -1; // already initialized
-    }
-
-    inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-    freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-    free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
-    open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
-    free_open_file_entries = malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
-    
-    if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-        !open_file_table || !free_open_file_entries) {
-        return -1; // allocation failed
+    if (fs_params.latency.mode == TFS_LATENCY_NONE || ns == 0) {
+        return;
     }
 
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
+    struct timespec now;
+    ALWAYS_ASSERT(clock_gettime(CLOCK_MONOTONIC, &now) == 0,
+                "insert_delay: could not read the clock");
+    struct timespec deadline = {
+        .tv_sec = now.tv_sec + (time_t)(ns / 1000000000ul),
+        .tv_nsec = now.tv_nsec + (long)(ns % 1000000000ul),
+    };
+    if (deadline.tv_nsec >= 1000000000l) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000l;
     }
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+    if (fs_params.latency.mode == TFS_LATENCY_SLEEP) {
+        // Sleeps until the deadline, so that interruptions do not stretch it.
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+        }
+        return;
     }
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
+    while (now.tv_sec < deadline.tv_sec ||
+           (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec)) {
+        ALWAYS_ASSERT(clock_gettime(CLOCK_MONOTONIC, &now) == 0,
+                    "insert_delay: could not read the clock");
     }
-
-    return 0;
 }
 
-int state_destroy(void)
-{
-    pthread_mutex_destroy(&inode_table_lock);
-    pthread_mutex_destroy(&open_file_table_lock);
-    pthread_mutex_destroy(&data_block_table_lock);
+static void *chunk_malloc(size_t first, size_t size) {
+    (void)first;
+    return malloc(size);
+}
 
-    free(inode_table);
-    free(freeinode_ts);
-    free(fs_data);
-    free(free_blocks);
-    free(open_file_table);
-    free(free_open_file_entries);
+static void chunk_free(void *chunk, size_t size) {
+    (void)size;
+    free(chunk);
+}
 
-    inode_table = NULL;
-    freeinode_ts = NULL;
-    fs_data = NULL;
-    free_blocks = NULL;
-    open_file_table = NULL;
-    free_open_file_entries = NULL;
+/**
+ * Set up an empty chunked table.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int chunked_table_init(chunked_table_t *table, size_t chunk_entries,
+                              size_t entry_size, size_t limit) {
+    table->ct_chunk_entries = chunk_entries;
+    table->ct_entry_size = entry_size;
+    table->ct_limit = limit;
+    atomic_init(&table->ct_capacity, 0);
+    table->ct_alloc_chunk = chunk_malloc;
+    table->ct_free_chunk = chunk_free;
+    table->ct_chunks = calloc((limit + chunk_entries - 1) / chunk_entries,
+                              sizeof(void *));
+    if (table->ct_chunks == NULL) {
+        return -1;
+    }
 
+    ALWAYS_ASSERT(pthread_mutex_init(&table->ct_grow_lock, NULL) == 0, 
+                "The table's growth lock could not be initialized.");
     return 0;
 }
 
 /**
- * (Try to) Allocate a new inode in the inode table, without initializing its
- * data.
+ * Add a chunk to a table, unless another thread already grew it.
  *
- * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ * Input:
+ *   - table: the table
+ *   - seen_capacity: the capacity for which the table was found to be full
+ *   - init_chunk: initializes the entries [first, first + count) (may be NULL)
+ *   - release_chunk: hands the entries over to the table's allocator
  *
- * Possible errors:
- *   - No free slots in inode table.
+ * Returns true if the table has grown since seen_capacity, false if it is at
+ * its limit (or memory ran out).
  */
-static int inode_alloc(void)
-{  
-    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            // Simulate storage access delay (to freeinode_ts).
-            insert_delay(); 
+static bool chunked_table_grow(chunked_table_t *table, size_t seen_capacity,
+                               void (*init_chunk)(size_t first, size_t count),
+                               void (*release_chunk)(size_t first, size_t count)) {
+    ALWAYS_ASSERT(pthread_mutex_lock(&table->ct_grow_lock) == 0, 
+                "The table's growth lock could not be locked.");
+
+    size_t first = atomic_load_explicit(&table->ct_capacity, memory_order_relaxed);
+    bool grown = first != seen_capacity;
+    if (!grown && first < table->ct_limit) {
+        size_t count = table->ct_limit - first;
+        if (count > table->ct_chunk_entries) {
+            count = table->ct_chunk_entries;
         }
 
-        // Locks the following code to prevent parallel access.
-        ALWAYS_ASSERT(pthread_mutex_lock(&inode_table_lock) == 0, "The inode table could't be locked");
+        void *chunk = table->ct_alloc_chunk(first, count * table->ct_entry_size);
+        if (chunk != NULL) {
+            table->ct_chunks[first / table->ct_chunk_entries] = chunk;
+            if (init_chunk != NULL) {
+                init_chunk(first, count);
+            }
+            atomic_store_explicit(&table->ct_capacity, first + count,
+                                  memory_order_release);
+            release_chunk(first, count);
+            grown = true;
+        }
+    }
 
-        // Finds first free entry in inode table.
+    ALWAYS_ASSERT(pthread_mutex_unlock(&table->ct_grow_lock) == 0, 
+                "The table's growth lock could not be unlocked.");
+    return grown;
+}
 
-        if (freeinode_ts[inumber] == FREE) {
+/**
+ * Free every chunk of a table.
+ */
+static void chunked_table_destroy(chunked_table_t *table) {
+    if (table->ct_chunks == NULL) {
+        return;
+    }
 
-            // Found a free entry, so takes it for the new inode.
-            freeinode_ts[inumber] = TAKEN;
-            
-            // Unlocks the code so that other tasks can perform it.
-            ALWAYS_ASSERT(pthread_mutex_unlock(&inode_table_lock) == 0, "The inode table could't be unlocked");
-            return (int)inumber;
+    size_t chunks = (table->ct_limit + table->ct_chunk_entries - 1) /
+                    table->ct_chunk_entries;
+    for (size_t i = 0; i < chunks; i++) {
+        if (table->ct_chunks[i] != NULL) {
+            size_t first = i * table->ct_chunk_entries;
+            size_t count = table->ct_limit - first < table->ct_chunk_entries
+                               ? table->ct_limit - first
+                               : table->ct_chunk_entries;
+            table->ct_free_chunk(table->ct_chunks[i], count * table->ct_entry_size);
         }
+    }
+    free(table->ct_chunks);
+    table->ct_chunks = NULL;
+    atomic_store_explicit(&table->ct_capacity, 0, memory_order_relaxed);
+    pthread_mutex_destroy(&table->ct_grow_lock);
+}
 
-        // Unlocks the code so that other tasks can perform it.
-        ALWAYS_ASSERT(pthread_mutex_unlock(&inode_table_lock) == 0, "The inode table could't be unlocked");
+/**
+ * Inode locks live as long as the FS (not as long as the inode), so a thread
+ * can always wait on the lock of an inode it found in a directory.
+ */
+static void inode_table_init_chunk(size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++) {
+        inode_t *inode = inode_at((int)i);
+        inode_lock_t *lock = inode_lock_at((int)i);
+        ALWAYS_ASSERT(pthread_rwlock_init(&lock->il_lock, NULL) == 0, 
+                    "The inode's lock could not be initialized.");
+        atomic_init(&lock->il_open_count, 0);
+        inode->i_inumber = (int)i;
+        inode_cold_at((int)i)->ic_sym_path = NULL;
+        atomic_init(&inode->i_seq, 0);
     }
-     
-    // No free inodes were found.
-    return -1;
 }
 
-int inode_create(inode_type i_type)
-{
-    // Allocates a new inode. 
-    // Returns -1 if there are no free slots in inode table.
-    
-    int inumber = inode_alloc();
-    if (inumber == -1) {
-        return -1; 
+/**
+ * Chunks of the inode table hold the three arrays of their inodes, aligned to
+ * cache lines.
+ */
+static void *inode_table_alloc_chunk(size_t first, size_t size) {
+    (void)first;
+    (void)size;
+    return aligned_alloc(CACHE_LINE_SIZE, INODE_CHUNK_SIZE);
+}
+
+static void inode_table_release_chunk(size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++) {
+        atomic_fetch_and_explicit(&freeinode_ts[i / BITMAP_WORD_BITS],
+                                  ~(UINT64_C(1) << (i % BITMAP_WORD_BITS)),
+                                  memory_order_release);
     }
+}
 
-    inode_t *inode = &inode_table[inumber];
-    // Simulate storage access delay (to inode).
-    insert_delay(); 
+/**
+ * New blocks are released with data_block_table_lock held (by
+ * data_block_alloc_extent, or by state_init).
+ */
+static void fs_data_release_chunk(size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++) {
+        free_blocks[i / BITMAP_WORD_BITS] &= ~(UINT64_C(1) << (i % BITMAP_WORD_BITS));
+    }
+}
 
-    // Initializes the hard link counter to 1 and is type to the input.
-    inode->hard_link_counter = 1;
-    inode->i_node_type = i_type;
+/**
+ * Open file locks also live as long as the FS, so that a thread can wait on
+ * the lock of a file handle that is being closed.
+ */
+static void open_file_table_init_chunk(size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++) {
+        ALWAYS_ASSERT(pthread_mutex_init(&open_file_at((int)i)->open_file_lock, NULL) == 0, 
+                    "The open file's lock could not be initialized.");
+        free_open_file_entries[i] = FREE;
+    }
+}
 
-    // Initializes the inode's lock.
-    ALWAYS_ASSERT(pthread_rwlock_init(&inode->inode_lock, NULL) == 0, 
-                "The inode's lock could not be initialized.");
-    
+static void open_file_table_release_chunk(size_t first, size_t count) {
+    // Lower handles are pushed last, so they are handed out first.
+    for (size_t i = first + count; i-- > first;) {
+        open_file_shard_t *shard = &open_file_shards[i % open_file_shard_count];
+        ALWAYS_ASSERT(pthread_mutex_lock(&shard->ofs_lock) == 0, 
+                    "The open file table's lock could not be locked.");
+        open_file_next_free[i] = shard->ofs_free_head;
+        shard->ofs_free_head = (int)i;
+        ALWAYS_ASSERT(pthread_mutex_unlock(&shard->ofs_lock) == 0, 
+                    "The open file table's lock could not be unlocked.");
+    }
+}
 
-    switch (i_type) {
-    case T_DIRECTORY: {
-        // Initializes directory (filling its block with empty entries, labeled
-        // with inumber==-1).
-        int b = data_block_alloc();
-        if (b == -1) {
-            // Ensure fields are initialized.
-            inode->i_size = 0;
-            inode->i_data_block = -1;
-            inode->sym_path = NULL;
+static inline bool inode_is_taken(size_t inumber) {
+    return (atomic_load(&freeinode_ts[inumber / BITMAP_WORD_BITS]) &
+            (UINT64_C(1) << (inumber % BITMAP_WORD_BITS))) != 0;
+}
 
-            // Run regular deletion process.
-            inode_delete(inumber);
-            return -1;
-        }
+static inline off_t image_inode_offset(size_t inumber) {
+    return (off_t)(IMAGE_ALIGNMENT + inumber * sizeof(image_inode_t));
+}
 
-        inode_table[inumber].i_size = BLOCK_SIZE;
-        inode_table[inumber].i_data_block = b;
+static inline off_t image_inode_bitmap_offset(void) {
+    return image_inode_offset(INODE_TABLE_SIZE);
+}
 
-        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-        ALWAYS_ASSERT(dir_entry != NULL, "inode_create: data block freed while in use");
+static inline off_t image_block_bitmap_offset(void) {
+    return image_inode_bitmap_offset() +
+           (off_t)(INODE_BITMAP_WORDS * sizeof(uint64_t));
+}
 
-        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-            dir_entry[i].d_inumber = -1;
+static inline off_t image_block_offset(size_t block_number) {
+    size_t bitmaps_end = (size_t)image_block_bitmap_offset() +
+                         BLOCK_BITMAP_WORDS * sizeof(uint64_t);
+    size_t data_start = (bitmaps_end + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT *
+                        IMAGE_ALIGNMENT;
+    return (off_t)(data_start + block_number * BLOCK_SIZE);
+}
+
+/**
+ * Read or write a range of the image (retrying partial transfers).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int image_transfer(bool write, void *buffer, size_t len, off_t offset) {
+    char *bytes = buffer;
+    while (len > 0) {
+        ssize_t done = write ? pwrite(image_fd, bytes, len, offset)
+                             : pread(image_fd, bytes, len, offset);
+        if (done == -1 && errno == EINTR) {
+            continue;
         }
+        if (done <= 0) {
+            return -1; // I/O error, or the image is truncated.
+        }
+        bytes += done;
+        len -= (size_t)done;
+        offset += done;
     }
-    break;
-    case T_FILE:
-    case T_SYMLINK:
-        // In case of a new file, simply sets its size to 0
-        inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
-        inode_table[inumber].sym_path = NULL;
-        break;
-    default:
-        PANIC("inode_create: unknown file type");
-    }
+    return 0;
+}
 
-    return inumber;
+/**
+ * Close the image file (if it is open).
+ */
+static void image_close(void) {
+    if (image_fd != -1) {
+        close(image_fd);
+        image_fd = -1;
+    }
+    free(image_path);
+    free(image_new_path);
+    image_path = NULL;
+    image_new_path = NULL;
+    image_loaded = false;
 }
 
-void inode_delete(int inumber) {
-    // Simulate storage access delay (to inode and freeinode_ts).
-    insert_delay();
-    insert_delay();
+/**
+ * Open (or create) the image file and read its superblock. If the image holds
+ * an FS, fs_params takes its limits and block size and image_loaded is set.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int image_open(char const *path, image_superblock_t *superblock) {
+    image_path = strdup(path);
+    image_new_path = malloc(strlen(path) + sizeof(".new"));
+    if (image_path == NULL || image_new_path == NULL) {
+        image_close();
+        return -1;
+    }
+    strcpy(image_new_path, path);
+    strcat(image_new_path, ".new");
 
-    //TODO: Lock aqui? Talvez. Correia faz sempre lock em condiçoes basicamente
-    ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
+    image_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (image_fd == -1) {
+        image_close();
+        return -1;
+    }
 
-    ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN, "inode_delete: inode already freed");
+    struct stat st;
+    if (fstat(image_fd, &st) != 0) {
+        image_close();
+        return -1;
+    }
+    if (st.st_size == 0) {
+        return 0; // A new image.
+    }
 
-    if (inode_table[inumber].i_size > 0) {
-        ALWAYS_ASSERT(pthread_rwlock_destroy(&inode_table[inumber].inode_lock) == 0, 
-                    "The inode's lock could not be destroyed.");
-        data_block_free(inode_table[inumber].i_data_block);
+    if (image_transfer(false, superblock, sizeof(*superblock), 0) != 0 ||
+        superblock->sb_magic != IMAGE_MAGIC || superblock->sb_block_size == 0 ||
+        superblock->sb_block_size % sizeof(int) != 0 ||
+        superblock->sb_inode_capacity > superblock->sb_max_inode_count ||
+        superblock->sb_block_capacity > superblock->sb_max_block_count ||
+        superblock->sb_max_block_count > INT32_MAX) {
+        image_close();
+        return -1; // Not an image.
     }
 
-    freeinode_ts[inumber] = FREE;
+    image_generation = superblock->sb_generation;
+    fs_params.block_size = superblock->sb_block_size;
+    fs_params.max_inode_count = superblock->sb_max_inode_count;
+    fs_params.max_block_count = superblock->sb_max_block_count;
+    image_loaded = true;
+    return 0;
 }
 
-inode_t *inode_get(int inumber, bool mode) {
-    ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
-    
-    insert_delay(); // Simulate storage access delay to inode.
-    // If mode is on read (true), lock on read. Else, write lock.
-    if(mode) {
-        ALWAYS_ASSERT(pthread_rwlock_rdlock(&inode_table[inumber].inode_lock) == 0, 
-                    "The inode's lock could not be rdlocked.");
-    } 
-    else if (!mode) {
-        ALWAYS_ASSERT(pthread_rwlock_wrlock(&inode_table[inumber].inode_lock) == 0, 
-                    "The inode's lock could not be wrlocked.");
-        
-        
-    } else {
-        return NULL;
-    } 
+/**
+ * Mask of a run of fragments in a block's fragment map.
+ */
+static inline uint8_t fragment_mask(size_t first, size_t count) {
+    return (uint8_t)(((1u << count) - 1) << first);
+}
+
+/**
+ * Remember a block with free fragments (the data block table's lock must be
+ * held), in place of an entry that is stale or has no room left, or else of
+ * the oldest one.
+ */
+static void fragment_partial_add(int block_number) {
+    size_t slot = fragment_partial_next;
+    for (size_t i = 0; i < FRAGMENT_PARTIAL_BLOCKS; i++) {
+        int b = fragment_partial[i];
+        if (b == block_number) {
+            return;
+        }
+        if (b == -1 || fragment_maps[b] == 0 || fragment_maps[b] == UINT8_MAX) {
+            slot = i;
+        }
+    }
+    if (slot == fragment_partial_next) {
+        fragment_partial_next = (fragment_partial_next + 1) % FRAGMENT_PARTIAL_BLOCKS;
+    }
+    fragment_partial[slot] = block_number;
+}
 
-    return &inode_table[inumber];
+/**
+ * Check that a block number read from an image is -1 or one of its blocks.
+ */
+static bool image_block_valid(int64_t block_number, uint64_t block_capacity) {
+    return block_number == -1 ||
+           (block_number >= 0 && (uint64_t)block_number < block_capacity);
 }
 
+/**
+ * Check that an inode read from an image is consistent, so that a damaged
+ * image is rejected rather than trusted (its fields index the block map,
+ * i_inline and the data blocks).
+ *
+ * Input:
+ *   - image: the inode, as read from the image
+ *   - block_capacity: the number of data blocks in the image
+ */
+static bool image_inode_valid(image_inode_t const *image, uint64_t block_capacity) {
+    if (image->ii_node_type != T_FILE && image->ii_node_type != T_DIRECTORY &&
+        image->ii_node_type != T_SYMLINK) {
+        return false;
+    }
+    if (image->ii_size > state_max_file_size() ||
+        image->ii_extent_count > INODE_EXTENTS) {
+        return false;
+    }
 
-int clear_dir_entry(inode_t *inode, char const *sub_name) {
-    insert_delay();
-    if (inode->i_node_type != T_DIRECTORY) {
-        
-        return -1; // not a directory
+    for (size_t b = 0; b < INODE_DIRECT_BLOCKS; b++) {
+        if (!image_block_valid(image->ii_direct_blocks[b], block_capacity)) {
+            return false;
+        }
+    }
+    if (!image_block_valid(image->ii_indirect_block, block_capacity) ||
+        !image_block_valid(image->ii_double_indirect_block, block_capacity)) {
+        return false;
+    }
+    for (size_t e = 0; e < image->ii_extent_count; e++) {
+        int64_t start = image->ii_extents[e].ie_start;
+        uint64_t length = image->ii_extents[e].ie_length;
+        if (start < 0 || (uint64_t)start >= block_capacity || length == 0 ||
+            length > block_capacity - (uint64_t)start) {
+            return false;
+        }
     }
 
-    // Locates the block containing the entries of the directory.
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL, "clear_dir_entry: directory must have a data block");
+    // Inline contents take the place of the block map (and of extents), and
+    // fragments lie within the first block.
+    if (image->ii_inline_data != 0) {
+        return image->ii_extent_count == 0 && image->ii_fragment_count == 0 &&
+               (image->ii_node_type != T_FILE || image->ii_size <= INODE_INLINE_SIZE);
+    }
+    if (image->ii_fragment_count > 0) {
+        return image->ii_fragment_count < FRAGMENTS_PER_BLOCK &&
+               image->ii_first_fragment <=
+                   FRAGMENTS_PER_BLOCK - image->ii_fragment_count &&
+               image->ii_direct_blocks[0] != -1 && image->ii_extent_count == 0 &&
+               image->ii_size <= image->ii_fragment_count * state_fragment_size();
+    }
+    return image->ii_first_fragment == 0;
+}
 
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            dir_entry[i].d_inumber = -1;
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
+/**
+ * Count an owner of a block of a loaded image, and (the first time an indirect
+ * block is counted) the blocks it references. block_refs holds the number of
+ * owners of each block while they are counted.
+ *
+ * Input:
+ *   - block_number: the block
+ *   - depth: 0 for a block of data, 1 for a single indirect block, 2 for a
+ *     double indirect block
+ *
+ * Returns true if successful, false if an indirect block references a block
+ * the image does not have.
+ */
+static bool block_refs_count(int block_number, int depth) {
+    if (block_refs[block_number]++ > 0 || depth == 0) {
+        return true;
+    }
 
-            return 0;
+    int const *entries = chunked_table_at(&fs_data, (size_t)block_number);
+    for (size_t i = 0; i < INDIRECT_ENTRIES; i++) {
+        if (!image_block_valid(entries[i], chunked_table_capacity(&fs_data))) {
+            return false;
+        }
+        if (entries[i] != -1 && !block_refs_count(entries[i], depth - 1)) {
+            return false;
         }
     }
-    
-    return -1; // sub_name not found.
+    return true;
 }
 
-int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
-    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
-        
-        return -1; // Invalid sub_name.
+/**
+ * Load the inodes, bitmaps and data blocks from the image, growing the tables
+ * to the capacity recorded in its superblock.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int image_load(image_superblock_t const *superblock) {
+    size_t capacity;
+    while ((capacity = chunked_table_capacity(&inode_table)) <
+           superblock->sb_inode_capacity) {
+        if (!chunked_table_grow(&inode_table, capacity, inode_table_init_chunk,
+                                inode_table_release_chunk)) {
+            return -1;
+        }
+    }
+    while ((capacity = chunked_table_capacity(&fs_data)) <
+           superblock->sb_block_capacity) {
+        if (!chunked_table_grow(&fs_data, capacity, NULL, fs_data_release_chunk)) {
+            return -1;
+        }
     }
 
-    insert_delay(); // Simulate storage access delay to inode with inumber.
-    if (inode->i_node_type != T_DIRECTORY) {
-        
-        return -1; // Not a directory.
+    // The bitmaps replace the ones left by growing the tables.
+    uint64_t *inode_bitmap = malloc(INODE_BITMAP_WORDS * sizeof(uint64_t));
+    if (inode_bitmap == NULL ||
+        image_transfer(false, inode_bitmap, INODE_BITMAP_WORDS * sizeof(uint64_t),
+                       image_inode_bitmap_offset()) != 0 ||
+        image_transfer(false, free_blocks, BLOCK_BITMAP_WORDS * sizeof(uint64_t),
+                       image_block_bitmap_offset()) != 0) {
+        free(inode_bitmap);
+        return -1;
+    }
+    for (size_t i = 0; i < INODE_BITMAP_WORDS; i++) {
+        atomic_store(&freeinode_ts[i], inode_bitmap[i]);
     }
+    free(inode_bitmap);
 
-    // Locates the block containing the entries of the directory.
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL, "add_dir_entry: directory must have a data block");
+    size_t inodes = chunked_table_capacity(&inode_table);
+    for (size_t i = 0; i < inodes; i++) {
+        if (!inode_is_taken(i)) {
+            continue; // Free inode.
+        }
 
-    // Finds and fills the first empty entry.
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+        image_inode_t image;
+        if (image_transfer(false, &image, sizeof(image), image_inode_offset(i)) != 0 ||
+            !image_inode_valid(&image, superblock->sb_block_capacity)) {
+            return -1;
+        }
 
-            
-            return 0;
+        inode_t *inode = inode_at((int)i);
+        inode->i_node_type = (inode_type)image.ii_node_type;
+        inode->hard_link_counter = image.ii_hard_link_counter;
+        inode->i_size = image.ii_size;
+        for (size_t b = 0; b < INODE_DIRECT_BLOCKS; b++) {
+            inode->i_direct_blocks[b] = image.ii_direct_blocks[b];
+        }
+        inode->i_indirect_block = image.ii_indirect_block;
+        inode->i_double_indirect_block = image.ii_double_indirect_block;
+        inode->i_extent_count = image.ii_extent_count;
+        for (size_t e = 0; e < inode->i_extent_count; e++) {
+            inode->i_extents[e].e_file_block = image.ii_extents[e].ie_file_block;
+            inode->i_extents[e].e_start = (int)image.ii_extents[e].ie_start;
+            inode->i_extents[e].e_length = image.ii_extents[e].ie_length;
+        }
+
+        inode->i_inline_data = image.ii_inline_data != 0;
+        if (inode->i_node_type == T_SYMLINK) {
+            image.ii_inline[MAX_PATH_NAME - 1] = '\0';
+            if (inode_set_sym_path(inode, image.ii_inline) != 0) {
+                return -1;
+            }
+        } else if (inode->i_inline_data) {
+            memcpy(inode->i_inline, image.ii_inline, INODE_INLINE_SIZE);
+        }
+
+        // The fragments in use are only recorded in their files' inodes.
+        inode->i_fragment_count = (uint8_t)image.ii_fragment_count;
+        inode->i_first_fragment = (uint8_t)image.ii_first_fragment;
+        if (inode->i_fragment_count > 0) {
+            fragment_maps[inode->i_direct_blocks[0]] |=
+                fragment_mask(inode->i_first_fragment, inode->i_fragment_count);
+            fragment_partial_add(inode->i_direct_blocks[0]);
         }
     }
 
+    // Mapped blocks are already there; otherwise, chunks of blocks are
+    // contiguous in memory, so each is read in one go.
+    size_t blocks = fs_data_mapped() ? 0 : chunked_table_capacity(&fs_data);
+    for (size_t first = 0; first < blocks; first += DATA_BLOCKS_CHUNK) {
+        size_t count = blocks - first < DATA_BLOCKS_CHUNK ? blocks - first
+                                                          : DATA_BLOCKS_CHUNK;
+        if (image_transfer(false, chunked_table_at(&fs_data, first), count * BLOCK_SIZE,
+                           image_block_offset(first)) != 0) {
+            return -1;
+        }
+    }
+
+    // Files copied from a snapshot may share blocks, which the image does not
+    // record: they are counted again.
+    for (size_t i = 0; i < inodes; i++) {
+        inode_t const *inode = inode_at((int)i);
+        if (!inode_is_taken(i) || inode->i_inline_data || inode->i_fragment_count > 0) {
+            continue;
+        }
+        for (size_t b = 0; b < INODE_DIRECT_BLOCKS; b++) {
+            if (inode->i_direct_blocks[b] != -1) {
+                block_refs_count(inode->i_direct_blocks[b], 0);
+            }
+        }
+        if ((inode->i_indirect_block != -1 &&
+             !block_refs_count(inode->i_indirect_block, 1)) ||
+            (inode->i_double_indirect_block != -1 &&
+             !block_refs_count(inode->i_double_indirect_block, 2))) {
+            return -1;
+        }
+    }
+    size_t capacity_blocks = chunked_table_capacity(&fs_data);
+    for (size_t b = 0; b < capacity_blocks; b++) {
+        if (block_refs[b] > 0 && --block_refs[b] > 0) {
+            atomic_fetch_add_explicit(&shared_blocks, 1, memory_order_relaxed);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Map a chunk of data blocks from the image (extending the image to cover
+ * it, which leaves a hole until the blocks are written).
+ */
+static void *fs_data_map_chunk(size_t first, size_t size) {
+    off_t offset = image_block_offset(first);
+    struct stat st;
+    if (fstat(image_fd, &st) != 0 ||
+        (st.st_size < offset + (off_t)size &&
+         ftruncate(image_fd, offset + (off_t)size) != 0)) {
+        return NULL;
+    }
+
+    void *chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, image_fd, offset);
+    if (chunk == MAP_FAILED) {
+        return NULL;
+    }
+
+#ifdef MADV_POPULATE_READ
+    // Prefaulted for reading (populating a private mapping for writing would
+    // copy each of its pages).
+    if (fs_params.data_populate) {
+        madvise(chunk, size, MADV_POPULATE_READ);
+    }
+#endif
+
+#ifdef MADV_HUGEPAGE
+    // Only a hint: the kernel may not back files with huge pages.
+    if (fs_params.data_hugepages) {
+        madvise(chunk, size, MADV_HUGEPAGE);
+    }
+#endif
+    return chunk;
+}
+
+static void fs_data_unmap_chunk(void *chunk, size_t size) {
+    munmap(chunk, size);
+}
+
+/**
+ * Check if an inode of a snapshot was in use when it was taken.
+ */
+static inline bool snapshot_inode_taken(snapshot_t const *snapshot, size_t inumber) {
+    return (snapshot->sn_inodes_taken[inumber / BITMAP_WORD_BITS] &
+            (UINT64_C(1) << (inumber % BITMAP_WORD_BITS))) != 0;
+}
+
+/**
+ * Release the memory of a snapshot (not the blocks it shares).
+ */
+static void snapshot_free(snapshot_t *snapshot) {
+    if (snapshot->sn_sym_paths != NULL) {
+        for (size_t i = 0; i < snapshot->sn_inode_count; i++) {
+            free(snapshot->sn_sym_paths[i]);
+        }
+    }
+    free(snapshot->sn_sym_paths);
+    free(snapshot->sn_inodes);
+    free(snapshot->sn_inodes_taken);
+    free(snapshot->sn_inodes_copied);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+/**
+ * Add an owner to a data block. Must be called with data_block_table_lock
+ * held.
+ */
+static void block_ref_locked(int block_number) {
+    ALWAYS_ASSERT(block_refs[block_number] < UINT16_MAX,
+                "block_ref_locked: too many owners of a block");
+    if (block_refs[block_number]++ == 0) {
+        atomic_fetch_add_explicit(&shared_blocks, 1, memory_order_relaxed);
+    }
+}
+
+
+/**
+ * Add an owner to every block an inode refers to (its indirect blocks stand
+ * for the blocks they reference). Must be called with data_block_table_lock
+ * held.
+ */
+static void inode_blocks_ref_locked(inode_t const *inode) {
+    if (inode->i_fragment_count > 0) {
+        block_ref_locked(inode->i_direct_blocks[0]);
+        return;
+    }
+
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        if (inode->i_direct_blocks[i] != -1) {
+            block_ref_locked(inode->i_direct_blocks[i]);
+        }
+    }
+    if (inode->i_indirect_block != -1) {
+        block_ref_locked(inode->i_indirect_block);
+    }
+    if (inode->i_double_indirect_block != -1) {
+        block_ref_locked(inode->i_double_indirect_block);
+    }
+}
+
+
+/**
+ * Copy an inode into the snapshot being taken, unless it is copied already or
+ * was not in use when the snapshot was started. Must be called with
+ * snapshot_pending_lock held, while the inode can not change.
+ */
+static void snapshot_inode_copy_locked(snapshot_t *snapshot, size_t inumber) {
+    uint64_t bit = UINT64_C(1) << (inumber % BITMAP_WORD_BITS);
+    if (inumber >= snapshot->sn_inode_count || !snapshot_inode_taken(snapshot, inumber) ||
+        (snapshot->sn_inodes_copied[inumber / BITMAP_WORD_BITS] & bit) != 0) {
+        return;
+    }
+    snapshot->sn_inodes_copied[inumber / BITMAP_WORD_BITS] |= bit;
+
+    inode_t const *inode = inode_at((int)inumber);
+    memcpy(&snapshot->sn_inodes[inumber], inode, sizeof(inode_t));
+    if (inode->i_node_type == T_SYMLINK && !inode->i_inline_data) {
+        snapshot->sn_sym_paths[inumber] = strdup(inode_cold_at((int)inumber)->ic_sym_path);
+        snapshot->sn_failed |= snapshot->sn_sym_paths[inumber] == NULL;
+    }
+
+    // The blocks of the inode gain the snapshot as an owner.
+    ALWAYS_ASSERT(pthread_mutex_lock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be locked.");
+    inode_blocks_ref_locked(&snapshot->sn_inodes[inumber]);
+    ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be unlocked.");
+}
+
+/**
+ * Copy an inode that is about to change into the snapshot being taken (if
+ * any, and if it has not copied it yet).
+ */
+static void snapshot_inode_save(int inumber) {
+    if (!atomic_load_explicit(&snapshot_taking, memory_order_acquire)) {
+        return;
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&snapshot_pending_lock) == 0,
+                "The pending snapshot's lock could not be locked.");
+    if (snapshot_pending != NULL) {
+        snapshot_inode_copy_locked(snapshot_pending, (size_t)inumber);
+    }
+    ALWAYS_ASSERT(pthread_mutex_unlock(&snapshot_pending_lock) == 0,
+                "The pending snapshot's lock could not be unlocked.");
+}
+
+int state_init(tfs_params params)
+{
+    if (inode_table.ct_chunks != NULL) {
+        return -1; // already initialized
+    }
+    fs_params = params;
+
+    // An existing image brings its own limits and block size.
+    image_superblock_t superblock;
+    image_generation = 0;
+    if (params.image_path != NULL &&
+        image_open(params.image_path, &superblock) != 0) {
+        return -1;
+    }
+
+    // Mapped chunks of blocks must start at page boundaries of the image.
+    if (fs_data_mapped() &&
+        (image_fd == -1 ||
+         (DATA_BLOCKS_CHUNK * BLOCK_SIZE) % (size_t)sysconf(_SC_PAGESIZE) != 0)) {
+        image_close();
+        return -1;
+    }
+
+    // The locks are destroyed by state_destroy, so they must be initialized
+    // again for the FS to be reinitialized. They come first, as from here on
+    // a failure is undone by state_destroy (which copes with the tables and
+    // buffers that were not allocated yet).
+    open_file_shard_count = MAX_OPEN_FILES < OPEN_FILE_SHARDS ? MAX_OPEN_FILES
+                                                               : OPEN_FILE_SHARDS;
+    for (size_t i = 0; i < open_file_shard_count; i++) {
+        ALWAYS_ASSERT(pthread_mutex_init(&open_file_shards[i].ofs_lock, NULL) == 0, 
+                    "The open file table's lock could not be initialized.");
+        open_file_shards[i].ofs_free_head = -1;
+    }
+    atomic_store(&open_file_next_home, 0);
+    ALWAYS_ASSERT(pthread_mutex_init(&data_block_table_lock, NULL) == 0, 
+                "The data block table's lock could not be initialized.");
+    atomic_store(&shared_blocks, 0);
+
+    for (size_t i = 0; i < MUTATION_BARRIER_SHARDS; i++) {
+        ALWAYS_ASSERT(pthread_rwlock_init(&mutation_barrier[i].mb_lock, NULL) == 0,
+                    "The mutation barrier's lock could not be initialized.");
+    }
+    ALWAYS_ASSERT(pthread_mutex_init(&snapshots_lock, NULL) == 0,
+                "The snapshots' lock could not be initialized.");
+    memset(snapshots, 0, sizeof(snapshots));
+    ALWAYS_ASSERT(pthread_mutex_init(&snapshot_pending_lock, NULL) == 0,
+                "The pending snapshot's lock could not be initialized.");
+    snapshot_pending = NULL;
+    atomic_store(&snapshot_taking, false);
+
+    for (size_t i = 0; i < DCACHE_LOCKS; i++) {
+        ALWAYS_ASSERT(pthread_mutex_init(&dcache_locks[i], NULL) == 0, 
+                    "The dentry cache's lock could not be initialized.");
+    }
+    ALWAYS_ASSERT(pthread_mutex_init(&block_cache_lock, NULL) == 0,
+                "The block cache's lock could not be initialized.");
+
+    // The tables start with a single chunk and grow as they fill up; the
+    // bitmaps and the free lists are sized for the limits, as they are small.
+    if (chunked_table_init(&inode_table, INODE_TABLE_CHUNK, INODE_ENTRY_SIZE,
+                           INODE_TABLE_SIZE) != 0 ||
+        chunked_table_init(&fs_data, DATA_BLOCKS_CHUNK, BLOCK_SIZE, DATA_BLOCKS) != 0 ||
+        chunked_table_init(&open_file_table, OPEN_FILE_TABLE_CHUNK,
+                           sizeof(open_file_entry_t), MAX_OPEN_FILES) != 0) {
+        state_destroy();
+        return -1; // allocation failed
+    }
+    inode_table.ct_alloc_chunk = inode_table_alloc_chunk;
+    if (fs_data_mapped()) {
+        fs_data.ct_alloc_chunk = fs_data_map_chunk;
+        fs_data.ct_free_chunk = fs_data_unmap_chunk;
+    }
+
+    freeinode_ts = malloc(INODE_BITMAP_WORDS * sizeof(*freeinode_ts));
+    free_blocks = malloc(BLOCK_BITMAP_WORDS * sizeof(uint64_t));
+    fragment_maps = calloc(DATA_BLOCKS, sizeof(uint8_t));
+    zero_block = calloc(1, BLOCK_SIZE);
+    block_refs = calloc(DATA_BLOCKS, sizeof(uint16_t));
+    free_open_file_entries = malloc(MAX_OPEN_FILES * sizeof(*free_open_file_entries));
+    open_file_next_free = malloc(MAX_OPEN_FILES * sizeof(int));
     
+    if (!freeinode_ts || !free_blocks || !fragment_maps || !zero_block ||
+        !block_refs || !free_open_file_entries || !open_file_next_free) {
+        state_destroy();
+        return -1; // allocation failed
+    }
+
+    for (size_t i = 0; i < DCACHE_ENTRIES; i++) {
+        dcache[i].dc_dir_inumber = -1;
+    }
+    atomic_store(&dcache_hits, 0);
+    atomic_store(&dcache_misses, 0);
+
+    block_cache_size = fs_params.block_cache_blocks < DATA_BLOCKS
+                           ? fs_params.block_cache_blocks
+                           : DATA_BLOCKS;
+    block_cache = malloc(block_cache_size * sizeof(block_cache_slot_t));
+    block_cache_index = malloc(DATA_BLOCKS * sizeof(atomic_int));
+    if ((block_cache_size > 0 && block_cache == NULL) || block_cache_index == NULL) {
+        state_destroy();
+        return -1; // allocation failed
+    }
+    for (size_t i = 0; i < block_cache_size; i++) {
+        atomic_init(&block_cache[i].bc_block, -1);
+        atomic_init(&block_cache[i].bc_referenced, false);
+        atomic_init(&block_cache[i].bc_dirty, false);
+    }
+    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+        atomic_init(&block_cache_index[i], -1);
+    }
+    block_cache_hand = 0;
+    atomic_store(&block_cache_hits, 0);
+    atomic_store(&block_cache_misses, 0);
+    atomic_store(&block_cache_write_backs, 0);
+
+    // Every inode and block is marked as taken until its chunk is added.
+    for (size_t i = 0; i < INODE_BITMAP_WORDS; i++) {
+        atomic_init(&freeinode_ts[i], ~UINT64_C(0));
+    }
+    atomic_init(&freeinode_ts_hint, 0);
+    for (size_t i = 0; i < BLOCK_BITMAP_WORDS; i++) {
+        free_blocks[i] = ~UINT64_C(0);
+    }
+    free_blocks_cursor = 0;
+    for (size_t i = 0; i < FRAGMENT_PARTIAL_BLOCKS; i++) {
+        fragment_partial[i] = -1;
+    }
+    fragment_partial_next = 0;
+
+    if (!chunked_table_grow(&inode_table, 0, inode_table_init_chunk,
+                            inode_table_release_chunk) ||
+        !chunked_table_grow(&fs_data, 0, NULL, fs_data_release_chunk) ||
+        !chunked_table_grow(&open_file_table, 0, open_file_table_init_chunk,
+                            open_file_table_release_chunk)) {
+        state_destroy();
+        return -1; // allocation failed
+    }
+
+    if (image_loaded && image_load(&superblock) != 0) {
+        state_destroy();
+        return -1;
+    }
+
+    return 0;
+}
+
+int state_destroy(void)
+{
+    size_t inodes = chunked_table_capacity(&inode_table);
+    for (size_t i = 0; i < inodes; i++) {
+        inode_t *inode = inode_at((int)i);
+        if (inode_is_taken(i) && inode->i_node_type == T_SYMLINK) {
+            free(inode_cold_at((int)i)->ic_sym_path);
+        }
+        pthread_rwlock_destroy(&inode_lock_at((int)i)->il_lock);
+    }
+    for (size_t i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_destroy(&dcache_locks[i]);
+    }
+    size_t open_files = chunked_table_capacity(&open_file_table);
+    for (size_t i = 0; i < open_files; i++) {
+        pthread_mutex_destroy(&open_file_at((int)i)->open_file_lock);
+    }
+    for (size_t i = 0; i < open_file_shard_count; i++) {
+        pthread_mutex_destroy(&open_file_shards[i].ofs_lock);
+    }
+    pthread_mutex_destroy(&data_block_table_lock);
+    pthread_mutex_destroy(&block_cache_lock);
+    for (size_t i = 0; i < MUTATION_BARRIER_SHARDS; i++) {
+        pthread_rwlock_destroy(&mutation_barrier[i].mb_lock);
+    }
+    pthread_mutex_destroy(&snapshots_lock);
+    pthread_mutex_destroy(&snapshot_pending_lock);
+
+    // The snapshots left go away with the blocks they share.
+    for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+        snapshot_free(&snapshots[i]);
+    }
+
+    chunked_table_destroy(&inode_table);
+    chunked_table_destroy(&fs_data);
+    chunked_table_destroy(&open_file_table);
+    free(freeinode_ts);
+    free(free_blocks);
+    free(fragment_maps);
+    free(zero_block);
+    free(block_refs);
+    free(free_open_file_entries);
+    free(open_file_next_free);
+    free(block_cache);
+    free(block_cache_index);
+
+    freeinode_ts = NULL;
+    free_blocks = NULL;
+    fragment_maps = NULL;
+    zero_block = NULL;
+    block_refs = NULL;
+    free_open_file_entries = NULL;
+    open_file_next_free = NULL;
+    block_cache = NULL;
+    block_cache_index = NULL;
+    block_cache_size = 0;
+
+    image_close();
+
+    return 0;
+}
+
+bool state_image_loaded(void) { return image_loaded; }
+
+uint64_t state_image_generation(void) { return image_generation; }
+
+/**
+ * Write the whole FS (within the tables' capacity) to the image file.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int image_write(size_t inodes, size_t blocks) {
+    image_superblock_t superblock = {
+        .sb_magic = IMAGE_MAGIC,
+        .sb_block_size = BLOCK_SIZE,
+        .sb_max_inode_count = INODE_TABLE_SIZE,
+        .sb_max_block_count = DATA_BLOCKS,
+        .sb_inode_capacity = inodes,
+        .sb_block_capacity = blocks,
+        .sb_generation = image_generation + 1,
+    };
+    if (image_transfer(true, &superblock, sizeof(superblock), 0) != 0) {
+        return -1;
+    }
+
+    uint64_t *inode_bitmap = malloc(INODE_BITMAP_WORDS * sizeof(uint64_t));
+    if (inode_bitmap == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < INODE_BITMAP_WORDS; i++) {
+        inode_bitmap[i] = atomic_load(&freeinode_ts[i]);
+    }
+    int written = image_transfer(true, inode_bitmap, INODE_BITMAP_WORDS * sizeof(uint64_t),
+                                 image_inode_bitmap_offset());
+    free(inode_bitmap);
+    if (written != 0 ||
+        image_transfer(true, free_blocks, BLOCK_BITMAP_WORDS * sizeof(uint64_t),
+                       image_block_bitmap_offset()) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < inodes; i++) {
+        if (!inode_is_taken(i)) {
+            continue; // Free inode.
+        }
+
+        inode_t const *inode = inode_at((int)i);
+        image_inode_t image;
+        memset(&image, 0, sizeof(image));
+        image.ii_node_type = (int32_t)inode->i_node_type;
+        image.ii_hard_link_counter = inode->hard_link_counter;
+        image.ii_size = inode->i_size;
+        for (size_t b = 0; b < INODE_DIRECT_BLOCKS; b++) {
+            image.ii_direct_blocks[b] = inode->i_direct_blocks[b];
+        }
+        image.ii_indirect_block = inode->i_indirect_block;
+        image.ii_double_indirect_block = inode->i_double_indirect_block;
+        image.ii_extent_count = inode->i_extent_count;
+        for (size_t e = 0; e < inode->i_extent_count; e++) {
+            image.ii_extents[e].ie_file_block = inode->i_extents[e].e_file_block;
+            image.ii_extents[e].ie_start = inode->i_extents[e].e_start;
+            image.ii_extents[e].ie_length = inode->i_extents[e].e_length;
+        }
+        image.ii_inline_data = inode->i_inline_data;
+        image.ii_fragment_count = inode->i_fragment_count;
+        image.ii_first_fragment = inode->i_first_fragment;
+        if (inode->i_node_type == T_SYMLINK) {
+            strncpy(image.ii_inline, inode_sym_path(inode), MAX_PATH_NAME - 1);
+        } else if (inode->i_inline_data) {
+            memcpy(image.ii_inline, inode->i_inline, INODE_INLINE_SIZE);
+        }
+
+        if (image_transfer(true, &image, sizeof(image), image_inode_offset(i)) != 0) {
+            return -1;
+        }
+    }
+
+    for (size_t first = 0; first < blocks; first += DATA_BLOCKS_CHUNK) {
+        size_t count = blocks - first < DATA_BLOCKS_CHUNK ? blocks - first
+                                                          : DATA_BLOCKS_CHUNK;
+        if (image_transfer(true, chunked_table_at(&fs_data, first), count * BLOCK_SIZE,
+                           image_block_offset(first)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Flush the directory of the image, so that the rename of a new image into
+ * place is durable.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int image_sync_directory(void) {
+    char *slash = strrchr(image_path, '/');
+    char *directory = slash == NULL ? strdup(".")
+                      : slash == image_path ? strdup("/")
+                                            : strndup(image_path, (size_t)(slash - image_path));
+    if (directory == NULL) {
+        return -1;
+    }
+    int fd = open(directory, O_RDONLY);
+    free(directory);
+    if (fd == -1) {
+        return -1;
+    }
+    int synced = fsync(fd);
+    close(fd);
+    return synced;
+}
+
+#ifndef NDEBUG
+/**
+ * Check that no inode is locked, as no operation is in progress (debug builds
+ * only, as it tries every inode's lock).
+ */
+static bool state_idle(void) {
+    size_t inodes = chunked_table_capacity(&inode_table);
+    for (size_t i = 0; i < inodes; i++) {
+        pthread_rwlock_t *lock = &inode_lock_at((int)i)->il_lock;
+        if (pthread_rwlock_trywrlock(lock) != 0) {
+            return false;
+        }
+        ALWAYS_ASSERT(pthread_rwlock_unlock(lock) == 0,
+                    "The inode's lock could not be unlocked.");
+    }
+    return true;
+}
+#endif
+
+int state_sync(void) {
+    if (image_fd == -1) {
+        return 0;
+    }
+
+    // The image is written and its blocks mapped again without locks, which
+    // is only sound if nothing else runs meanwhile.
+#ifndef NDEBUG
+    ALWAYS_ASSERT(state_idle(), "state_sync: called while other operations run");
+#endif
+
+    size_t inodes = chunked_table_capacity(&inode_table);
+    size_t blocks = chunked_table_capacity(&fs_data);
+
+    // The checkpoint goes to a new image, which only takes the old one's place
+    // once all of it is durable.
+    int old_fd = image_fd;
+    image_fd = open(image_new_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (image_fd == -1) {
+        image_fd = old_fd;
+        return -1;
+    }
+    if (image_write(inodes, blocks) != 0 || fsync(image_fd) != 0 ||
+        rename(image_new_path, image_path) != 0) {
+        close(image_fd);
+        unlink(image_new_path);
+        image_fd = old_fd;
+        return -1;
+    }
+    close(old_fd);
+    image_generation++;
+
+    // Mapped blocks are mapped from the new image (which holds what their
+    // pages were changed to), so that the old one can go.
+    for (size_t first = 0; fs_data_mapped() && first < blocks; first += DATA_BLOCKS_CHUNK) {
+        size_t count = blocks - first < DATA_BLOCKS_CHUNK ? blocks - first
+                                                          : DATA_BLOCKS_CHUNK;
+        void *chunk = chunked_table_at(&fs_data, first);
+        ALWAYS_ASSERT(mmap(chunk, count * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                           image_fd, image_block_offset(first)) == chunk,
+                      "state_sync: a chunk of blocks could not be mapped again");
+    }
+    for (size_t i = 0; i < block_cache_size; i++) {
+        atomic_store_explicit(&block_cache[i].bc_dirty, false, memory_order_relaxed);
+    }
+
+    return image_sync_directory();
+}
+
+/**
+ * Mark every entry of an inode's block map as unallocated.
+ */
+static void inode_block_map_init(inode_t *inode) {
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        INODE_SEQ_STORE(inode->i_direct_blocks[i], -1);
+    }
+    inode->i_indirect_block = -1;
+    inode->i_double_indirect_block = -1;
+    inode->i_extent_count = 0;
+    inode->i_fragment_count = 0;
+    INODE_SEQ_STORE(inode->i_first_fragment, 0);
+}
+
+/**
+ * (Try to) Allocate a new inode in the inode table, without initializing its
+ * data.
+ *
+ * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ */
+static int inode_alloc(void) {
+    size_t capacity = chunked_table_capacity(&inode_table);
+    size_t words = (capacity + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    size_t first_word = atomic_load_explicit(&freeinode_ts_hint, memory_order_relaxed);
+
+    for (size_t i = 0; i < words; i++) {
+        size_t w = (first_word + i) % words;
+        if ((w * sizeof(uint64_t)) % BLOCK_SIZE == 0) {
+            // Simulate storage access delay (to freeinode_ts).
+            insert_delay(fs_params.latency.bitmap_ns);
+        }
+
+        // Claims the lowest free bit of the word; if another thread changes
+        // the word in the meantime, the CAS fails, reloads it and retries.
+        uint64_t taken = atomic_load_explicit(&freeinode_ts[w], memory_order_relaxed);
+        while (~taken != 0) {
+            uint64_t bit = UINT64_C(1) << __builtin_ctzll(~taken);
+            if (atomic_compare_exchange_weak_explicit(&freeinode_ts[w], &taken,
+                                                      taken | bit,
+                                                      memory_order_acquire,
+                                                      memory_order_relaxed)) {
+                atomic_store_explicit(&freeinode_ts_hint, w, memory_order_relaxed);
+                return (int)(w * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(bit));
+            }
+        }
+    }
+
+    // No free inodes were found, so the table grows (if it can).
+    if (!chunked_table_grow(&inode_table, capacity, inode_table_init_chunk,
+                            inode_table_release_chunk)) {
+        return -1;
+    }
+    return inode_alloc();
+}
+
+int inode_create(inode_type i_type)
+{
+    // Allocates a new inode. 
+    // Returns -1 if there are no free slots in inode table.
+    
+    int inumber = inode_alloc();
+    if (inumber == -1) {
+        return -1; 
+    }
+
+    inode_t *inode = inode_at(inumber);
+    // Simulate storage access delay (to inode).
+    insert_delay(fs_params.latency.inode_ns);
+
+    // Initializes the hard link counter to 1 and is type to the input.
+    inode->hard_link_counter = 1;
+    inode->i_node_type = i_type;
+
+
+    switch (i_type) {
+    case T_DIRECTORY: {
+        // Initializes directory (filling its block with empty entries, labeled
+        // with inumber==-1).
+        int b = data_block_alloc();
+        if (b == -1) {
+            // Ensure fields are initialized.
+            inode->i_size = 0;
+            inode->i_inline_data = false;
+            inode_block_map_init(inode);
+            inode_cold_at(inumber)->ic_sym_path = NULL;
+
+            // Run regular deletion process.
+            inode_delete(inumber);
+            return -1;
+        }
+
+        inode->i_size = BLOCK_SIZE;
+        inode->i_inline_data = false;
+        inode_block_map_init(inode);
+        inode->i_direct_blocks[0] = b;
+
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b, true);
+        ALWAYS_ASSERT(dir_entry != NULL, "inode_create: data block freed while in use");
+
+        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+            dir_entry[i].d_inumber = DIR_ENTRY_EMPTY;
+        }
+    }
+    break;
+    case T_FILE:
+    case T_SYMLINK:
+        // In case of a new file, simply sets its size to 0 (its contents, or
+        // the link's target, start inline).
+        inode->i_size = 0;
+        inode->i_inline_data = true;
+        inode_block_map_init(inode);
+        inode->i_inline[0] = '\0';
+        inode_cold_at(inumber)->ic_sym_path = NULL;
+        break;
+    default:
+        PANIC("inode_create: unknown file type");
+    }
+
+    return inumber;
+}
+
+void inode_delete(int inumber) {
+    // Simulate storage access delay (to inode and freeinode_ts).
+    insert_delay(fs_params.latency.inode_ns);
+    insert_delay(fs_params.latency.bitmap_ns);
+
+    //TODO: Lock aqui? Talvez. Correia faz sempre lock em condiçoes basicamente
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
+
+    uint64_t bit = UINT64_C(1) << (inumber % BITMAP_WORD_BITS);
+    ALWAYS_ASSERT((atomic_load(&freeinode_ts[inumber / BITMAP_WORD_BITS]) & bit) != 0,
+                "inode_delete: inode already freed");
+    snapshot_inode_save(inumber);
+
+    inode_t *inode = inode_at(inumber);
+    if (inode->i_node_type == T_SYMLINK) {
+        free(inode_cold_at(inumber)->ic_sym_path);
+        inode_cold_at(inumber)->ic_sym_path = NULL;
+    }
+    // Indirect blocks may have been allocated even if no data was written.
+    inode_blocks_free(inode);
+
+    atomic_fetch_and_explicit(&freeinode_ts[inumber / BITMAP_WORD_BITS], ~bit,
+                              memory_order_release);
+}
+
+inode_t *inode_get(int inumber, bool mode) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
+    
+    insert_delay(fs_params.latency.inode_ns); // Simulate storage access delay to inode.
+    inode_t *inode = inode_at(inumber);
+    pthread_rwlock_t *lock = &inode_lock_at(inumber)->il_lock;
+    // If mode is on read (true), lock on read. Else, write lock.
+    if(mode) {
+        ALWAYS_ASSERT(pthread_rwlock_rdlock(lock) == 0, 
+                    "The inode's lock could not be rdlocked.");
+    } 
+    else if (!mode) {
+        ALWAYS_ASSERT(pthread_rwlock_wrlock(lock) == 0, 
+                    "The inode's lock could not be wrlocked.");
+        // The inode may change now.
+        snapshot_inode_save(inumber);
+        ALWAYS_ASSERT(write_locks_held_count < WRITE_LOCKS_HELD_MAX,
+                    "inode_get: too many inodes locked for writing");
+        write_locks_held[write_locks_held_count++] = inumber;
+    } else {
+        return NULL;
+    } 
+
+    return inode;
+}
+
+inode_t const *inode_get_unlocked(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_get_unlocked: invalid inumber");
+
+    insert_delay(fs_params.latency.inode_ns); // Simulate storage access delay to inode.
+    return inode_at(inumber);
+}
+
+char const *inode_sym_path(inode_t const *inode) {
+    return inode->i_inline_data ? inode->i_inline
+                                : inode_cold_at(inode->i_inumber)->ic_sym_path;
+}
+
+int inode_set_sym_path(inode_t *inode, char const *target) {
+    inode_cold_t *cold = inode_cold_at(inode->i_inumber);
+    size_t len = strlen(target);
+
+    // Targets that fit are kept in the inode.
+    if (len < INODE_INLINE_SIZE) {
+        free(cold->ic_sym_path);
+        cold->ic_sym_path = NULL;
+        memcpy(inode->i_inline, target, len + 1);
+        inode->i_inline_data = true;
+        return 0;
+    }
+
+    char *sym_path = malloc(len + 1);
+    if (sym_path == NULL) {
+        return -1;
+    }
+    memcpy(sym_path, target, len + 1);
+
+    free(cold->ic_sym_path);
+    cold->ic_sym_path = sym_path;
+    inode->i_inline_data = false;
+    return 0;
+}
+
+void inode_seq_write_begin(inode_t *inode) {
+    atomic_fetch_add_explicit(&inode->i_seq, 1, memory_order_relaxed);
+    // Orders the odd sequence number before the writer's changes.
+    atomic_thread_fence(memory_order_release);
+}
+
+void inode_seq_write_end(inode_t *inode) {
+    atomic_fetch_add_explicit(&inode->i_seq, 1, memory_order_release);
+}
+
+unsigned inode_seq_read_begin(inode_t const *inode) {
+    return atomic_load_explicit((atomic_uint *)&inode->i_seq, memory_order_acquire);
+}
+
+bool inode_seq_read_retry(inode_t const *inode, unsigned seq) {
+    // Orders the reader's loads before the second load of the sequence number.
+    atomic_thread_fence(memory_order_acquire);
+    return (seq & 1) != 0 ||
+           atomic_load_explicit((atomic_uint *)&inode->i_seq, memory_order_relaxed) != seq;
+}
+
+void seq_copy_in(void *dest, void const *src, size_t n) {
+    unsigned char *to = dest;
+    unsigned char const *from = src;
+    for (size_t i = 0; i < n; i++) {
+        __atomic_store_n(&to[i], from != NULL ? from[i] : 0, __ATOMIC_RELAXED);
+    }
+}
+
+void seq_copy_out(void *dest, void const *src, size_t n) {
+    unsigned char *to = dest;
+    unsigned char const *from = src;
+    for (size_t i = 0; i < n; i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+void inode_unlock(inode_t const *inode) {
+    for (size_t i = 0; i < write_locks_held_count; i++) {
+        if (write_locks_held[i] == inode->i_inumber) {
+            write_locks_held[i] = write_locks_held[--write_locks_held_count];
+            break;
+        }
+    }
+    ALWAYS_ASSERT(pthread_rwlock_unlock(&inode_lock_at(inode->i_inumber)->il_lock) == 0, 
+                "The inode's lock could not be unlocked.");
+}
+
+/**
+ * Hash a file name (32-bit FNV-1a).
+ */
+static uint32_t dir_entry_hash(char const *name) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Look for an entry in a directory block, following the probe sequence that
+ * starts at the slot of the name's hash.
+ *
+ * Returns the index of the entry, or -1 if there is none with that name.
+ */
+static int dir_entry_lookup(dir_entry_t const *dir_entry, char const *sub_name,
+                            uint32_t hash) {
+    size_t slot = hash % MAX_DIR_ENTRIES;
+    for (size_t probe = 0; probe < MAX_DIR_ENTRIES; probe++) {
+        dir_entry_t const *entry = &dir_entry[slot];
+        if (entry->d_inumber == DIR_ENTRY_EMPTY) {
+            break; // End of the probe sequence.
+        }
+
+        // Comparing the hashes first avoids most string comparisons.
+        if (entry->d_inumber != DIR_ENTRY_DELETED && entry->d_hash == hash &&
+            strncmp(entry->d_name, sub_name, MAX_FILE_NAME) == 0) {
+            return (int)slot;
+        }
+
+        slot = (slot + 1) % MAX_DIR_ENTRIES;
+    }
+
+    return -1;
+}
+
+static inline size_t dcache_slot(int dir_inumber, uint32_t hash) {
+    return (hash ^ ((uint32_t)dir_inumber * 2654435761u)) % DCACHE_ENTRIES;
+}
+
+/**
+ * Look for a name in the dentry cache.
+ *
+ * Input:
+ *   - dir_inumber: inumber of the directory (which must be locked)
+ *   - sub_name: name inside the directory
+ *   - hash: hash of sub_name
+ *   - inumber: where to store the cached inumber (-1 if the name is cached as
+ *     missing)
+ *
+ * Returns true if the name was cached, false otherwise.
+ */
+static bool dcache_lookup(int dir_inumber, char const *sub_name, uint32_t hash,
+                          int *inumber) {
+    size_t slot = dcache_slot(dir_inumber, hash);
+    pthread_mutex_t *lock = &dcache_locks[slot % DCACHE_LOCKS];
+
+    ALWAYS_ASSERT(pthread_mutex_lock(lock) == 0, "The dentry cache's lock could not be locked.");
+    dcache_entry_t const *entry = &dcache[slot];
+    bool hit = entry->dc_dir_inumber == dir_inumber && entry->dc_hash == hash &&
+               strncmp(entry->dc_name, sub_name, MAX_FILE_NAME) == 0;
+    if (hit) {
+        *inumber = entry->dc_inumber;
+    }
+    ALWAYS_ASSERT(pthread_mutex_unlock(lock) == 0, "The dentry cache's lock could not be unlocked.");
+
+    atomic_fetch_add_explicit(hit ? &dcache_hits : &dcache_misses, 1,
+                              memory_order_relaxed);
+    return hit;
+}
+
+/**
+ * Store what a directory holds under a name in the dentry cache (replacing
+ * whatever the entry held).
+ *
+ * Input:
+ *   - dir_inumber: inumber of the directory (which must be locked)
+ *   - sub_name: name inside the directory
+ *   - hash: hash of sub_name
+ *   - inumber: inumber linked to the name, or -1 if there is none
+ */
+static void dcache_store(int dir_inumber, char const *sub_name, uint32_t hash,
+                         int inumber) {
+    size_t slot = dcache_slot(dir_inumber, hash);
+    pthread_mutex_t *lock = &dcache_locks[slot % DCACHE_LOCKS];
+
+    ALWAYS_ASSERT(pthread_mutex_lock(lock) == 0, "The dentry cache's lock could not be locked.");
+    dcache_entry_t *entry = &dcache[slot];
+    entry->dc_dir_inumber = dir_inumber;
+    entry->dc_hash = hash;
+    strncpy(entry->dc_name, sub_name, MAX_FILE_NAME - 1);
+    entry->dc_name[MAX_FILE_NAME - 1] = '\0';
+    entry->dc_inumber = inumber;
+    ALWAYS_ASSERT(pthread_mutex_unlock(lock) == 0, "The dentry cache's lock could not be unlocked.");
+}
+
+void dcache_stats(size_t *hits, size_t *misses) {
+    *hits = atomic_load_explicit(&dcache_hits, memory_order_relaxed);
+    *misses = atomic_load_explicit(&dcache_misses, memory_order_relaxed);
+}
+
+int clear_dir_entry(inode_t *inode, char const *sub_name) {
+    insert_delay(fs_params.latency.directory_ns); // Simulate storage access delay to the directory.
+    if (inode->i_node_type != T_DIRECTORY) {
+        
+        return -1; // not a directory
+    }
+
+    // Locates the block containing the entries of the directory (copying it
+    // first if it is shared with a snapshot).
+    if (!inode_block_unshare(inode, 0)) {
+        return -1; // No free data blocks.
+    }
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_direct_blocks[0], true);
+    ALWAYS_ASSERT(dir_entry != NULL, "clear_dir_entry: directory must have a data block");
+
+    uint32_t hash = dir_entry_hash(sub_name);
+    int index = dir_entry_lookup(dir_entry, sub_name, hash);
+    if (index == -1) {
+        return -1; // sub_name not found.
+    }
+
+    dcache_store(inode->i_inumber, sub_name, hash, -1);
+
+    size_t slot = (size_t)index;
+    memset(dir_entry[slot].d_name, 0, MAX_FILE_NAME);
+
+    // The slot has to keep probe sequences going past it, unless the next one
+    // ends them anyway; in that case, it (and the deleted slots before it) can
+    // end them instead.
+    if (dir_entry[(slot + 1) % MAX_DIR_ENTRIES].d_inumber != DIR_ENTRY_EMPTY) {
+        dir_entry[slot].d_inumber = DIR_ENTRY_DELETED;
+        return 0;
+    }
+
+    dir_entry[slot].d_inumber = DIR_ENTRY_EMPTY;
+    for (size_t i = 1; i < MAX_DIR_ENTRIES; i++) {
+        size_t previous = (slot + MAX_DIR_ENTRIES - i) % MAX_DIR_ENTRIES;
+        if (dir_entry[previous].d_inumber != DIR_ENTRY_DELETED) {
+            break;
+        }
+        dir_entry[previous].d_inumber = DIR_ENTRY_EMPTY;
+    }
+
+    return 0;
+}
+
+int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
+    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
+        
+        return -1; // Invalid sub_name.
+    }
+
+    insert_delay(fs_params.latency.directory_ns); // Simulate storage access delay to the directory.
+    if (inode->i_node_type != T_DIRECTORY) {
+        
+        return -1; // Not a directory.
+    }
+
+    // Locates the block containing the entries of the directory (copying it
+    // first if it is shared with a snapshot).
+    if (!inode_block_unshare(inode, 0)) {
+        return -1; // No free data blocks.
+    }
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_direct_blocks[0], true);
+    ALWAYS_ASSERT(dir_entry != NULL, "add_dir_entry: directory must have a data block");
+
+    // Fills the first unused slot of the name's probe sequence.
+    uint32_t hash = dir_entry_hash(sub_name);
+    size_t slot = hash % MAX_DIR_ENTRIES;
+    for (size_t probe = 0; probe < MAX_DIR_ENTRIES; probe++) {
+        if (dir_entry[slot].d_inumber < 0) {
+            dir_entry[slot].d_inumber = sub_inumber;
+            dir_entry[slot].d_hash = hash;
+            strncpy(dir_entry[slot].d_name, sub_name, MAX_FILE_NAME - 1);
+            dir_entry[slot].d_name[MAX_FILE_NAME - 1] = '\0';
+
+            dcache_store(inode->i_inumber, sub_name, hash, sub_inumber);
+            return 0;
+        }
+
+        slot = (slot + 1) % MAX_DIR_ENTRIES;
+    }
+
     return -1; // No space for entry.
 }
 
-int find_in_dir(inode_t const *inode, char const *sub_name) {
-    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
-    ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
+int find_in_dir(inode_t const *inode, char const *sub_name) {
+    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
+    ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
+
+    if (inode->i_node_type != T_DIRECTORY) {
+        
+        return -1; // Not a directory.
+    }
+
+    // The dentry cache spares the accesses to the directory's inode and block.
+    int dir_inumber = inode->i_inumber;
+    uint32_t hash = dir_entry_hash(sub_name);
+    int sub_inumber;
+    if (dcache_lookup(dir_inumber, sub_name, hash, &sub_inumber)) {
+        return sub_inumber;
+    }
+
+    insert_delay(fs_params.latency.directory_ns); // Simulate storage access delay to the directory.
+
+    // Locates the block containing the entries of the directory.
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_direct_blocks[0], false);
+    ALWAYS_ASSERT(dir_entry != NULL, "find_in_dir: directory inode must have a data block");
+
+    int index = dir_entry_lookup(dir_entry, sub_name, hash);
+    sub_inumber = index == -1 ? -1 : dir_entry[index].d_inumber;
+
+    dcache_store(dir_inumber, sub_name, hash, sub_inumber);
+    return sub_inumber;
+}
+
+bool dir_is_empty(inode_t const *inode) {
+    ALWAYS_ASSERT(inode->i_node_type == T_DIRECTORY, "dir_is_empty: inode must be a directory");
+
+    insert_delay(fs_params.latency.directory_ns); // Simulate storage access delay to the directory.
+
+    dir_entry_t const *dir_entry =
+        (dir_entry_t const *)data_block_get(inode->i_direct_blocks[0], false);
+    ALWAYS_ASSERT(dir_entry != NULL, "dir_is_empty: directory must have a data block");
+
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if (dir_entry[i].d_inumber >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Check if a data block has other owners (so it must be copied before it is
+ * changed).
+ */
+static bool block_is_shared(int block_number) {
+    if (atomic_load_explicit(&shared_blocks, memory_order_relaxed) == 0) {
+        return false;
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be locked.");
+    bool shared = block_refs[block_number] != 0;
+    ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be unlocked.");
+    return shared;
+}
+
+/**
+ * Remove an owner from a data block.
+ *
+ * Returns true if it was the last one (the block must then be freed).
+ */
+static bool block_unref(int block_number) {
+    if (atomic_load_explicit(&shared_blocks, memory_order_relaxed) == 0) {
+        return true;
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be locked.");
+    bool last = block_refs[block_number] == 0;
+    if (!last && --block_refs[block_number] == 0) {
+        atomic_fetch_sub_explicit(&shared_blocks, 1, memory_order_relaxed);
+    }
+    ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be unlocked.");
+    return last;
+}
+
+/**
+ * Free an indirect block and every block it references (if it is shared, it
+ * only loses an owner, and the blocks it references stay).
+ *
+ * Input:
+ *   - block_number: the indirect block
+ *   - depth: 1 for a single indirect block, 2 for a double indirect block
+ */
+static void indirect_table_free(int block_number, int depth) {
+    if (!block_unref(block_number)) {
+        return;
+    }
+
+    int *entries = (int *)data_block_get(block_number, false);
+    for (size_t i = 0; i < INDIRECT_ENTRIES; i++) {
+        if (entries[i] == -1) {
+            continue;
+        }
+
+        if (depth > 1) {
+            indirect_table_free(entries[i], depth - 1);
+        } else {
+            data_block_free(entries[i]);
+        }
+    }
+    data_block_free(block_number);
+}
+
+/**
+ * Obtain the table of block numbers stored in an indirect block, optionally
+ * allocating the indirect block (with every entry unallocated) if it does not
+ * exist yet. A shared indirect block is copied before it can be changed.
+ *
+ * Input:
+ *   - slot: the block map entry that references the indirect block
+ *   - depth: 1 for a single indirect block, 2 for a double indirect block
+ *   - allocate: whether to allocate the indirect block if it is missing (the
+ *     table is then about to be changed)
+ *
+ * Returns a pointer to the table, or NULL if the block is not allocated.
+ */
+static int *indirect_table_get(int *slot, int depth, bool allocate) {
+    if (*slot == -1) {
+        if (!allocate) {
+            return NULL;
+        }
+
+        int b = data_block_alloc();
+        if (b == -1) {
+            return NULL; // No free data blocks.
+        }
+
+        int *entries = (int *)data_block_get(b, true);
+        for (size_t i = 0; i < INDIRECT_ENTRIES; i++) {
+            entries[i] = -1;
+        }
+        *slot = b;
+        return entries;
+    }
+
+    if (allocate && block_is_shared(*slot)) {
+        int b = data_block_alloc();
+        if (b == -1) {
+            return NULL; // No free data blocks.
+        }
+
+        // The blocks referenced by the copy gain an owner.
+        int *entries = (int *)data_block_get(b, true);
+        memcpy(entries, data_block_get(*slot, false), BLOCK_SIZE);
+        ALWAYS_ASSERT(pthread_mutex_lock(&data_block_table_lock) == 0, 
+                    "The data block table's lock could not be locked.");
+        for (size_t i = 0; i < INDIRECT_ENTRIES; i++) {
+            if (entries[i] != -1) {
+                block_ref_locked(entries[i]);
+            }
+        }
+        ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
+                    "The data block table's lock could not be unlocked.");
+
+        indirect_table_free(*slot, depth);
+        *slot = b;
+        return entries;
+    }
+
+    return (int *)data_block_get(*slot, allocate);
+}
+
+/**
+ * Obtain the block map entry for one of the blocks of an inode, optionally
+ * allocating the indirect blocks needed to reach it.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - file_block: index of the block inside the file
+ *   - allocate: whether to allocate missing indirect blocks
+ *
+ * Returns a pointer to the entry, or NULL if it can not be reached.
+ */
+static int *inode_block_slot(inode_t *inode, size_t file_block, bool allocate) {
+    if (file_block < INODE_DIRECT_BLOCKS) {
+        return &inode->i_direct_blocks[file_block];
+    }
+
+    if (file_block - INODE_DIRECT_BLOCKS < INDIRECT_ENTRIES) {
+        int *table = indirect_table_get(&inode->i_indirect_block, 1, allocate);
+        if (table == NULL) {
+            return NULL;
+        }
+        return &table[file_block - INODE_DIRECT_BLOCKS];
+    }
+
+    size_t index = file_block - INODE_DIRECT_BLOCKS - INDIRECT_ENTRIES;
+    if (index >= INDIRECT_ENTRIES * INDIRECT_ENTRIES) {
+        return NULL; // Beyond the maximum file size.
+    }
+
+    int *outer = indirect_table_get(&inode->i_double_indirect_block, 2, allocate);
+    if (outer == NULL) {
+        return NULL;
+    }
+    int *table = indirect_table_get(&outer[index / INDIRECT_ENTRIES], 1, allocate);
+    if (table == NULL) {
+        return NULL;
+    }
+    return &table[index % INDIRECT_ENTRIES];
+}
+
+int inode_block_get(inode_t *inode, size_t file_block, bool allocate) {
+    int *slot = inode_block_slot(inode, file_block, allocate);
+    if (slot == NULL) {
+        return -1;
+    }
+
+    if (*slot == -1 && allocate) {
+        INODE_SEQ_STORE(*slot, data_block_alloc());
+    }
+    return *slot;
+}
+
+int inode_block_run(inode_t const *inode, size_t file_block, size_t *run) {
+    // Contiguous blocks can be found in the extent list without walking the
+    // block map.
+    for (size_t i = 0; i < inode->i_extent_count; i++) {
+        inode_extent_t const *extent = &inode->i_extents[i];
+        if (file_block >= extent->e_file_block &&
+            file_block - extent->e_file_block < extent->e_length) {
+            size_t skip = file_block - extent->e_file_block;
+            *run = extent->e_length - skip;
+            return extent->e_start + (int)skip;
+        }
+    }
+
+    *run = 1;
+    return inode_block_get((inode_t *)inode, file_block, false);
+}
+
+/**
+ * Record a newly allocated extent in an inode, merging it with the last
+ * extent when they are contiguous (in the same chunk of fs_data, as chunks
+ * are not contiguous in memory). Extents that do not fit are not recorded
+ * (their blocks remain reachable through the block map).
+ */
+static void inode_extent_add(inode_t *inode, size_t file_block, int start,
+                             size_t length) {
+    if (inode->i_extent_count > 0) {
+        inode_extent_t *last = &inode->i_extents[inode->i_extent_count - 1];
+        if (last->e_file_block + last->e_length == file_block &&
+            last->e_start + (int)last->e_length == start &&
+            (size_t)start % DATA_BLOCKS_CHUNK != 0) {
+            last->e_length += length;
+            return;
+        }
+    }
+
+    if (inode->i_extent_count < INODE_EXTENTS) {
+        inode_extent_t *extent = &inode->i_extents[inode->i_extent_count++];
+        extent->e_file_block = file_block;
+        extent->e_start = start;
+        extent->e_length = length;
+    }
+}
+
+int inode_blocks_reserve(inode_t *inode, size_t file_block, size_t count) {
+    size_t end = file_block + count;
+    size_t current = file_block;
+
+    while (current < end) {
+        int *slot = inode_block_slot(inode, current, true);
+        if (slot == NULL) {
+            return -1;
+        }
+        if (*slot != -1) {
+            current++;
+            continue; // Already allocated.
+        }
+
+        // Measures the run of missing blocks, allocating the indirect blocks
+        // that reference them beforehand so that they do not end up in the
+        // middle of the extent.
+        size_t missing = 1;
+        while (current + missing < end) {
+            int *next = inode_block_slot(inode, current + missing, true);
+            if (next == NULL || *next != -1) {
+                break;
+            }
+            missing++;
+        }
+
+        // Tries to continue the extent of the preceding block.
+        int goal = -1;
+        if (current > 0) {
+            int previous = inode_block_get(inode, current - 1, false);
+            if (previous != -1) {
+                goal = previous + 1;
+            }
+        }
+
+        size_t allocated;
+        int start = data_block_alloc_extent(goal, missing, &allocated);
+        if (start == -1) {
+            return -1; // No free data blocks.
+        }
+
+        for (size_t i = 0; i < allocated; i++) {
+            *inode_block_slot(inode, current + i, false) = start + (int)i;
+        }
+        inode_extent_add(inode, current, start, allocated);
+        current += allocated;
+    }
+
+    return 0;
+}
+
+/**
+ * Free the blocks of a block map (including its indirect blocks), leaving the
+ * map itself as it is.
+ */
+static void block_map_free(inode_t const *inode) {
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        if (inode->i_direct_blocks[i] != -1) {
+            data_block_free(inode->i_direct_blocks[i]);
+        }
+    }
+
+    if (inode->i_indirect_block != -1) {
+        indirect_table_free(inode->i_indirect_block, 1);
+    }
+    if (inode->i_double_indirect_block != -1) {
+        indirect_table_free(inode->i_double_indirect_block, 2);
+    }
+}
+
+void inode_blocks_free(inode_t *inode) {
+    if (inode->i_fragment_count > 0) {
+        data_fragments_free(inode->i_direct_blocks[0], inode->i_first_fragment,
+                            inode->i_fragment_count);
+        INODE_SEQ_STORE(inode->i_direct_blocks[0], -1);
+    }
+    block_map_free(inode);
+
+    // An empty file keeps its contents inline again.
+    inode_block_map_init(inode);
+    INODE_SEQ_STORE(inode->i_inline_data, inode->i_node_type == T_FILE);
+}
+
+bool inode_block_unshare(inode_t *inode, size_t file_block) {
+    if (atomic_load_explicit(&shared_blocks, memory_order_relaxed) == 0 ||
+        inode_block_get(inode, file_block, false) == -1) {
+        return true;
+    }
+
+    // Reaching the block for a change copies the shared indirect blocks on
+    // the way (which makes the blocks they reference shared on their own).
+    int *slot = inode_block_slot(inode, file_block, true);
+    if (slot == NULL) {
+        return false; // No free data blocks.
+    }
+    if (!block_is_shared(*slot)) {
+        return true;
+    }
+
+    int b = data_block_alloc();
+    if (b == -1) {
+        return false; // No free data blocks.
+    }
+    seq_copy_in(data_block_get(b, true), data_block_get(*slot, false), BLOCK_SIZE);
+    data_block_free(*slot);
+    INODE_SEQ_STORE(*slot, b);
+
+    // The extent holding the block no longer does: it is cut short before it
+    // (or dropped, if it starts there).
+    for (size_t i = 0; i < inode->i_extent_count; i++) {
+        inode_extent_t *extent = &inode->i_extents[i];
+        if (file_block < extent->e_file_block ||
+            file_block - extent->e_file_block >= extent->e_length) {
+            continue;
+        }
+
+        if (file_block > extent->e_file_block) {
+            extent->e_length = file_block - extent->e_file_block;
+        } else {
+            inode->i_extent_count--;
+            memmove(extent, extent + 1,
+                    (inode->i_extent_count - i) * sizeof(inode_extent_t));
+        }
+        break;
+    }
+    return true;
+}
+
+bool inode_fragments_unshare(inode_t *inode) {
+    if (inode->i_fragment_count == 0 || !block_is_shared(inode->i_direct_blocks[0])) {
+        return true;
+    }
+
+    size_t first;
+    int b = data_fragments_alloc(inode->i_fragment_count, &first);
+    if (b == -1) {
+        return false; // No free data blocks.
+    }
+
+    size_t fragment_size = state_fragment_size();
+    seq_copy_in((char *)data_block_get(b, true) + first * fragment_size,
+                inode_fragments_get(inode, false), inode->i_fragment_count * fragment_size);
+    data_fragments_free(inode->i_direct_blocks[0], inode->i_first_fragment,
+                        inode->i_fragment_count);
+    INODE_SEQ_STORE(inode->i_direct_blocks[0], b);
+    INODE_SEQ_STORE(inode->i_first_fragment, (uint8_t)first);
+    return true;
+}
+
+bool state_blocks_shared(void) {
+    return atomic_load_explicit(&shared_blocks, memory_order_relaxed) != 0;
+}
+
+static inline bool block_is_free(size_t block_number) {
+    return (free_blocks[block_number / BITMAP_WORD_BITS] &
+            (UINT64_C(1) << (block_number % BITMAP_WORD_BITS))) == 0;
+}
+
+/**
+ * Find the first free block at or after a given one, wrapping around at the
+ * end of the blocks allocated so far. Must be called with
+ * data_block_table_lock held.
+ *
+ * Returns the block number, or DATA_BLOCKS if all blocks are taken.
+ */
+static size_t block_bitmap_find_free(size_t from) {
+    size_t words = (chunked_table_capacity(&fs_data) + BITMAP_WORD_BITS - 1) /
+                   BITMAP_WORD_BITS;
+    if (from / BITMAP_WORD_BITS >= words) {
+        from = 0;
+    }
+    size_t first_word = from / BITMAP_WORD_BITS;
+
+    // Scans one word (64 blocks) at a time; the first word is visited twice so
+    // that the bits before 'from' are checked after wrapping around.
+    for (size_t i = 0; i <= words; i++) {
+        size_t w = (first_word + i) % words;
+        if ((w * sizeof(uint64_t)) % BLOCK_SIZE == 0) {
+            insert_delay(fs_params.latency.bitmap_ns); // Simulate storage access delay to free_blocks.
+        }
+
+        uint64_t free_bits = ~free_blocks[w];
+        if (i == 0) {
+            free_bits &= ~UINT64_C(0) << (from % BITMAP_WORD_BITS);
+        }
+        if (free_bits != 0) {
+            return w * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(free_bits);
+        }
+    }
+
+    return DATA_BLOCKS;
+}
+
+/**
+ * Mark up to count free blocks starting at a free block as taken, stopping at
+ * the first taken block or at the end of the block's chunk. Must be called
+ * with data_block_table_lock held.
+ *
+ * Returns the number of blocks taken.
+ */
+static size_t block_bitmap_take_run(size_t start, size_t count) {
+    size_t length = 0;
+
+    size_t chunk_left = DATA_BLOCKS_CHUNK - start % DATA_BLOCKS_CHUNK;
+    if (count > chunk_left) {
+        count = chunk_left;
+    }
+
+    while (length < count) {
+        size_t block = start + length;
+        if (block >= DATA_BLOCKS) {
+            break;
+        }
+        size_t w = block / BITMAP_WORD_BITS;
+        size_t bit = block % BITMAP_WORD_BITS;
+
+        // Free blocks in this word, from 'bit' until the first taken one.
+        uint64_t taken = free_blocks[w] >> bit;
+        size_t available = taken == 0 ? BITMAP_WORD_BITS - bit
+                                      : (size_t)__builtin_ctzll(taken);
+        if (available == 0) {
+            break;
+        }
+        if (available > count - length) {
+            available = count - length;
+        }
+
+        uint64_t mask = available == BITMAP_WORD_BITS
+                            ? ~UINT64_C(0)
+                            : ((UINT64_C(1) << available) - 1) << bit;
+        free_blocks[w] |= mask;
+        length += available;
 
-    insert_delay(); // Simulate storage access delay to inode with inumber.
-    if (inode->i_node_type != T_DIRECTORY) {
-        
-        return -1; // Not a directory.
+        if (bit + available < BITMAP_WORD_BITS) {
+            break; // Stopped at a taken block (or at count).
+        }
     }
 
-    // Locates the block containing the entries of the directory.
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL, "find_in_dir: directory inode must have a data block");
+    return length;
+}
+
+/**
+ * Write a block evicted from the block cache back to secondary memory.
+ */
+static void block_cache_write_back(int block_number) {
+    insert_delay(fs_params.latency.block_ns); // Simulate storage access delay to block.
+    atomic_fetch_add_explicit(&block_cache_write_backs, 1, memory_order_relaxed);
+
+    // Mapped blocks start on their way to the image (the msync must cover
+    // whole pages).
+    if (fs_data_mapped()) {
+        uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)chunked_table_at(&fs_data, (size_t)block_number);
+        uintptr_t aligned = start & ~(page - 1);
+        msync((void *)aligned, BLOCK_SIZE + (start - aligned), MS_ASYNC);
+    }
+}
+
+/**
+ * Account for an access to a data block: a hit if it is in the block cache,
+ * otherwise a miss that brings it in (evicting another block if needed). The
+ * caller pays for bringing the block in.
+ *
+ * Input:
+ *   - block_number: the block
+ *   - dirty: whether the access changes the block
+ *
+ * Returns true if the block was in the cache.
+ */
+static bool block_cache_access(int block_number, bool dirty) {
+    if (block_cache_size == 0) {
+        atomic_fetch_add_explicit(&block_cache_misses, 1, memory_order_relaxed);
+        return false;
+    }
 
-    // Iterates over the directory entries looking for one that has the target
-    // name.
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-            int sub_inumber = dir_entry[i].d_inumber;
-            
-            return sub_inumber;
-            
+    int slot = atomic_load_explicit(&block_cache_index[block_number], memory_order_acquire);
+    if (slot == -1 ||
+        atomic_load_explicit(&block_cache[slot].bc_block, memory_order_relaxed) !=
+            block_number) {
+        ALWAYS_ASSERT(pthread_mutex_lock(&block_cache_lock) == 0,
+                    "The block cache's lock could not be locked.");
+
+        // Another thread may have brought the block in meanwhile.
+        slot = atomic_load_explicit(&block_cache_index[block_number], memory_order_relaxed);
+        if (slot == -1) {
+            // CLOCK: the hand skips (and clears) referenced slots, and stops at
+            // the first unused or unreferenced one.
+            block_cache_slot_t *victim;
+            while (true) {
+                slot = (int)block_cache_hand;
+                block_cache_hand = (block_cache_hand + 1) % block_cache_size;
+                victim = &block_cache[slot];
+                if (atomic_load_explicit(&victim->bc_block, memory_order_relaxed) == -1 ||
+                    !atomic_exchange_explicit(&victim->bc_referenced, false,
+                                              memory_order_relaxed)) {
+                    break;
+                }
+            }
+
+            int evicted = atomic_load_explicit(&victim->bc_block, memory_order_relaxed);
+            bool write_back = evicted != -1 &&
+                              atomic_load_explicit(&victim->bc_dirty, memory_order_relaxed);
+            if (evicted != -1) {
+                atomic_store_explicit(&block_cache_index[evicted], -1, memory_order_relaxed);
+            }
+            atomic_store_explicit(&victim->bc_block, block_number, memory_order_relaxed);
+            atomic_store_explicit(&victim->bc_referenced, true, memory_order_relaxed);
+            atomic_store_explicit(&victim->bc_dirty, dirty, memory_order_relaxed);
+            atomic_store_explicit(&block_cache_index[block_number], slot,
+                                  memory_order_release);
+            ALWAYS_ASSERT(pthread_mutex_unlock(&block_cache_lock) == 0,
+                        "The block cache's lock could not be unlocked.");
+
+            // The evicted block is written back without the lock, so misses on
+            // different blocks overlap.
+            if (write_back) {
+                block_cache_write_back(evicted);
+            }
+            atomic_fetch_add_explicit(&block_cache_misses, 1, memory_order_relaxed);
+            return false;
         }
+        ALWAYS_ASSERT(pthread_mutex_unlock(&block_cache_lock) == 0,
+                    "The block cache's lock could not be unlocked.");
     }
-    
-    return -1; // Entry not found.
+
+    atomic_store_explicit(&block_cache[slot].bc_referenced, true, memory_order_relaxed);
+    if (dirty) {
+        atomic_store_explicit(&block_cache[slot].bc_dirty, true, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&block_cache_hits, 1, memory_order_relaxed);
+    return true;
+}
+
+/**
+ * Drop a block from the block cache (without writing it back).
+ */
+static void block_cache_forget(int block_number) {
+    if (block_cache_size == 0 ||
+        atomic_load_explicit(&block_cache_index[block_number], memory_order_relaxed) == -1) {
+        return;
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&block_cache_lock) == 0,
+                "The block cache's lock could not be locked.");
+    int slot = atomic_load_explicit(&block_cache_index[block_number], memory_order_relaxed);
+    if (slot != -1) {
+        atomic_store_explicit(&block_cache[slot].bc_block, -1, memory_order_relaxed);
+        atomic_store_explicit(&block_cache[slot].bc_referenced, false, memory_order_relaxed);
+        atomic_store_explicit(&block_cache[slot].bc_dirty, false, memory_order_relaxed);
+        atomic_store_explicit(&block_cache_index[block_number], -1, memory_order_relaxed);
+    }
+    ALWAYS_ASSERT(pthread_mutex_unlock(&block_cache_lock) == 0,
+                "The block cache's lock could not be unlocked.");
 }
 
 int data_block_alloc(void) {
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // Simulate storage access delay to free_blocks.
-        }
-        
-        // Locks the data block table to prevent parallelism.
-        ALWAYS_ASSERT(pthread_mutex_lock(&data_block_table_lock) == 0, 
-                    "The data block table's lock could not be locked.");
-        
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
+    size_t allocated;
+    return data_block_alloc_extent(-1, 1, &allocated);
+}
+
+int data_block_alloc_extent(int goal, size_t count, size_t *allocated) {
+    ALWAYS_ASSERT(count > 0, "data_block_alloc_extent: count must be positive");
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be locked.");
 
+    // Starts at the goal if it is free, otherwise at the next free block after
+    // the cursor.
+    size_t start;
+    if (valid_block_number(goal) && block_is_free((size_t)goal)) {
+        insert_delay(fs_params.latency.bitmap_ns); // Simulate storage access delay to free_blocks.
+        start = (size_t)goal;
+    } else {
+        start = block_bitmap_find_free(free_blocks_cursor);
+    }
+
+    // If every block is taken, fs_data grows and the search goes on in the
+    // new chunk.
+    if (start == DATA_BLOCKS) {
+        size_t capacity = chunked_table_capacity(&fs_data);
+        if (!chunked_table_grow(&fs_data, capacity, NULL, fs_data_release_chunk)) {
             ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
                         "The data block table's lock could not be unlocked.");
-            return (int)i;
+            return -1;
         }
-        ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
-                    "The data block table's lock could not be unlocked.");
-        
+        start = capacity;
     }
-    return -1;
+
+    size_t length = block_bitmap_take_run(start, count);
+    free_blocks_cursor = start + length;
+
+    ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be unlocked.");
+
+    *allocated = length;
+    return (int)start;
 }
 
 void data_block_free(int block_number) {
     ALWAYS_ASSERT(valid_block_number(block_number), "data_block_free: invalid block number");
 
-    insert_delay(); // Simulate storage access delay to free_blocks.
+    // A shared block only loses an owner.
+    if (!block_unref(block_number)) {
+        return;
+    }
+
+    // The contents of a free block are dead, so they are never written back.
+    block_cache_forget(block_number);
+
+    insert_delay(fs_params.latency.bitmap_ns); // Simulate storage access delay to free_blocks.
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be locked.");
+    free_blocks[block_number / BITMAP_WORD_BITS] &=
+        ~(UINT64_C(1) << (block_number % BITMAP_WORD_BITS));
+    ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be unlocked.");
+}
+
+/**
+ * Find a run of free fragments in a block split into fragments (the data block
+ * table's lock must be held).
+ *
+ * Returns the index of the first fragment of the run, or -1 if there is none.
+ */
+static int fragment_find(int block_number, size_t count) {
+    uint8_t map = fragment_maps[block_number];
+    if (map == 0 || block_refs[block_number] != 0) {
+        return -1; // Not split into fragments (any longer), or shared.
+    }
+    for (size_t first = 0; first + count <= FRAGMENTS_PER_BLOCK; first++) {
+        if ((map & fragment_mask(first, count)) == 0) {
+            return (int)first;
+        }
+    }
+    return -1;
+}
+
+int data_fragments_alloc(size_t count, size_t *first) {
+    ALWAYS_ASSERT(count > 0 && count < FRAGMENTS_PER_BLOCK,
+                "data_fragments_alloc: invalid fragment count");
+
+    insert_delay(fs_params.latency.bitmap_ns); // Simulate storage access delay to free_blocks.
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be locked.");
+    for (size_t i = 0; i < FRAGMENT_PARTIAL_BLOCKS; i++) {
+        int b = fragment_partial[i];
+        int found = b == -1 ? -1 : fragment_find(b, count);
+        if (found != -1) {
+            fragment_maps[b] |= fragment_mask((size_t)found, count);
+            ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
+                        "The data block table's lock could not be unlocked.");
+            *first = (size_t)found;
+            return b;
+        }
+    }
+    ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be unlocked.");
+
+    // Splits a new block.
+    int b = data_block_alloc();
+    if (b == -1) {
+        return -1; // No free data blocks.
+    }
 
-    free_blocks[block_number] = FREE;
+    ALWAYS_ASSERT(pthread_mutex_lock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be locked.");
+    fragment_maps[b] = fragment_mask(0, count);
+    fragment_partial_add(b);
+    ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be unlocked.");
+    *first = 0;
+    return b;
 }
 
-void *data_block_get(int block_number) {
-    ALWAYS_ASSERT(valid_block_number(block_number), "data_block_get: invalid block number");
+bool data_fragments_extend(int block_number, size_t first, size_t count,
+                           size_t new_count) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                "data_fragments_extend: invalid block number");
+    if (first + new_count > FRAGMENTS_PER_BLOCK) {
+        return false;
+    }
 
-    insert_delay(); // Simulate storage access delay to block.
-    return &fs_data[(size_t)block_number * BLOCK_SIZE];
+    ALWAYS_ASSERT(pthread_mutex_lock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be locked.");
+    uint8_t added = fragment_mask(first + count, new_count - count);
+    bool extended = block_refs[block_number] == 0 &&
+                    (fragment_maps[block_number] & added) == 0;
+    if (extended) {
+        fragment_maps[block_number] |= added;
+    }
+    ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be unlocked.");
+    return extended;
 }
 
-int add_to_open_file_table(int inumber, size_t offset) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+bool data_fragments_promote(int block_number, size_t first, size_t count) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                "data_fragments_promote: invalid block number");
 
-        // Locks the open file table to prevent parallelism.
-        ALWAYS_ASSERT(pthread_mutex_lock(&open_file_table_lock) == 0, 
-                    "The open file table's lock could not be locked.");
+    ALWAYS_ASSERT(pthread_mutex_lock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be locked.");
+    bool promoted = block_refs[block_number] == 0 &&
+                    fragment_maps[block_number] == fragment_mask(first, count);
+    if (promoted) {
+        fragment_maps[block_number] = 0;
+    }
+    ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be unlocked.");
+    return promoted;
+}
 
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
+void data_fragments_free(int block_number, size_t first, size_t count) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                "data_fragments_free: invalid block number");
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be locked.");
+    fragment_maps[block_number] &= (uint8_t)~fragment_mask(first, count);
+    bool unused = fragment_maps[block_number] == 0;
+    if (!unused) {
+        fragment_partial_add(block_number);
+    }
+    ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be unlocked.");
+
+    if (unused) {
+        data_block_free(block_number);
+    }
+}
+
+void *inode_fragments_get(inode_t const *inode, bool dirty) {
+    ALWAYS_ASSERT(inode->i_fragment_count > 0,
+                "inode_fragments_get: contents are not kept in fragments");
+    return (char *)data_block_get(inode->i_direct_blocks[0], dirty) +
+           inode->i_first_fragment * state_fragment_size();
+}
+
+void inode_read_ahead(inode_t const *inode, size_t offset) {
+    if (!fs_data_mapped() || offset >= inode->i_size) {
+        return;
+    }
+
+    size_t run;
+    int block_number = inode_block_run(inode, offset / BLOCK_SIZE, &run);
+    if (block_number == -1) {
+        return;
+    }
+    if (run > DATA_READAHEAD_BLOCKS) {
+        run = DATA_READAHEAD_BLOCKS;
+    }
+
+    // Runs do not cross chunks, so the blocks are contiguous in memory; the
+    // advice must start at a page boundary, though.
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)chunked_table_at(&fs_data, (size_t)block_number);
+    uintptr_t aligned = start & ~(page - 1);
+    posix_madvise((void *)aligned, run * BLOCK_SIZE + (start - aligned),
+                  POSIX_MADV_WILLNEED);
+}
+
+void const *data_block_zeros(void) {
+    return zero_block;
+}
 
-            // Initializes the open file's lock.
-            ALWAYS_ASSERT(pthread_mutex_init(&open_file_table[i].open_file_lock, NULL) == 0, 
-                        "The open file's lock could not be initialized.");
+void *data_block_get(int block_number, bool dirty) {
+    return data_blocks_get(block_number, 1, dirty);
+}
 
-            ALWAYS_ASSERT(pthread_mutex_unlock(&open_file_table_lock) == 0, 
-                        "The open file table's lock could not be unlocked.");
-            return i;
+void *data_blocks_get(int block_number, size_t count, bool dirty) {
+    ALWAYS_ASSERT(valid_block_number(block_number) &&
+                  valid_block_number(block_number + (int)count - 1),
+                  "data_blocks_get: invalid block number");
+
+    // The blocks missing from the cache are brought in with a single access,
+    // as the run is contiguous.
+    bool missed = false;
+    for (size_t i = 0; i < count; i++) {
+        if (!block_cache_access(block_number + (int)i, dirty)) {
+            missed = true;
         }
-        ALWAYS_ASSERT(pthread_mutex_unlock(&open_file_table_lock) == 0, 
-                    "The open file table's lock could not be unlocked.");
     }
-    return -1;
+    if (missed) {
+        insert_delay(fs_params.latency.block_ns); // Simulate storage access delay to block.
+    }
+    return chunked_table_at(&fs_data, (size_t)block_number);
 }
 
-void remove_from_open_file_table(int fhandle) {
+void block_cache_stats(size_t *hits, size_t *misses, size_t *write_backs) {
+    *hits = atomic_load_explicit(&block_cache_hits, memory_order_relaxed);
+    *misses = atomic_load_explicit(&block_cache_misses, memory_order_relaxed);
+    *write_backs = atomic_load_explicit(&block_cache_write_backs, memory_order_relaxed);
+}
 
-    // Locks the open file table
-    ALWAYS_ASSERT(pthread_mutex_lock(&open_file_table_lock) == 0, 
+/**
+ * Takes an entry from a shard's free list.
+ *
+ * Returns the entry's file handle, or -1 if the shard has no free entries.
+ */
+static int open_file_shard_take(open_file_shard_t *shard) {
+    ALWAYS_ASSERT(pthread_mutex_lock(&shard->ofs_lock) == 0, 
                 "The open file table's lock could not be locked.");
+    int fhandle = shard->ofs_free_head;
+    if (fhandle != -1) {
+        shard->ofs_free_head = open_file_next_free[fhandle];
+    }
+    ALWAYS_ASSERT(pthread_mutex_unlock(&shard->ofs_lock) == 0, 
+                "The open file table's lock could not be unlocked.");
+    return fhandle;
+}
+
+int add_to_open_file_table(int inumber, size_t offset) {
+    // The first time a thread opens a file, it is given a home shard.
+    if (open_file_home_shard == -1 ||
+            (size_t)open_file_home_shard >= open_file_shard_count) {
+        open_file_home_shard = (int)(atomic_fetch_add(&open_file_next_home, 1) %
+                                     open_file_shard_count);
+    }
+
+    // Falls back to the other shards if the home shard has no free entries,
+    // and then to growing the table.
+    int fhandle = -1;
+    while (fhandle == -1) {
+        size_t capacity = chunked_table_capacity(&open_file_table);
+        for (size_t i = 0; i < open_file_shard_count && fhandle == -1; i++) {
+            size_t shard = ((size_t)open_file_home_shard + i) % open_file_shard_count;
+            fhandle = open_file_shard_take(&open_file_shards[shard]);
+        }
+        if (fhandle == -1 &&
+            !chunked_table_grow(&open_file_table, capacity, open_file_table_init_chunk,
+                                open_file_table_release_chunk)) {
+            return -1;
+        }
+    }
+
+    atomic_fetch_add(&inode_lock_at(inumber)->il_open_count, 1);
+
+    open_file_entry_t *file = open_file_at(fhandle);
+    file->of_inumber = inumber;
+    file->of_offset = offset;
+    atomic_store_explicit(&free_open_file_entries[fhandle], TAKEN, memory_order_release);
+
+    return fhandle;
+}
+
+void remove_from_open_file_table(int fhandle) {
     // Validates the file handle
     ALWAYS_ASSERT(valid_file_handle(fhandle), 
                 "remove_from_open_file_table: file handle must be valid");
@@ -455,45 +2842,68 @@ void remove_from_open_file_table(int fhandle) {
     ALWAYS_ASSERT(free_open_file_entries[fhandle] == TAKEN,
                 "remove_from_open_file_table: file handle must be taken");
 
-    // Unlocks the open file's lock
-    ALWAYS_ASSERT(pthread_mutex_unlock(&open_file_table[fhandle].open_file_lock) == 0, 
-                "The open file's lock could not be unlocked.");
-
-    // Destroy the open file's lock.
-    ALWAYS_ASSERT(pthread_mutex_destroy(&open_file_table[fhandle].open_file_lock) == 0, 
-                "The open file's lock could not be destroyed.");
+    open_file_entry_t *file = open_file_at(fhandle);
+    atomic_fetch_sub(&inode_lock_at(file->of_inumber)->il_open_count, 1);
 
-    // Sets the entry as free
+    // Sets the entry as free and unlocks the open file's lock
     free_open_file_entries[fhandle] = FREE;
+    ALWAYS_ASSERT(pthread_mutex_unlock(&file->open_file_lock) == 0, 
+                "The open file's lock could not be unlocked.");
 
-    // Unlocks the open file table
-    ALWAYS_ASSERT(pthread_mutex_unlock(&open_file_table_lock) == 0, 
+    // Returns the entry to the free list of its shard
+    open_file_shard_t *shard = &open_file_shards[(size_t)fhandle % open_file_shard_count];
+    ALWAYS_ASSERT(pthread_mutex_lock(&shard->ofs_lock) == 0, 
+                "The open file table's lock could not be locked.");
+    open_file_next_free[fhandle] = shard->ofs_free_head;
+    shard->ofs_free_head = fhandle;
+    ALWAYS_ASSERT(pthread_mutex_unlock(&shard->ofs_lock) == 0, 
                 "The open file table's lock could not be unlocked.");
-
 }
 
 open_file_entry_t *get_open_file_entry(int fhandle) {
-    ALWAYS_ASSERT(pthread_mutex_lock(&open_file_table[fhandle].open_file_lock) == 0, 
-                "The open file's lock could not be locked.");
     if (!valid_file_handle(fhandle)) {
         return NULL;
     }
 
+    open_file_entry_t *file = open_file_at(fhandle);
+    ALWAYS_ASSERT(pthread_mutex_lock(&file->open_file_lock) == 0, 
+                "The open file's lock could not be locked.");
+
     if (free_open_file_entries[fhandle] != TAKEN) {
+        ALWAYS_ASSERT(pthread_mutex_unlock(&file->open_file_lock) == 0, 
+                    "The open file's lock could not be unlocked.");
         return NULL;
     }
 
-    return &open_file_table[fhandle];
+    return file;
 }
 
-bool is_file_open(int inumber) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (open_file_table[i].of_inumber == inumber &&
-                    free_open_file_entries[i] == TAKEN) {
-            return true;
-        }
+int get_open_file_inumber(int fhandle) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
     }
-    return false;
+
+    int inumber = file->of_inumber;
+    inode_pin(inumber);
+    ALWAYS_ASSERT(pthread_mutex_unlock(&file->open_file_lock) == 0, 
+                "The open file's lock could not be unlocked.");
+    return inumber;
+}
+
+bool is_file_open(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "is_file_open: invalid inumber");
+    return atomic_load(&inode_lock_at(inumber)->il_open_count) > 0;
+}
+
+void inode_pin(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_pin: invalid inumber");
+    atomic_fetch_add(&inode_lock_at(inumber)->il_open_count, 1);
+}
+
+void inode_unpin(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_unpin: invalid inumber");
+    atomic_fetch_sub(&inode_lock_at(inumber)->il_open_count, 1);
 }
 
 inode_t *root_inode(bool mode) {
@@ -502,3 +2912,378 @@ inode_t *root_inode(bool mode) {
     return root_dir_inode;
 }
 
+
+void state_mutation_begin(void) {
+    if (mutation_shard == -1) {
+        mutation_shard = (int)(atomic_fetch_add(&mutation_next_shard, 1) %
+                               MUTATION_BARRIER_SHARDS);
+    }
+    ALWAYS_ASSERT(pthread_rwlock_rdlock(&mutation_barrier[mutation_shard].mb_lock) == 0,
+                "The mutation barrier could not be rdlocked.");
+
+    // A snapshot may have started while the barrier was waited for, after the
+    // inodes about to change were locked.
+    for (size_t i = 0; i < write_locks_held_count; i++) {
+        snapshot_inode_save(write_locks_held[i]);
+    }
+}
+
+void state_mutation_end(void) {
+    ALWAYS_ASSERT(pthread_rwlock_unlock(&mutation_barrier[mutation_shard].mb_lock) == 0,
+                "The mutation barrier could not be unlocked.");
+}
+
+/**
+ * Remove a snapshot as an owner of the blocks of its inodes (which are freed
+ * if the FS no longer refers to them).
+ */
+static void snapshot_blocks_free(snapshot_t const *snapshot) {
+    for (size_t i = 0; i < snapshot->sn_inode_count; i++) {
+        if (!snapshot_inode_taken(snapshot, i)) {
+            continue;
+        }
+
+        inode_t const *inode = &snapshot->sn_inodes[i];
+        if (inode->i_fragment_count > 0) {
+            data_block_free(inode->i_direct_blocks[0]);
+        } else {
+            block_map_free(inode);
+        }
+    }
+}
+
+int snapshot_create(void) {
+    ALWAYS_ASSERT(pthread_mutex_lock(&snapshots_lock) == 0,
+                "The snapshots' lock could not be locked.");
+    int id = 0;
+    while (id < MAX_SNAPSHOTS && snapshots[id].sn_taken) {
+        id++;
+    }
+    if (id == MAX_SNAPSHOTS) {
+        ALWAYS_ASSERT(pthread_mutex_unlock(&snapshots_lock) == 0,
+                    "The snapshots' lock could not be unlocked.");
+        return -1; // No room for another snapshot.
+    }
+
+    // Waits for the changes to names in progress, and holds new ones back
+    // only while the inode bitmap is taken.
+    for (size_t i = 0; i < MUTATION_BARRIER_SHARDS; i++) {
+        ALWAYS_ASSERT(pthread_rwlock_wrlock(&mutation_barrier[i].mb_lock) == 0,
+                    "The mutation barrier could not be wrlocked.");
+    }
+
+    snapshot_t *snapshot = &snapshots[id];
+    size_t count = chunked_table_capacity(&inode_table);
+    size_t words = (count + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    snapshot->sn_inode_count = count;
+    snapshot->sn_inodes_taken = malloc(words * sizeof(uint64_t));
+    snapshot->sn_inodes_copied = calloc(words, sizeof(uint64_t));
+    snapshot->sn_inodes = aligned_alloc(CACHE_LINE_SIZE, count * sizeof(inode_t));
+    snapshot->sn_sym_paths = calloc(count, sizeof(char *));
+    bool started = snapshot->sn_inodes_taken != NULL && snapshot->sn_inodes_copied != NULL &&
+                   snapshot->sn_inodes != NULL && snapshot->sn_sym_paths != NULL;
+
+    if (started) {
+        for (size_t w = 0; w < words; w++) {
+            snapshot->sn_inodes_taken[w] = atomic_load(&freeinode_ts[w]);
+        }
+        ALWAYS_ASSERT(pthread_mutex_lock(&snapshot_pending_lock) == 0,
+                    "The pending snapshot's lock could not be locked.");
+        snapshot_pending = snapshot;
+        atomic_store_explicit(&snapshot_taking, true, memory_order_release);
+        ALWAYS_ASSERT(pthread_mutex_unlock(&snapshot_pending_lock) == 0,
+                    "The pending snapshot's lock could not be unlocked.");
+    }
+
+    for (size_t i = 0; i < MUTATION_BARRIER_SHARDS; i++) {
+        ALWAYS_ASSERT(pthread_rwlock_unlock(&mutation_barrier[i].mb_lock) == 0,
+                    "The mutation barrier could not be unlocked.");
+    }
+
+    // Copies the inodes that have not changed (and so were not copied) since.
+    for (size_t i = 0; started && i < count; i++) {
+        if (!snapshot_inode_taken(snapshot, i)) {
+            continue;
+        }
+
+        insert_delay(fs_params.latency.inode_ns); // Simulate storage access delay to inode.
+        pthread_rwlock_t *lock = &inode_lock_at((int)i)->il_lock;
+        ALWAYS_ASSERT(pthread_rwlock_rdlock(lock) == 0, 
+                    "The inode's lock could not be rdlocked.");
+        ALWAYS_ASSERT(pthread_mutex_lock(&snapshot_pending_lock) == 0,
+                    "The pending snapshot's lock could not be locked.");
+        snapshot_inode_copy_locked(snapshot, i);
+        ALWAYS_ASSERT(pthread_mutex_unlock(&snapshot_pending_lock) == 0,
+                    "The pending snapshot's lock could not be unlocked.");
+        ALWAYS_ASSERT(pthread_rwlock_unlock(lock) == 0, 
+                    "The inode's lock could not be unlocked.");
+    }
+
+    bool taken = started;
+    if (started) {
+        ALWAYS_ASSERT(pthread_mutex_lock(&snapshot_pending_lock) == 0,
+                    "The pending snapshot's lock could not be locked.");
+        snapshot_pending = NULL;
+        atomic_store_explicit(&snapshot_taking, false, memory_order_relaxed);
+        ALWAYS_ASSERT(pthread_mutex_unlock(&snapshot_pending_lock) == 0,
+                    "The pending snapshot's lock could not be unlocked.");
+
+        taken = !snapshot->sn_failed;
+        if (!taken) {
+            snapshot_blocks_free(snapshot);
+        }
+    }
+    if (taken) {
+        free(snapshot->sn_inodes_copied);
+        snapshot->sn_inodes_copied = NULL;
+        snapshot->sn_taken = true;
+    } else {
+        snapshot_free(snapshot);
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_unlock(&snapshots_lock) == 0,
+                "The snapshots' lock could not be unlocked.");
+    return taken ? id : -1;
+}
+
+int snapshot_delete(int id) {
+    ALWAYS_ASSERT(pthread_mutex_lock(&snapshots_lock) == 0,
+                "The snapshots' lock could not be locked.");
+    if (id < 0 || id >= MAX_SNAPSHOTS || !snapshots[id].sn_taken) {
+        ALWAYS_ASSERT(pthread_mutex_unlock(&snapshots_lock) == 0,
+                    "The snapshots' lock could not be unlocked.");
+        return -1;
+    }
+
+    snapshot_blocks_free(&snapshots[id]);
+    snapshot_free(&snapshots[id]);
+
+    ALWAYS_ASSERT(pthread_mutex_unlock(&snapshots_lock) == 0,
+                "The snapshots' lock could not be unlocked.");
+    return 0;
+}
+
+/**
+ * Drop the names of a directory that is about to be deleted (with entries
+ * left) from the dentry cache, where a later directory with the same inumber
+ * would find them. Does nothing for other inodes.
+ */
+static void dir_entries_forget(int inumber) {
+    inode_t const *inode = inode_at(inumber);
+    if (inode->i_node_type != T_DIRECTORY || inode->i_direct_blocks[0] == -1) {
+        return;
+    }
+
+    dir_entry_t const *dir_entry =
+        (dir_entry_t const *)data_block_get(inode->i_direct_blocks[0], false);
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if (dir_entry[i].d_inumber >= 0) {
+            dcache_store(inumber, dir_entry[i].d_name, dir_entry[i].d_hash, -1);
+        }
+    }
+}
+
+/**
+ * Fill an inode of the FS with a copy of an inode of a snapshot: blocks are
+ * shared, but fragments (which are not counted per file) and directories
+ * (whose entries refer to the copies of the inodes) are copied.
+ *
+ * Input:
+ *   - snapshot: the snapshot
+ *   - inumber: the inode of the snapshot
+ *   - clones: the inumber of the copy of each inode of the snapshot
+ *
+ * Returns 0 if successful, -1 otherwise (no free data blocks, or no memory
+ * for a link target).
+ */
+static int snapshot_inode_clone(snapshot_t const *snapshot, size_t inumber,
+                                int const *clones) {
+    inode_t const *frozen = &snapshot->sn_inodes[inumber];
+    inode_t *inode = inode_at(clones[inumber]);
+    insert_delay(fs_params.latency.inode_ns); // Simulate storage access delay to inode.
+
+    inode->i_node_type = frozen->i_node_type;
+    inode->hard_link_counter = frozen->hard_link_counter;
+
+    if (frozen->i_node_type == T_SYMLINK) {
+        return inode_set_sym_path(inode, frozen->i_inline_data
+                                             ? frozen->i_inline
+                                             : snapshot->sn_sym_paths[inumber]);
+    }
+
+    if (frozen->i_inline_data) {
+        memcpy(inode->i_inline, frozen->i_inline, INODE_INLINE_SIZE);
+        inode->i_size = frozen->i_size;
+        return 0;
+    }
+    inode->i_inline_data = false;
+
+    if (frozen->i_fragment_count > 0) {
+        size_t first;
+        int b = data_fragments_alloc(frozen->i_fragment_count, &first);
+        if (b == -1) {
+            return -1;
+        }
+        size_t fragment_size = state_fragment_size();
+        memcpy((char *)data_block_get(b, true) + first * fragment_size,
+               (char *)data_block_get(frozen->i_direct_blocks[0], false) +
+                   frozen->i_first_fragment * fragment_size,
+               frozen->i_fragment_count * fragment_size);
+        inode->i_direct_blocks[0] = b;
+        inode->i_first_fragment = (uint8_t)first;
+        inode->i_fragment_count = frozen->i_fragment_count;
+        inode->i_size = frozen->i_size;
+        return 0;
+    }
+
+    if (frozen->i_node_type == T_DIRECTORY) {
+        int b = data_block_alloc();
+        if (b == -1) {
+            return -1;
+        }
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b, true);
+        memcpy(dir_entry, data_block_get(frozen->i_direct_blocks[0], false), BLOCK_SIZE);
+        inode->i_direct_blocks[0] = b;
+        inode->i_size = frozen->i_size;
+
+        // The cache may still know the names of an old directory with the
+        // same inumber.
+        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+            if (dir_entry[i].d_inumber >= 0) {
+                dir_entry[i].d_inumber = clones[dir_entry[i].d_inumber];
+                dcache_store(inode->i_inumber, dir_entry[i].d_name, dir_entry[i].d_hash,
+                             dir_entry[i].d_inumber);
+            }
+        }
+        return 0;
+    }
+
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        inode->i_direct_blocks[i] = frozen->i_direct_blocks[i];
+    }
+    inode->i_indirect_block = frozen->i_indirect_block;
+    inode->i_double_indirect_block = frozen->i_double_indirect_block;
+    inode->i_extent_count = frozen->i_extent_count;
+    memcpy(inode->i_extents, frozen->i_extents, sizeof(inode->i_extents));
+    inode->i_size = frozen->i_size;
+
+    ALWAYS_ASSERT(pthread_mutex_lock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be locked.");
+    inode_blocks_ref_locked(inode);
+    ALWAYS_ASSERT(pthread_mutex_unlock(&data_block_table_lock) == 0, 
+                "The data block table's lock could not be unlocked.");
+    return 0;
+}
+
+/**
+ * Allocate the inode for the copy of an inode of a snapshot (an empty file,
+ * until it is filled).
+ *
+ * Returns its inumber, or -1 if there are no free inodes.
+ */
+static int snapshot_inode_reserve(void) {
+    int inumber = inode_alloc();
+    if (inumber == -1) {
+        return -1;
+    }
+
+    inode_t *inode = inode_at(inumber);
+    inode->i_node_type = T_FILE;
+    inode->hard_link_counter = 1;
+    inode->i_size = 0;
+    inode->i_inline_data = true;
+    inode_block_map_init(inode);
+    inode_cold_at(inumber)->ic_sym_path = NULL;
+    return inumber;
+}
+
+int snapshot_clone(int id) {
+    ALWAYS_ASSERT(pthread_mutex_lock(&snapshots_lock) == 0,
+                "The snapshots' lock could not be locked.");
+    if (id < 0 || id >= MAX_SNAPSHOTS || !snapshots[id].sn_taken) {
+        ALWAYS_ASSERT(pthread_mutex_unlock(&snapshots_lock) == 0,
+                    "The snapshots' lock could not be unlocked.");
+        return -1;
+    }
+
+    snapshot_t const *snapshot = &snapshots[id];
+    size_t count = snapshot->sn_inode_count;
+    int *clones = malloc(count * sizeof(int));
+    int *reached = malloc(count * sizeof(int));
+    bool cloned = clones != NULL && reached != NULL;
+
+    for (size_t i = 0; cloned && i < count; i++) {
+        clones[i] = -1;
+    }
+
+    // Every inode reachable from the root gets its copy first (as an empty
+    // file), so that the entries of directories can refer to the copies. The
+    // others (not linked to a directory yet when the snapshot was taken) are
+    // left out.
+    size_t reached_count = 0;
+    if (cloned) {
+        clones[ROOT_DIR_INUM] = snapshot_inode_reserve();
+        reached[reached_count++] = ROOT_DIR_INUM;
+        cloned = clones[ROOT_DIR_INUM] != -1;
+    }
+    for (size_t r = 0; cloned && r < reached_count; r++) {
+        inode_t const *frozen = &snapshot->sn_inodes[reached[r]];
+        if (frozen->i_node_type != T_DIRECTORY) {
+            continue;
+        }
+
+        dir_entry_t const *dir_entry =
+            (dir_entry_t const *)data_block_get(frozen->i_direct_blocks[0], false);
+        for (size_t i = 0; cloned && i < MAX_DIR_ENTRIES; i++) {
+            int inumber = dir_entry[i].d_inumber;
+            if (inumber < 0 || clones[inumber] != -1) {
+                continue;
+            }
+            ALWAYS_ASSERT(snapshot_inode_taken(snapshot, (size_t)inumber),
+                        "snapshot_clone: entry of a free inode");
+            clones[inumber] = snapshot_inode_reserve();
+            reached[reached_count++] = inumber;
+            cloned = clones[inumber] != -1;
+        }
+    }
+
+    for (size_t r = 0; cloned && r < reached_count; r++) {
+        if (snapshot_inode_clone(snapshot, (size_t)reached[r], clones) != 0) {
+            cloned = false;
+        }
+    }
+
+    int root = cloned ? clones[ROOT_DIR_INUM] : -1;
+    if (!cloned && reached != NULL) {
+        for (size_t r = 0; r < reached_count; r++) {
+            if (clones[reached[r]] != -1) {
+                dir_entries_forget(clones[reached[r]]);
+                inode_delete(clones[reached[r]]);
+            }
+        }
+    }
+    free(reached);
+    free(clones);
+
+    ALWAYS_ASSERT(pthread_mutex_unlock(&snapshots_lock) == 0,
+                "The snapshots' lock could not be unlocked.");
+    return root;
+}
+
+void inode_tree_delete(int inumber) {
+    inode_t *inode = inode_at(inumber);
+    if (inode->i_node_type == T_DIRECTORY) {
+        dir_entry_t const *dir_entry =
+            (dir_entry_t const *)data_block_get(inode->i_direct_blocks[0], false);
+        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+            if (dir_entry[i].d_inumber >= 0) {
+                inode_tree_delete(dir_entry[i].d_inumber);
+            }
+        }
+        dir_entries_forget(inumber);
+    } else if (--inode->hard_link_counter > 0) {
+        return;
+    }
+
+    inode_delete(inumber);
+}
@@ -2,10 +2,12 @@
 #define STATE_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include "config.h"
 #include "operations.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -13,30 +15,90 @@
 
 /**
  * Directory entry
+ *
+ * The entries of a directory block form an open-addressing hash table: an
+ * entry is placed at the slot given by the hash of its name (or at the next
+ * available one after it).
  */
 typedef struct {
     char d_name[MAX_FILE_NAME];
-    int d_inumber;
+    int d_inumber; // DIR_ENTRY_EMPTY / DIR_ENTRY_DELETED if the slot is unused
+    uint32_t d_hash; // hash of d_name
 } dir_entry_t;
 
+// Slot that was never used (ends a probe sequence).
+#define DIR_ENTRY_EMPTY (-1)
+// Slot whose entry was removed (probe sequences continue past it).
+#define DIR_ENTRY_DELETED (-2)
+
 typedef enum { T_FILE, T_DIRECTORY, T_SYMLINK } inode_type;
 
 /**
- * Inode
+ * Extent: a run of contiguous data blocks holding contiguous file blocks.
  */
 typedef struct {
-    inode_type i_node_type;
+    size_t e_file_block; // index of the first file block in the run
+    int e_start;         // block number of the first block in the run
+    size_t e_length;     // number of blocks in the run
+} inode_extent_t;
+
+// Number of bytes of a file (or symbolic link target) that can be kept in its
+// inode, instead of in data blocks; they take the place of the extents, which
+// such a file has no use for.
+#define INODE_INLINE_SIZE (INODE_EXTENTS * sizeof(inode_extent_t))
+
+/**
+ * Inode: the fields used by most accesses, on cache lines of its own. The
+ * inode's lock and the fields seldom used are kept apart (see state.c), so
+ * that taking the lock of an inode does not disturb readers of its
+ * neighbours. Built with TFS_INODE_PACKED, inodes are instead packed next to
+ * their lock and seldom used fields, as they used to be (to compare both
+ * layouts).
+ */
+#ifdef TFS_INODE_PACKED
+#define INODE_ALIGNAS
+#else
+#define INODE_ALIGNAS _Alignas(CACHE_LINE_SIZE)
+#endif
+typedef struct {
+    // Sequence counter for optimistic readers: odd while a writer (holding
+    // the inode's lock for writing) changes the file's size, blocks or
+    // contents.
+    INODE_ALIGNAS atomic_uint i_seq;
 
+    inode_type i_node_type;
+    // Whether the contents (or link target) are kept in i_inline. Files start
+    // inline, and move to data blocks for good when they outgrow it (until
+    // they are truncated).
+    bool i_inline_data;
+    // Number of fragments holding the contents (0 if they are not kept in
+    // fragments), the first of which is fragment i_first_fragment of the block
+    // i_direct_blocks[0] (shared with other files).
+    uint8_t i_fragment_count;
+    uint8_t i_first_fragment;
     size_t i_size;
-    int i_data_block;
+
+    // The inode's number (fixed, as the inode never moves in the table).
+    int i_inumber;
 
     int hard_link_counter;
 
-    // Stores the path to a file (for symbolic links).
-    char *sym_path;
+    // Block map (-1 marks an unallocated entry): the first blocks of the file
+    // are referenced directly, the following ones through a single indirect
+    // block and, after that, through a double indirect block.
+    int i_direct_blocks[INODE_DIRECT_BLOCKS];
+    int i_indirect_block;
+    int i_double_indirect_block;
 
-    // Single inode lock.
-    pthread_rwlock_t inode_lock;
+    // Extents allocated to the file, in file order. They index (part of) the
+    // block map so that contiguous blocks can be accessed in one go; blocks
+    // not covered by an extent are only reachable through the block map.
+    // Inline contents take their place (i_extent_count is then 0).
+    size_t i_extent_count;
+    union {
+        inode_extent_t i_extents[INODE_EXTENTS];
+        char i_inline[INODE_INLINE_SIZE];
+    };
     // in a more complete FS, more fields could exist here
 } inode_t;
 
@@ -61,7 +123,8 @@ typedef struct {
 } open_file_entry_t;
 
 /**
- * Initialize FS state.
+ * Initialize FS state, loading it from params.image_path if it holds an
+ * image.
  *
  * Input:
  *   - params: TécnicoFS parameters
@@ -71,6 +134,7 @@ typedef struct {
  * Possible errors:
  *   - TFS already initialized.
  *   - malloc failure when allocating TFS structures.
+ *   - The image is invalid or could not be read.
  */
 int state_init(tfs_params);
 
@@ -81,15 +145,47 @@ int state_init(tfs_params);
  */
 int state_destroy(void);
 
+/**
+ * Checks if state_init loaded the FS from an existing image (rather than
+ * starting an empty FS).
+ */
+bool state_image_loaded(void);
+
+/**
+ * Returns the number of the checkpoint (state_sync) the FS image is at.
+ */
+uint64_t state_image_generation(void);
+
+/**
+ * Write the FS state back to its image (if it has one) and flush it to
+ * storage. The image is replaced at once: after a crash, it holds this
+ * checkpoint or the previous one, whole. No other operation may run
+ * meanwhile (checked in debug builds).
+ *
+ * Returns 0 if successful (or if there is no image), -1 otherwise.
+ */
+int state_sync(void);
+
 size_t state_block_size(void);
 
+/**
+ * Returns the maximum size of a file, as limited by the inode's block map.
+ */
+size_t state_max_file_size(void);
+
+/**
+ * Returns the size of a fragment of a data block (0 if blocks can not be split
+ * into fragments).
+ */
+size_t state_fragment_size(void);
+
 /**
  * Create a new inode in the inode table.
  *
  * Allocates and initializes a new inode.
- * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * Directories will have their (first) data block allocated and initialized,
+ * with i_size set to BLOCK_SIZE. Regular files will not have any data block
+ * allocated (i_size will be set to 0 and every block map entry to -1).
  *
  * Input:
  *   - i_type: the type of the node (file or directory)
@@ -120,6 +216,119 @@ void inode_delete(int inumber);
  */
 inode_t *inode_get(int inumber, bool mode);
 
+/**
+ * Prefetch the blocks of a file that follow an offset, if the data blocks are
+ * mapped from an image (does nothing otherwise). The inode must be locked.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - offset: where a read is expected to start
+ */
+void inode_read_ahead(inode_t const *inode, size_t offset);
+
+/**
+ * Obtain a pointer to an inode from its inumber, without locking it.
+ *
+ * Only meant for optimistic readers, which must validate what they read with
+ * inode_seq_read_begin/inode_seq_read_retry.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *
+ * Returns pointer to inode.
+ */
+inode_t const *inode_get_unlocked(int inumber);
+
+/**
+ * Obtain the target of a symbolic link.
+ *
+ * Input:
+ *   - inode: the link's inode (locked)
+ *
+ * Returns the target's path name.
+ */
+char const *inode_sym_path(inode_t const *inode);
+
+/**
+ * Set the target of a symbolic link.
+ *
+ * Input:
+ *   - inode: the link's inode (locked for writing)
+ *   - target: the target's path name
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int inode_set_sym_path(inode_t *inode, char const *target);
+
+/**
+ * Mark the start of a change to a file's size, blocks or contents, seen by
+ * optimistic readers. The inode must be locked for writing.
+ */
+void inode_seq_write_begin(inode_t *inode);
+
+/**
+ * Mark the end of a change started with inode_seq_write_begin.
+ */
+void inode_seq_write_end(inode_t *inode);
+
+/**
+ * Start an optimistic read of an inode.
+ *
+ * Returns the sequence number to pass to inode_seq_read_retry (odd if a
+ * writer is active, in which case the read will have to be retried).
+ */
+unsigned inode_seq_read_begin(inode_t const *inode);
+
+/**
+ * Checks if an optimistic read of an inode has to be retried.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - seq: the value returned by inode_seq_read_begin
+ *
+ * Returns true if a writer was active during the read, false if what was read
+ * is consistent.
+ */
+bool inode_seq_read_retry(inode_t const *inode, unsigned seq);
+
+/**
+ * Store to a field of an inode that optimistic readers load (its size, and
+ * where its contents are), while they may be reading it. The inode must be
+ * locked for writing, between inode_seq_write_begin and inode_seq_write_end.
+ */
+#define INODE_SEQ_STORE(field, value) \
+    __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+/**
+ * Copy bytes to where optimistic readers may be reading them (the contents of
+ * a small file), with relaxed atomic stores.
+ *
+ * Input:
+ *   - dest: where to copy the bytes to
+ *   - src: the bytes to copy, or NULL to write zeros
+ *   - n: number of bytes to copy (the ranges may overlap if dest < src)
+ */
+void seq_copy_in(void *dest, void const *src, size_t n);
+
+/**
+ * Copy bytes that a writer may be changing at the same time (for optimistic
+ * readers), with relaxed atomic loads.
+ *
+ * Input:
+ *   - dest: where to copy the bytes to
+ *   - src: the bytes to copy
+ *   - n: number of bytes to copy
+ */
+void seq_copy_out(void *dest, void const *src, size_t n);
+
+/**
+ * Release the lock taken on an inode by inode_get.
+ *
+ * Input:
+ *   - inode: the inode
+ */
+void inode_unlock(inode_t const *inode);
+
 /**
  * Clear the directory entry associated with a sub file.
  *
@@ -132,6 +341,7 @@ inode_t *inode_get(int inumber, bool mode);
  * Possible errors:
  *   - inode is not a directory inode.
  *   - Directory does not contain an entry for sub_name.
+ *   - No free data blocks (to copy a directory shared with a snapshot).
  */
 int clear_dir_entry(inode_t *inode, char const *sub_name);
 
@@ -149,12 +359,16 @@ int clear_dir_entry(inode_t *inode, char const *sub_name);
  *   - inode is not a directory inode.
  *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
  *   - Directory is already full of entries.
+ *   - No free data blocks (to copy a directory shared with a snapshot).
  */
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
 
 /**
  * Obtain the inumber for a sub file inside a directory.
  *
+ * Answered by the dentry cache when possible (both for names that exist and
+ * for names that do not).
+ *
  * Input:
  *   - inode: directory inode
  *   - sub_name: sub file name
@@ -167,6 +381,119 @@ int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
  */
 int find_in_dir(inode_t const *inode, char const *sub_name);
 
+/**
+ * Obtain the dentry cache's statistics.
+ *
+ * Input:
+ *   - hits: where to store the number of lookups answered by the cache
+ *   - misses: where to store the number of lookups that had to search the
+ *     directory
+ */
+void dcache_stats(size_t *hits, size_t *misses);
+
+/**
+ * Checks if a directory has no entries.
+ *
+ * Input:
+ *   - inode: directory inode (must be locked)
+ *
+ * Returns true if it is empty, false if not.
+ */
+bool dir_is_empty(inode_t const *inode);
+
+/**
+ * Obtain the block number of one of the blocks of an inode.
+ *
+ * Input:
+ *   - inode: the inode (must be locked for writing if allocate is true)
+ *   - file_block: index of the block inside the file (offset / BLOCK_SIZE)
+ *   - allocate: whether to allocate the block (and any indirect blocks
+ *     needed to reach it) if it does not exist yet
+ *
+ * Returns the block number, or -1 if the block is not allocated.
+ *
+ * Possible errors:
+ *   - file_block is beyond the maximum file size.
+ *   - (if allocating) No free data blocks.
+ */
+int inode_block_get(inode_t *inode, size_t file_block, bool allocate);
+
+/**
+ * Obtain the block number of one of the blocks of an inode, along with the
+ * number of blocks (starting at that one) that are contiguous both in the file
+ * and in the data block region.
+ *
+ * Input:
+ *   - inode: the inode (must be locked)
+ *   - file_block: index of the block inside the file
+ *   - run: where to store the number of contiguous blocks (at least 1)
+ *
+ * Returns the block number, or -1 if the block is not allocated.
+ */
+int inode_block_run(inode_t const *inode, size_t file_block, size_t *run);
+
+/**
+ * Allocate the missing blocks in a range of blocks of an inode.
+ *
+ * Missing blocks are allocated as extents, placed right after the preceding
+ * block of the file whenever possible, and recorded in the inode.
+ *
+ * Input:
+ *   - inode: the inode (must be locked for writing)
+ *   - file_block: index of the first block of the range inside the file
+ *   - count: number of blocks in the range
+ *
+ * Returns 0 if every block of the range is allocated, -1 otherwise (a prefix
+ * of the range may have been allocated).
+ *
+ * Possible errors:
+ *   - The range goes beyond the maximum file size.
+ *   - No free data blocks.
+ */
+int inode_blocks_reserve(inode_t *inode, size_t file_block, size_t count);
+
+/**
+ * Make sure that one of the blocks of an inode (if it is allocated) is not
+ * shared with a snapshot, so that it can be changed: a shared block (or
+ * indirect block on the way to it) is replaced with a copy.
+ *
+ * Input:
+ *   - inode: the inode (must be locked for writing)
+ *   - file_block: index of the block inside the file
+ *
+ * Returns true if successful, false if the copy could not be made (no free
+ * data blocks).
+ */
+bool inode_block_unshare(inode_t *inode, size_t file_block);
+
+/**
+ * Make sure that the fragments holding the contents of a file (if any) are
+ * not in a block shared with a snapshot, moving them to other fragments if
+ * they are.
+ *
+ * Input:
+ *   - inode: the file's inode (must be locked for writing)
+ *
+ * Returns true if successful, false if there were no free data blocks.
+ */
+bool inode_fragments_unshare(inode_t *inode);
+
+/**
+ * Check if any data block may be shared with a snapshot (if not, blocks can be
+ * changed in place without inode_block_unshare).
+ */
+bool state_blocks_shared(void);
+
+/**
+ * Free every data block (or fragment) of an inode (including its indirect
+ * blocks), leaving all of its block map entries unallocated. The contents of a
+ * file are then kept inline again.
+ *
+ * Input:
+ *   - inode: the inode (must be locked for writing)
+ */
+void inode_blocks_free(inode_t *inode);
+
 /**
  * Allocate a new data block.
  *
@@ -178,7 +505,23 @@ int find_in_dir(inode_t const *inode, char const *sub_name);
 int data_block_alloc(void);
 
 /**
- * Free a data block.
+ * Allocate a run of contiguous data blocks.
+ *
+ * Input:
+ *   - goal: block number where the run should preferably start (-1 for none)
+ *   - count: maximum number of blocks in the run
+ *   - allocated: where to store the number of blocks in the run
+ *
+ * Returns the number of the first block in the run if successful, -1
+ * otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ */
+int data_block_alloc_extent(int goal, size_t count, size_t *allocated);
+
+/**
+ * Free a data block (if it is shared, it only loses an owner).
  *
  * Input:
  *   - block_number: the block number/index
@@ -186,14 +529,115 @@ int data_block_alloc(void);
 void data_block_free(int block_number);
 
 /**
- * Obtain a pointer to the contents of a given block.
+ * Allocate a run of fragments of a data block, preferably in a block that
+ * already has fragments in use (and is not shared with a snapshot).
+ *
+ * Input:
+ *   - count: number of fragments (less than FRAGMENTS_PER_BLOCK)
+ *   - first: where to store the index of the first fragment of the run
+ *
+ * Returns the block's number if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ */
+int data_fragments_alloc(size_t count, size_t *first);
+
+/**
+ * Extend a run of fragments in place, if the fragments after it are free (and
+ * the block is not shared with a snapshot).
+ *
+ * Input:
+ *   - block_number: the block holding the run
+ *   - first: index of the first fragment of the run
+ *   - count: number of fragments in the run
+ *   - new_count: number of fragments the run must have
+ *
+ * Returns true if the run was extended, false otherwise.
+ */
+bool data_fragments_extend(int block_number, size_t first, size_t count,
+                           size_t new_count);
+
+/**
+ * Turn the block of a run of fragments into a whole block, if no other
+ * fragments of it are in use (and it is not shared with a snapshot).
+ *
+ * Input:
+ *   - block_number: the block holding the run
+ *   - first: index of the first fragment of the run
+ *   - count: number of fragments in the run
+ *
+ * Returns true if the block is no longer split into fragments, false otherwise.
+ */
+bool data_fragments_promote(int block_number, size_t first, size_t count);
+
+/**
+ * Free a run of fragments (and their block, once none of its fragments is in
+ * use).
+ *
+ * Input:
+ *   - block_number: the block holding the run
+ *   - first: index of the first fragment of the run
+ *   - count: number of fragments in the run
+ */
+void data_fragments_free(int block_number, size_t first, size_t count);
+
+/**
+ * Obtain a pointer to the contents of a file kept in fragments, going through
+ * the block cache.
+ *
+ * Input:
+ *   - inode: the file's inode (locked)
+ *   - dirty: whether the caller changes the contents
+ *
+ * Returns a pointer to the first byte of the file.
+ */
+void *inode_fragments_get(inode_t const *inode, bool dirty);
+
+/**
+ * Obtain a block's worth of zeros (not a data block: it must not be changed),
+ * which stands for the holes of sparse files.
+ */
+void const *data_block_zeros(void);
+
+/**
+ * Obtain a pointer to the contents of a given block, going through the block
+ * cache.
  *
  * Input:
  *   - block_number: the block number/index
+ *   - dirty: whether the caller changes the block (so that it is written back
+ *     when it is evicted from the block cache)
  *
  * Returns a pointer to the first byte of the block.
  */
-void *data_block_get(int block_number);
+void *data_block_get(int block_number, bool dirty);
+
+/**
+ * Obtain a pointer to the contents of a run of contiguous blocks (which must
+ * not cross a chunk of the data block table, like the runs of inode extents),
+ * going through the block cache.
+ *
+ * Input:
+ *   - block_number: the first block of the run
+ *   - count: number of blocks in the run
+ *   - dirty: whether the caller changes the blocks
+ *
+ * Returns a pointer to the first byte of the run.
+ */
+void *data_blocks_get(int block_number, size_t count, bool dirty);
+
+/**
+ * Obtain the block cache's statistics.
+ *
+ * Input:
+ *   - hits: where to store the number of block accesses served by the cache
+ *   - misses: where to store the number of block accesses that brought a block
+ *     in
+ *   - write_backs: where to store the number of changed blocks written back
+ *     when evicted
+ */
+void block_cache_stats(size_t *hits, size_t *misses, size_t *write_backs);
 
 /**
  * Add a new entry to the open file table.
@@ -223,18 +667,118 @@ void remove_from_open_file_table(int fhandle);
  * Input:
  *   - fhandle: file handle
  *
- * Returns pointer to the entry, or NULL if the fhandle is invalid/closed/never
- * opened.
+ * Returns pointer to the entry (with its lock held), or NULL if the fhandle is
+ * invalid/closed/never opened.
  */
 open_file_entry_t *get_open_file_entry(int fhandle);
 
+/**
+ * Obtain the inumber of an open file, without keeping its entry locked.
+ *
+ * The file is pinned (see inode_pin) before its entry is unlocked, so that it
+ * can not be deleted, nor its inode reused, if the handle is closed meanwhile:
+ * the caller must unpin it with inode_unpin when done with it.
+ *
+ * Input:
+ *   - fhandle: file handle
+ *
+ * Returns the inumber, or -1 if the fhandle is invalid/closed/never opened.
+ */
+int get_open_file_inumber(int fhandle);
+
 /**
  * Checks if a file is open.
+ *
+ * The check is only reliable while holding the lock of a directory the file
+ * is in, since tfs_open adds files to the open file table with it held.
  * 
  * Returns true if it is, false if not.
 */
 bool is_file_open(int inumber);
 
+/**
+ * Keep a file from being deleted while it is not locked, as if it were open
+ * (its last name can not be removed). Like opening it, it must be done while
+ * holding the lock of a directory the file is in (or of an entry of the open
+ * file table that refers to it).
+ *
+ * Input:
+ *   - inumber: the file's inode number
+ */
+void inode_pin(int inumber);
+
+/**
+ * Let a file pinned by inode_pin be deleted again.
+ *
+ * Input:
+ *   - inumber: the file's inode number
+ */
+void inode_unpin(int inumber);
+
+/**
+ * Start a change to the names of the FS (which involves more than one inode),
+ * which a snapshot must not see in part: snapshot_create waits for it to end.
+ * It is started after the inodes it changes are locked, and changes must not
+ * be nested. Changes to a single inode (under its write lock) need not be
+ * marked: the snapshot copies the inode before they are made.
+ */
+void state_mutation_begin(void);
+
+/**
+ * End a change to the FS started with state_mutation_begin.
+ */
+void state_mutation_end(void);
+
+/**
+ * Take a snapshot of the FS: a frozen copy of its inodes, which shares their
+ * blocks with the FS until the FS changes them (and copies them). Waits for
+ * the changes to names in progress to end, and holds new ones back only while
+ * it takes the inode bitmap; the inodes are then copied one at a time, and an
+ * inode about to change (when it is locked for writing, or deleted) is copied
+ * first.
+ *
+ * Returns the snapshot's id if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - MAX_SNAPSHOTS snapshots are kept already.
+ *   - No memory for the copy.
+ */
+int snapshot_create(void);
+
+/**
+ * Delete a snapshot, freeing the blocks that only it refers to.
+ *
+ * Input:
+ *   - id: the snapshot's id
+ *
+ * Returns 0 if successful, -1 if there is no such snapshot.
+ */
+int snapshot_delete(int id);
+
+/**
+ * Copy the tree of a snapshot into new inodes of the FS, sharing the blocks
+ * of its files (so the copy takes time in the number of inodes). Inodes that
+ * are not reachable from the snapshot's root are left out. The copy is
+ * not in any directory yet: it must be linked to one, or deleted with
+ * inode_tree_delete.
+ *
+ * Input:
+ *   - id: the snapshot's id
+ *
+ * Returns the inumber of the copy of the snapshot's root directory, or -1 if
+ * there is no such snapshot or there is no room for the copy.
+ */
+int snapshot_clone(int id);
+
+/**
+ * Delete a directory and everything in it (files only lose the links from
+ * within it), which no other thread can reach.
+ *
+ * Input:
+ *   - inumber: the directory's inumber
+ */
+void inode_tree_delete(int inumber);
+
 /**
  * Returns a pointer to the root inode.
  *
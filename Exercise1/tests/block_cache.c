@@ -0,0 +1,76 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+This test writes a file larger than the block cache, so that changed blocks are
+evicted (and written back), and then reads its last block over and over, which
+the cache must serve without bringing it in again. The contents must survive
+the evictions.
+*/
+
+#define CACHE_BLOCKS 4
+#define FILE_BLOCKS 12
+#define HOT_READS 20
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.block_cache_blocks = CACHE_BLOCKS;
+    assert(tfs_init(&params) != -1);
+
+    size_t const block_size = params.block_size;
+    char out[FILE_BLOCKS * 1024];
+    assert(block_size * FILE_BLOCKS <= sizeof(out));
+    for (size_t i = 0; i < FILE_BLOCKS; i++) {
+        memset(out + i * block_size, 'A' + (int)i, block_size);
+    }
+
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+
+    tfs_block_cache_stats_t before = tfs_block_cache_stats();
+    assert(tfs_write(f, out, block_size * FILE_BLOCKS) ==
+           (ssize_t)(block_size * FILE_BLOCKS));
+    tfs_block_cache_stats_t after = tfs_block_cache_stats();
+
+    // Every block was brought in, and all but the last few written back.
+    assert(after.misses - before.misses >= FILE_BLOCKS);
+    assert(after.write_backs - before.write_backs >= FILE_BLOCKS - CACHE_BLOCKS);
+
+    // The last block is hot.
+    char in[1024];
+    before = tfs_block_cache_stats();
+    for (int i = 0; i < HOT_READS; i++) {
+        assert(tfs_pread(f, in, block_size, (FILE_BLOCKS - 1) * block_size) ==
+               (ssize_t)block_size);
+        assert(memcmp(in, out + (FILE_BLOCKS - 1) * block_size, block_size) == 0);
+    }
+    after = tfs_block_cache_stats();
+    assert(after.misses == before.misses);
+    assert(after.hits - before.hits == HOT_READS);
+
+    // Evicted blocks keep their contents.
+    for (size_t i = 0; i < FILE_BLOCKS; i++) {
+        assert(tfs_pread(f, in, block_size, i * block_size) == (ssize_t)block_size);
+        assert(memcmp(in, out + i * block_size, block_size) == 0);
+    }
+    assert(tfs_close(f) != -1);
+
+    // Blocks of a deleted file are dropped rather than written back.
+    before = tfs_block_cache_stats();
+    assert(tfs_unlink("/f1") != -1);
+    f = tfs_open("/f2", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, out, block_size * CACHE_BLOCKS) ==
+           (ssize_t)(block_size * CACHE_BLOCKS));
+    after = tfs_block_cache_stats();
+    assert(after.write_backs - before.write_backs <= 1); // the root directory
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
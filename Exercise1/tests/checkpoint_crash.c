@@ -0,0 +1,148 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IMAGE "/tmp/tfs_checkpoint_crash.img"
+#define JOURNAL IMAGE ".journal"
+#define NEW_IMAGE IMAGE ".new"
+#define CRASHES 25
+#define FILES 8
+#define MAX_SIZE (12 * 1024)
+
+/*
+This test has a child process rewrite and checkpoint the files of a FS image
+over and over, and kills it at some point, most likely in the middle of a
+checkpoint. Mounting the image again must find it at one checkpoint or
+another (plus the names redone from the journal): every file holds one of
+the versions it was written with in whole (or nothing, if only its name was
+journaled), and filling the FS afterwards overwrites none of them.
+*/
+
+static char buffer[MAX_SIZE];
+
+static size_t size_of(int file) {
+    return 100 + (size_t)file * 1500;
+}
+
+static void rewrite_forever(tfs_params const *params, int crash) {
+    assert(tfs_init(params) != -1);
+
+    char path[MAX_FILE_NAME];
+    for (int round = 0;; round++) {
+        // The contents are rewritten in place (they are not journaled).
+        int file = round % FILES;
+        sprintf(path, "/f%d", file);
+        int fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        memset(buffer, 'a' + (crash + round) % 26, size_of(file));
+        assert(tfs_pwrite(fd, buffer, size_of(file), 0) == (ssize_t)size_of(file));
+        assert(tfs_close(fd) != -1);
+
+        // Names come and go.
+        sprintf(path, "/d%d", round % 3);
+        if (tfs_mkdir(path) == -1) {
+            assert(tfs_rmdir(path) != -1);
+        }
+        sprintf(path, "/n%d", round % 5);
+        if (tfs_unlink(path) == -1) {
+            fd = tfs_open(path, TFS_O_CREAT);
+            assert(fd != -1);
+            assert(tfs_write(fd, buffer, 2000) == 2000);
+            assert(tfs_close(fd) != -1);
+        }
+
+        assert(tfs_sync() != -1);
+    }
+}
+
+/**
+ * Checks the files, and records (or checks) the letter each one holds (0 if
+ * it is missing or empty).
+ */
+static void check_files(char letters[FILES], bool record) {
+    char path[MAX_FILE_NAME];
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/f%d", i);
+        char letter = 0;
+        int fd = tfs_open(path, 0);
+        if (fd != -1) {
+            ssize_t size = tfs_read(fd, buffer, sizeof(buffer));
+            assert(size == 0 || size == (ssize_t)size_of(i));
+            for (ssize_t b = 1; b < size; b++) {
+                assert(buffer[b] == buffer[0]);
+            }
+            if (size > 0) {
+                letter = buffer[0];
+            }
+            assert(tfs_close(fd) != -1);
+        }
+        if (record) {
+            letters[i] = letter;
+        } else {
+            assert(letters[i] == letter);
+        }
+    }
+}
+
+static void crash_and_check(tfs_params const *params) {
+    unsigned seed = 1;
+    for (int crash = 0; crash < CRASHES; crash++) {
+        pid_t pid = fork();
+        assert(pid != -1);
+        if (pid == 0) {
+            rewrite_forever(params, crash);
+        }
+
+        struct timespec delay = {0, 1000000 + rand_r(&seed) % 20000000};
+        nanosleep(&delay, NULL);
+        assert(kill(pid, SIGKILL) == 0);
+        int status;
+        assert(waitpid(pid, &status, 0) == pid);
+        assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+
+        assert(tfs_init(params) != -1);
+        char letters[FILES];
+        check_files(letters, true);
+
+        // The blocks in use are not given to another file.
+        int fd = tfs_open("/fill", TFS_O_CREAT);
+        assert(fd != -1);
+        memset(buffer, 'z', sizeof(buffer));
+        while (tfs_write(fd, buffer, sizeof(buffer)) > 0) {
+        }
+        assert(tfs_close(fd) != -1);
+        check_files(letters, false);
+        assert(tfs_unlink("/fill") != -1);
+        assert(tfs_destroy() != -1);
+    }
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 512;
+    params.image_path = IMAGE;
+
+    unlink(IMAGE);
+    unlink(JOURNAL);
+    crash_and_check(&params);
+
+    unlink(IMAGE);
+    unlink(JOURNAL);
+    params.data_mode = TFS_DATA_MAPPED;
+    crash_and_check(&params);
+
+    unlink(IMAGE);
+    unlink(JOURNAL);
+    unlink(NEW_IMAGE);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
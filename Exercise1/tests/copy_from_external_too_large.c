@@ -27,7 +27,11 @@ int main() {
     char *path_src = "tests/file_to_copy_over1024.txt";
     char buffer[1500];
 
-    assert(tfs_init(NULL) != -1);
+    // Only one data block is left for files (the other one belongs to the
+    // root directory), so the source file does not fit.
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 2;
+    assert(tfs_init(&params) != -1);
 
     int f;
     ssize_t r;
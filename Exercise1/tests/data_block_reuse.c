@@ -0,0 +1,76 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILES (10)
+#define FILE_SIZE (8 * 1024)
+
+/*
+This test fills most of a small file system (whose block count is not a
+multiple of 64), removes every other file and checks that the freed blocks
+are found again (after the allocator wraps around) until the FS is full.
+*/
+
+static char buffer[FILE_SIZE];
+
+static void write_file(char const *path, char c, ssize_t expected) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    memset(buffer, c, sizeof(buffer));
+    assert(tfs_write(f, buffer, sizeof(buffer)) == expected);
+    assert(tfs_close(f) != -1);
+}
+
+static void check_file(char const *path, char c) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        assert(buffer[i] == c);
+    }
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    char path[16];
+
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 32;
+    params.max_block_count = 100;
+    assert(tfs_init(&params) != -1);
+
+    // 10 files with 8 blocks each, plus the root directory's block.
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/f%d", i);
+        write_file(path, (char)('a' + i), FILE_SIZE);
+    }
+
+    for (int i = 0; i < FILES; i += 2) {
+        sprintf(path, "/f%d", i);
+        assert(tfs_unlink(path) != -1);
+    }
+
+    // 19 blocks were never used and 40 were freed: 7 new files fit, the 8th
+    // only partially.
+    for (int i = 0; i < 7; i++) {
+        sprintf(path, "/g%d", i);
+        write_file(path, (char)('A' + i), FILE_SIZE);
+    }
+    write_file("/g7", 'Z', 3 * 1024);
+
+    for (int i = 1; i < FILES; i += 2) {
+        sprintf(path, "/f%d", i);
+        check_file(path, (char)('a' + i));
+    }
+    for (int i = 0; i < 7; i++) {
+        sprintf(path, "/g%d", i);
+        check_file(path, (char)('A' + i));
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+
+/*
+This test checks that repeated name lookups are answered by the dentry cache,
+and that the cache follows files being created and removed (for names that
+exist as well as for names that do not).
+*/
+
+static void open_and_close(char const *path, tfs_file_mode_t mode) {
+    int f = tfs_open(path, mode);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    tfs_dcache_stats_t before = tfs_dcache_stats();
+    assert(before.hits == 0);
+
+    // Missing names are cached too.
+    assert(tfs_open("/f1", 0) == -1);
+    assert(tfs_open("/f1", 0) == -1);
+    tfs_dcache_stats_t after = tfs_dcache_stats();
+    assert(after.hits == before.hits + 1);
+    assert(after.misses == before.misses + 1);
+
+    // Creating the file replaces the cached miss.
+    open_and_close("/f1", TFS_O_CREAT);
+    before = tfs_dcache_stats();
+    for (int i = 0; i < 10; i++) {
+        open_and_close("/f1", 0);
+    }
+    after = tfs_dcache_stats();
+    assert(after.hits == before.hits + 10);
+    assert(after.misses == before.misses);
+
+    // Removing it (or a directory) is seen by the next lookups.
+    assert(tfs_unlink("/f1") != -1);
+    assert(tfs_open("/f1", 0) == -1);
+    assert(tfs_mkdir("/d") != -1);
+    open_and_close("/d/f2", TFS_O_CREAT);
+    assert(tfs_unlink("/d/f2") != -1);
+    assert(tfs_rmdir("/d") != -1);
+    assert(tfs_open("/d/f2", TFS_O_CREAT) == -1);
+
+    // A new directory reusing the inode finds no stale names.
+    assert(tfs_mkdir("/e") != -1);
+    assert(tfs_open("/e/f2", 0) == -1);
+    open_and_close("/e/f2", TFS_O_CREAT);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
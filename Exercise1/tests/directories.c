@@ -0,0 +1,77 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+This test creates nested directories, works with files inside them (through
+regular, hard and symbolic links), and removes them again.
+*/
+
+static void write_contents(char const *path, char const *contents) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, contents, strlen(contents)) == strlen(contents));
+    assert(tfs_close(f) != -1);
+}
+
+static void assert_contents_ok(char const *path, char const *contents) {
+    char buffer[64];
+
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == strlen(contents));
+    assert(memcmp(buffer, contents, strlen(contents)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    assert(tfs_mkdir("/a") != -1);
+    assert(tfs_mkdir("/a/b") != -1);
+    assert(tfs_mkdir("/a") == -1);          // already exists
+    assert(tfs_mkdir("/x/y") == -1);        // missing parent
+    assert(tfs_mkdir("/a//c") == -1);       // empty component
+
+    write_contents("/a/b/f1", "nested");
+    write_contents("/a/f1", "not so nested");
+    assert_contents_ok("/a/b/f1", "nested");
+    assert_contents_ok("/a/f1", "not so nested");
+
+    // Directories can not be opened, written or unlinked as files, nor be
+    // used as files in a path.
+    assert(tfs_open("/a/b", 0) == -1);
+    assert(tfs_open("/a/b", TFS_O_CREAT) == -1);
+    assert(tfs_unlink("/a/b") == -1);
+    assert(tfs_open("/a/b/f1/f2", TFS_O_CREAT) == -1);
+    assert(tfs_open("/a/c/f1", TFS_O_CREAT) == -1);
+
+    // Links across directories.
+    assert(tfs_link("/a/b/f1", "/l1") != -1);
+    assert(tfs_sym_link("/a/f1", "/a/b/s1") != -1);
+    assert(tfs_link("/a/b", "/l2") == -1); // no hard links to directories
+    assert(tfs_link("/a/b", "/a/b/l2") == -1); // not even inside them
+    assert(tfs_link("/a", "/a/b/l2") == -1);
+    assert_contents_ok("/l1", "nested");
+    assert_contents_ok("/a/b/s1", "not so nested");
+
+    // Only empty directories can be removed.
+    assert(tfs_rmdir("/a/b") == -1);
+    assert(tfs_unlink("/a/b/f1") != -1);
+    assert(tfs_unlink("/a/b/s1") != -1);
+    assert(tfs_rmdir("/a/b/f1") == -1);
+    assert(tfs_rmdir("/a/b") != -1);
+    assert(tfs_open("/a/b/f1", TFS_O_CREAT) == -1);
+    assert_contents_ok("/l1", "nested");
+
+    assert(tfs_unlink("/a/f1") != -1);
+    assert(tfs_rmdir("/a") != -1);
+    assert(tfs_rmdir("/a") == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,67 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+
+// Entries that fit in the root directory's block (1024 / sizeof(dir_entry_t)).
+#define ENTRIES (21)
+
+/*
+This test fills the root directory, removes and re-adds entries, and checks
+that every remaining name is still found (even after probing past the slots
+of removed entries) and that a full directory rejects new names.
+*/
+
+static void create(char const *path) {
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+}
+
+static void check_exists(char const *path, int exists) {
+    int f = tfs_open(path, 0);
+    assert((f != -1) == exists);
+    if (f != -1) {
+        assert(tfs_close(f) != -1);
+    }
+}
+
+int main() {
+    char path[16];
+
+    assert(tfs_init(NULL) != -1);
+
+    for (int i = 0; i < ENTRIES; i++) {
+        sprintf(path, "/file%d", i);
+        create(path);
+    }
+    assert(tfs_open("/one_too_many", TFS_O_CREAT) == -1);
+
+    for (int i = 0; i < ENTRIES; i += 2) {
+        sprintf(path, "/file%d", i);
+        assert(tfs_unlink(path) != -1);
+    }
+
+    for (int i = 0; i < ENTRIES; i++) {
+        sprintf(path, "/file%d", i);
+        check_exists(path, i % 2);
+    }
+
+    for (int i = 0; i < ENTRIES; i += 2) {
+        sprintf(path, "/other%d", i);
+        create(path);
+    }
+    assert(tfs_open("/one_too_many", TFS_O_CREAT) == -1);
+
+    for (int i = 0; i < ENTRIES; i++) {
+        sprintf(path, "/file%d", i);
+        check_exists(path, i % 2);
+        sprintf(path, "/other%d", i);
+        check_exists(path, !(i % 2));
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+This test checks that files smaller than a block share blocks, as runs of
+fragments: with two free data blocks, eight files of two fragments each fit,
+but not a ninth until one of them is deleted. A file that grows takes
+the whole block once it is alone in it, keeping its contents (and leaving the
+other files in their blocks alone). The fragments in use must be known again
+after mounting an image of the FS.
+*/
+
+#define IMAGE "/tmp/tfs_fragments.img"
+#define FILES 8
+#define SMALL_SIZE 200 // two fragments of 128 bytes
+
+static char contents[FILES + 1][1024];
+
+static void write_file(char const *path, char const *data, size_t len, ssize_t expected) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, data, len) == expected);
+    assert(tfs_close(f) != -1);
+}
+
+static void check_file(char const *path, char const *data, size_t len) {
+    char buffer[1025];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)len);
+    assert(memcmp(buffer, data, len) == 0);
+    assert(tfs_pread(f, buffer, len, 0) == (ssize_t)len);
+    assert(memcmp(buffer, data, len) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    unlink(IMAGE);
+    unlink(IMAGE ".journal");
+
+    char names[FILES + 1][16];
+    for (int i = 0; i <= FILES; i++) {
+        snprintf(names[i], sizeof(names[i]), "/f%d", i);
+        for (size_t j = 0; j < sizeof(contents[i]); j++) {
+            contents[i][j] = (char)('A' + (i * 7 + (int)j) % 26);
+        }
+    }
+
+    // The root directory takes one of the blocks.
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 3;
+    params.image_path = IMAGE;
+    assert(tfs_init(&params) != -1);
+
+    for (int i = 0; i < FILES; i++) {
+        write_file(names[i], contents[i], SMALL_SIZE, SMALL_SIZE);
+    }
+    write_file(names[FILES], contents[FILES], SMALL_SIZE, -1);
+    for (int i = 0; i < FILES; i++) {
+        check_file(names[i], contents[i], SMALL_SIZE);
+    }
+
+    // The fragments in use survive mounting the image again.
+    assert(tfs_destroy() != -1);
+    assert(tfs_init(&params) != -1);
+    for (int i = 0; i < FILES; i++) {
+        check_file(names[i], contents[i], SMALL_SIZE);
+    }
+    write_file(names[FILES], contents[FILES], SMALL_SIZE, -1);
+
+    // Deleting a file makes room for another.
+    assert(tfs_unlink(names[0]) != -1);
+    write_file(names[FILES], contents[FILES], SMALL_SIZE, SMALL_SIZE);
+    for (int i = 1; i <= FILES; i++) {
+        check_file(names[i], contents[i], SMALL_SIZE);
+    }
+
+    // Growing a file needs more fragments than its block has free.
+    write_file(names[1], contents[1] + SMALL_SIZE, 300, -1);
+    check_file(names[1], contents[1], SMALL_SIZE);
+
+    // Once the other files sharing its block are gone, a file can take the
+    // whole block without needing a free one.
+    for (int i = 1; i <= 4; i++) {
+        assert(tfs_unlink(names[i]) != -1);
+    }
+    int grown = -1;
+    for (int i = 5; i <= FILES && grown == -1; i++) {
+        int f = tfs_open(names[i], TFS_O_APPEND);
+        assert(f != -1);
+        if (tfs_write(f, contents[i] + SMALL_SIZE, 1024 - SMALL_SIZE) != -1) {
+            grown = i;
+        }
+        assert(tfs_close(f) != -1);
+    }
+    assert(grown != -1);
+    check_file(names[grown], contents[grown], 1024);
+    for (int i = 5; i <= FILES; i++) {
+        if (i != grown) {
+            check_file(names[i], contents[i], SMALL_SIZE);
+        }
+    }
+
+    // Truncating it brings it back inline, and frees the block.
+    int f = tfs_open(names[grown], TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    write_file("/big", contents[0], 1024, 1024);
+    check_file("/big", contents[0], 1024);
+
+    assert(tfs_destroy() != -1);
+    unlink(IMAGE);
+    unlink(IMAGE ".journal");
+
+    printf("Successful test.\n");
+
+    return 0;
+}
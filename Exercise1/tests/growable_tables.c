@@ -0,0 +1,97 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define INODES 300
+#define BLOCKS 1100
+#define OPEN_FILES 70
+#define FILES 200
+#define DIRS 16
+#define LARGE_SIZE (600 * 1024)
+
+/*
+This test uses limits much larger than the chunks the tables start with, and
+checks that the inode table, the data blocks and the open file table grow up
+to (and not past) them, with the data of a file that spans several chunks of
+blocks read back intact.
+*/
+
+static char large[LARGE_SIZE];
+static char buffer[LARGE_SIZE];
+
+int main() {
+    char path[MAX_FILE_NAME];
+    int handles[OPEN_FILES];
+
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = INODES;
+    params.max_block_count = BLOCKS;
+    params.max_open_files_count = OPEN_FILES;
+    assert(tfs_init(&params) != -1);
+
+    // Many small files, each with a block of its own.
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/d%d", i % DIRS);
+        if (i < DIRS) {
+            assert(tfs_mkdir(path) != -1);
+        }
+        sprintf(path, "/d%d/f%d", i % DIRS, i);
+        int fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_write(fd, path, strlen(path)) == (ssize_t)strlen(path));
+        assert(tfs_close(fd) != -1);
+    }
+
+    // A file larger than a chunk of blocks.
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        large[i] = (char)('a' + (i / 1000 + i) % 26);
+    }
+    int fd = tfs_open("/large", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, large, LARGE_SIZE) == LARGE_SIZE);
+    assert(tfs_pread(fd, buffer, LARGE_SIZE, 0) == LARGE_SIZE);
+    assert(memcmp(buffer, large, LARGE_SIZE) == 0);
+    assert(tfs_close(fd) != -1);
+
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/d%d/f%d", i % DIRS, i);
+        fd = tfs_open(path, 0);
+        assert(fd != -1);
+        memset(buffer, 0, sizeof(path));
+        assert(tfs_read(fd, buffer, sizeof(path)) == (ssize_t)strlen(path));
+        assert(strcmp(buffer, path) == 0);
+        assert(tfs_close(fd) != -1);
+    }
+
+    // The open file table grows up to its limit.
+    for (int i = 0; i < OPEN_FILES; i++) {
+        handles[i] = tfs_open("/large", 0);
+        assert(handles[i] != -1);
+    }
+    assert(tfs_open("/large", 0) == -1);
+    for (int i = 0; i < OPEN_FILES; i++) {
+        assert(tfs_close(handles[i]) != -1);
+    }
+    assert(tfs_close(OPEN_FILES) == -1);
+
+    // The inode table grows up to its limit (the root directory, the other
+    // directories and the large file are also there).
+    int created = 0;
+    for (int i = 0; i < INODES; i++) {
+        sprintf(path, "/d%d/g%d", i % DIRS, i);
+        fd = tfs_open(path, TFS_O_CREAT);
+        if (fd == -1) {
+            break;
+        }
+        assert(tfs_close(fd) != -1);
+        created++;
+    }
+    assert(created == INODES - FILES - DIRS - 2);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
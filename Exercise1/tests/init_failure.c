@@ -0,0 +1,35 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+This test asks for tables too large to be allocated, so that tfs_init fails
+at different points, and checks that each failure undoes what was done: the
+FS can still be initialized and used afterwards.
+*/
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = SIZE_MAX / 64;
+    assert(tfs_init(&params) == -1);
+
+    params = tfs_default_params();
+    params.max_inode_count = SIZE_MAX / 64;
+    assert(tfs_init(&params) == -1);
+
+    params = tfs_default_params();
+    params.max_open_files_count = SIZE_MAX / 64;
+    assert(tfs_init(&params) == -1);
+
+    assert(tfs_init(NULL) != -1);
+    int fd = tfs_open("/f1", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, "data", 4) == 4);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
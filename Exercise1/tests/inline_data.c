@@ -0,0 +1,135 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+This test checks that small files and short symbolic link targets are kept in
+their inodes: with a single free data block, many small files can be written. A file
+that outgrows its inode moves to data blocks (keeping its contents), unless
+there are none left, in which case the write fails and the file is left as it
+was. Truncating it brings the file back inline and frees its block.
+*/
+
+#define SMALL_FILES 8
+#define SMALL "small contents"
+#define LARGE_SIZE 600
+
+static void check_file(char const *path, char const *contents, size_t len) {
+    char buffer[LARGE_SIZE + 1];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)len);
+    assert(memcmp(buffer, contents, len) == 0);
+
+    // Views of inline contents are a single segment.
+    assert(tfs_close(f) != -1);
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    tfs_view_t view;
+    assert(tfs_read_view(f, sizeof(buffer), &view) == (ssize_t)len);
+    size_t offset = 0;
+    for (int i = 0; i < view.tv_count; i++) {
+        assert(memcmp(view.tv_segments[i].iov_base, contents + offset,
+                      view.tv_segments[i].iov_len) == 0);
+        offset += view.tv_segments[i].iov_len;
+    }
+    assert(offset == len);
+    assert(tfs_release_view(&view) != -1);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    char large[LARGE_SIZE];
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        large[i] = (char)('a' + i % 26);
+    }
+
+    // The root directory takes one of the blocks.
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 2;
+    assert(tfs_init(&params) != -1);
+
+    char names[SMALL_FILES][16];
+    for (int i = 0; i < SMALL_FILES; i++) {
+        snprintf(names[i], sizeof(names[i]), "/f%d", i);
+        int f = tfs_open(names[i], TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, SMALL, sizeof(SMALL)) == sizeof(SMALL));
+        assert(tfs_close(f) != -1);
+    }
+    for (int i = 0; i < SMALL_FILES; i++) {
+        check_file(names[i], SMALL, sizeof(SMALL));
+    }
+
+    // Filling a gap and writing right up to the end of the inline contents.
+    int f = tfs_open("/gap", TFS_O_CREAT);
+    assert(f != -1);
+    char zeros[100] = {0};
+    assert(tfs_pwrite(f, large, 92, 100) == 92);
+    assert(tfs_close(f) != -1);
+    char expected[192];
+    memcpy(expected, zeros, 100);
+    memcpy(expected + 100, large, 92);
+    check_file("/gap", expected, sizeof(expected));
+
+    // Outgrowing the inode takes the free block.
+    f = tfs_open(names[0], TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, large, LARGE_SIZE - sizeof(SMALL)) ==
+           LARGE_SIZE - sizeof(SMALL));
+    assert(tfs_close(f) != -1);
+    char grown[LARGE_SIZE];
+    memcpy(grown, SMALL, sizeof(SMALL));
+    memcpy(grown + sizeof(SMALL), large, LARGE_SIZE - sizeof(SMALL));
+    check_file(names[0], grown, LARGE_SIZE);
+
+    // No block is left for another file to outgrow its inode.
+    f = tfs_open(names[1], TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, large, LARGE_SIZE) == -1);
+    assert(tfs_close(f) != -1);
+    check_file(names[1], SMALL, sizeof(SMALL));
+
+    // Truncating the large file frees its block.
+    f = tfs_open(names[0], TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, SMALL, sizeof(SMALL)) == sizeof(SMALL));
+    assert(tfs_close(f) != -1);
+    check_file(names[0], SMALL, sizeof(SMALL));
+
+    f = tfs_open(names[1], 0);
+    assert(f != -1);
+    assert(tfs_write(f, large, LARGE_SIZE) == LARGE_SIZE);
+    assert(tfs_close(f) != -1);
+    check_file(names[1], large, LARGE_SIZE);
+
+    assert(tfs_sym_link(names[2], "/short") != -1);
+    check_file("/short", SMALL, sizeof(SMALL));
+    assert(tfs_destroy() != -1);
+
+    // A symbolic link target that does not fit in the inode.
+    assert(tfs_init(NULL) != -1);
+    char long_target[256] = "";
+    for (int i = 0; i < 5; i++) {
+        char dir[40];
+        memset(dir, 'a' + i, sizeof(dir) - 1);
+        dir[sizeof(dir) - 1] = '\0';
+        strcat(long_target, "/");
+        strcat(long_target, dir);
+        assert(tfs_mkdir(long_target) != -1);
+    }
+    strcat(long_target, "/f");
+    f = tfs_open(long_target, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, SMALL, sizeof(SMALL)) == sizeof(SMALL));
+    assert(tfs_close(f) != -1);
+    assert(tfs_sym_link(long_target, "/long") != -1);
+    check_file("/long", SMALL, sizeof(SMALL));
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define IMAGE "/tmp/tfs_journal_recovery.img"
+#define JOURNAL IMAGE ".journal"
+#define THREADS 8
+#define FILES_PER_THREAD 10
+
+/*
+This test has a child process change the namespace of a FS image (from many
+threads, so that their journal records are committed together) and exit
+without writing the image back, as if it crashed. Mounting the image again
+must redo every change recorded in the journal, and ignore a torn record at
+its end. A snapshot mounted before the crash survives only if it was synced;
+otherwise it is left out, with the changes made inside it.
+*/
+
+void* create_files(void* num) {
+    int number = *(int*)num;
+    char path[MAX_FILE_NAME];
+
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        sprintf(path, "/t%d/f%d", number, i);
+        int fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_close(fd) != -1);
+    }
+    sprintf(path, "/t%d/f0", number);
+    assert(tfs_unlink(path) != -1);
+
+    return NULL;
+}
+
+static void crash_after_changes(tfs_params const *params) {
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid > 0) {
+        int status;
+        assert(waitpid(pid, &status, 0) == pid);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        return;
+    }
+
+    int numbers[THREADS];
+    pthread_t tid[THREADS];
+    char path[MAX_FILE_NAME];
+
+    assert(tfs_init(params) != -1);
+
+    // Written back before the crash.
+    assert(tfs_mkdir("/synced") != -1);
+    int fd = tfs_open("/synced/data", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, "durable", 7) == 7);
+    assert(tfs_close(fd) != -1);
+    int snapshot = tfs_snapshot_create();
+    assert(snapshot != -1);
+    assert(tfs_snapshot_mount(snapshot, "/kept") != -1);
+    assert(tfs_sync() != -1);
+
+    // Mounted copies are not journaled.
+    assert(tfs_snapshot_mount(snapshot, "/lost") != -1);
+    fd = tfs_open("/lost/new", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_link("/lost/synced/data", "/from_lost") != -1);
+    assert(tfs_unlink("/kept/synced/data") != -1);
+
+    // Only in the journal.
+    for (int i = 0; i < THREADS; i++) {
+        sprintf(path, "/t%d", i);
+        assert(tfs_mkdir(path) != -1);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        numbers[i] = i;
+        pthread_create(&tid[i], NULL, create_files, &numbers[i]);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    assert(tfs_link("/synced/data", "/hard") != -1);
+    assert(tfs_sym_link("/hard", "/soft") != -1);
+    assert(tfs_unlink("/synced/data") != -1);
+    assert(tfs_rmdir("/synced") != -1);
+
+    _exit(0);
+}
+
+int main() {
+    char path[MAX_FILE_NAME];
+    char buffer[16];
+
+    unlink(IMAGE);
+    unlink(JOURNAL);
+
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 128;
+    params.image_path = IMAGE;
+    crash_after_changes(&params);
+
+    // A torn record (from a crash in the middle of a flush) is ignored.
+    FILE *journal = fopen(JOURNAL, "a");
+    assert(journal != NULL);
+    assert(fwrite("\1\0\0\0\50\0\0\0", 1, 8, journal) == 8);
+    assert(fclose(journal) == 0);
+
+    assert(tfs_init(&params) != -1);
+
+    for (int t = 0; t < THREADS; t++) {
+        for (int i = 0; i < FILES_PER_THREAD; i++) {
+            sprintf(path, "/t%d/f%d", t, i);
+            int fd = tfs_open(path, 0);
+            assert((fd == -1) == (i == 0));
+            if (fd != -1) {
+                assert(tfs_close(fd) != -1);
+            }
+        }
+    }
+
+    // The file's contents were in the image, its new names in the journal.
+    int fd = tfs_open("/soft", 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == 7);
+    assert(memcmp(buffer, "durable", 7) == 0);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_open("/synced/data", 0) == -1);
+    assert(tfs_mkdir("/synced") != -1);
+
+    // The synced copy is there (with the changes made to it since), the other
+    // one is not.
+    assert(tfs_open("/kept/synced/data", 0) == -1);
+    assert(tfs_mkdir("/kept/synced/other") != -1);
+    assert(tfs_open("/lost", 0) == -1);
+    assert(tfs_open("/lost/new", 0) == -1);
+    assert(tfs_open("/from_lost", 0) == -1);
+    assert(tfs_mkdir("/lost") != -1);
+
+    assert(tfs_destroy() != -1);
+
+    // Recovery checkpointed the image, so nothing is redone twice.
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/t1/f0", 0) == -1);
+    fd = tfs_open("/hard", 0);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_destroy() != -1);
+
+    unlink(IMAGE);
+    unlink(JOURNAL);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+This test checks that the latency model is applied: with a cost per access to
+the FS structures, creating, writing and reading a file takes at least as long
+as the accesses it makes, both sleeping and spinning.
+*/
+
+#define COST_NS (2000000ul) // 2 ms
+
+static double elapsed_ns(struct timespec const *start) {
+    struct timespec now;
+    assert(clock_gettime(CLOCK_MONOTONIC, &now) == 0);
+    return (double)(now.tv_sec - start->tv_sec) * 1e9 +
+           (double)(now.tv_nsec - start->tv_nsec);
+}
+
+static void run(tfs_latency_model latency, double min_ns) {
+    tfs_params params = tfs_default_params();
+    params.latency = latency;
+    assert(tfs_init(&params) != -1);
+
+    // Too large to be kept inline in the inode, so it takes a data block.
+    char buffer[512] = "latency";
+    struct timespec start;
+    assert(clock_gettime(CLOCK_MONOTONIC, &start) == 0);
+
+    // Creating the file scans the root directory, allocates an inode and adds
+    // an entry; writing and reading it get its data block.
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    assert(tfs_close(f) != -1);
+
+    assert(elapsed_ns(&start) >= min_ns);
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    run(tfs_fixed_latency(TFS_LATENCY_NONE, COST_NS), 0);
+
+    // At least a directory scan, an inode and a data block on each path.
+    run(tfs_fixed_latency(TFS_LATENCY_SLEEP, COST_NS), 3.0 * COST_NS);
+    run(tfs_fixed_latency(TFS_LATENCY_SPIN, COST_NS), 3.0 * COST_NS);
+
+    // Only data blocks cost anything: the write brings the block into the
+    // block cache, where the read finds it.
+    tfs_latency_model blocks = tfs_fixed_latency(TFS_LATENCY_SLEEP, 0);
+    blocks.block_ns = COST_NS;
+    run(blocks, 1.0 * COST_NS);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE "/tmp/tfs_mapped_image.img"
+#define LARGE_SIZE (400 * 1024)
+
+/*
+This test keeps the data blocks of an image mapped from it, and checks that
+the image can be mounted again (mapped, prefaulted or read into memory) with
+its contents intact, and that mapped blocks require an image.
+*/
+
+static char large[LARGE_SIZE];
+static char buffer[LARGE_SIZE];
+
+static void check_large(void) {
+    int fd = tfs_open("/large", 0);
+    assert(fd != -1);
+
+    // Reads in pieces, so that each read prefetches the next blocks.
+    size_t total = 0;
+    ssize_t r;
+    while ((r = tfs_read(fd, buffer + total, 10000)) > 0) {
+        total += (size_t)r;
+    }
+    assert(r == 0);
+    assert(total == LARGE_SIZE);
+    assert(memcmp(buffer, large, LARGE_SIZE) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    unlink(IMAGE);
+    unlink(IMAGE ".journal");
+
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        large[i] = (char)('a' + (i / 3000 + i) % 26);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.data_mode = TFS_DATA_MAPPED;
+    assert(tfs_init(&params) == -1);
+
+    params.image_path = IMAGE;
+    assert(tfs_init(&params) != -1);
+    int fd = tfs_open("/large", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, large, LARGE_SIZE) == LARGE_SIZE);
+    assert(tfs_close(fd) != -1);
+    check_large();
+    assert(tfs_destroy() != -1);
+
+    params.data_populate = true;
+    params.data_hugepages = true;
+    assert(tfs_init(&params) != -1);
+    check_large();
+
+    // Overwrites part of the file; the change reaches the image by tfs_sync.
+    fd = tfs_open("/large", 0);
+    assert(fd != -1);
+    memset(large + 5000, 'Z', 300000);
+    assert(tfs_pwrite(fd, large + 5000, 300000, 5000) == 300000);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_sync() != -1);
+    assert(tfs_destroy() != -1);
+
+    // The layout of the image does not depend on how its blocks are kept.
+    params.data_mode = TFS_DATA_IN_MEMORY;
+    assert(tfs_init(&params) != -1);
+    check_large();
+    assert(tfs_destroy() != -1);
+
+    unlink(IMAGE);
+    unlink(IMAGE ".journal");
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define THREADS 5
+#define MAX_OPEN 21
+
+/*
+This test has THREADS threads open the same file until the open file table is
+full, and checks that every entry is handed out exactly once, even though the
+threads allocate from different shards of the table. It then checks that an
+open file can not be unlinked until all its handles are closed.
+*/
+
+int handles[THREADS][MAX_OPEN];
+int opened[THREADS];
+
+void* open_all(void* num) {
+    int number = *(int*)num;
+
+    int fd;
+    while ((fd = tfs_open("/f1", 0)) != -1) {
+        handles[number][opened[number]++] = fd;
+    }
+
+    return NULL;
+}
+
+int main() {
+    int numbers[THREADS];
+    pthread_t tid[THREADS];
+    int seen[MAX_OPEN];
+    int kept = -1;
+
+    tfs_params params = tfs_default_params();
+    params.max_open_files_count = MAX_OPEN;
+    assert(tfs_init(&params) != -1);
+
+    int fd = tfs_open("/f1", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < THREADS; i++) {
+            numbers[i] = i;
+            opened[i] = 0;
+            pthread_create(&tid[i], NULL, open_all, &numbers[i]);
+        }
+        for (int i = 0; i < THREADS; i++) {
+            pthread_join(tid[i], NULL);
+        }
+
+        memset(seen, 0, sizeof(seen));
+        int total = 0;
+        for (int i = 0; i < THREADS; i++) {
+            for (int j = 0; j < opened[i]; j++) {
+                assert(handles[i][j] >= 0 && handles[i][j] < MAX_OPEN);
+                assert(!seen[handles[i][j]]);
+                seen[handles[i][j]] = 1;
+                total++;
+            }
+        }
+        assert(total == MAX_OPEN);
+
+        // The file is open, so it can not be unlinked.
+        assert(tfs_unlink("/f1") == -1);
+
+        for (int i = 0; i < THREADS; i++) {
+            for (int j = 0; j < opened[i]; j++) {
+                if (round == 1 && kept == -1) {
+                    kept = handles[i][j]; // Keeps one handle open.
+                    continue;
+                }
+                assert(tfs_close(handles[i][j]) != -1);
+            }
+        }
+    }
+
+    assert(tfs_unlink("/f1") == -1);
+    assert(tfs_close(kept) != -1);
+    assert(tfs_close(kept) == -1);
+    assert(tfs_unlink("/f1") != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE "/tmp/tfs_persistent_image.img"
+#define LARGE_SIZE (300 * 1024)
+
+/*
+This test creates a FS backed by an image file, fills it with directories,
+files, hard links and symbolic links, and checks that everything is still
+there after mounting the image again (with different parameters, which are
+ignored in favour of the image's). It also checks that changes made after a
+tfs_sync persist, and that neither a damaged image nor a file that is not an
+image is mounted.
+*/
+
+static char large[LARGE_SIZE];
+static char buffer[LARGE_SIZE];
+
+static void check_file(char const *path, char const *contents, size_t len) {
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == (ssize_t)len);
+    assert(memcmp(buffer, contents, len) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    unlink(IMAGE);
+    unlink(IMAGE ".journal");
+
+    for (size_t i = 0; i < LARGE_SIZE; i++) {
+        large[i] = (char)('A' + (i / 1024 + i) % 26);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 2048;
+    params.image_path = IMAGE;
+    assert(tfs_init(&params) != -1);
+
+    assert(tfs_mkdir("/box") != -1);
+    int fd = tfs_open("/box/msg", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, "hello", 5) == 5);
+    assert(tfs_close(fd) != -1);
+    fd = tfs_open("/large", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, large, LARGE_SIZE) == LARGE_SIZE);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_link("/box/msg", "/hard") != -1);
+    assert(tfs_sym_link("/large", "/soft") != -1);
+    fd = tfs_open("/gone", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_unlink("/gone") != -1);
+
+    assert(tfs_destroy() != -1);
+
+    // The image keeps its own limits.
+    params = tfs_default_params();
+    params.image_path = IMAGE;
+    assert(tfs_init(&params) != -1);
+
+    check_file("/box/msg", "hello", 5);
+    check_file("/hard", "hello", 5);
+    check_file("/soft", large, LARGE_SIZE);
+    check_file("/large", large, LARGE_SIZE);
+    assert(tfs_open("/gone", 0) == -1);
+
+    // The hard link count was kept too.
+    assert(tfs_unlink("/box/msg") != -1);
+    check_file("/hard", "hello", 5);
+
+    fd = tfs_open("/box/new", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, "after", 5) == 5);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_sync() != -1);
+
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init(&params) != -1);
+    check_file("/box/new", "after", 5);
+    assert(tfs_open("/box/msg", 0) == -1);
+    assert(tfs_destroy() != -1);
+
+    // An image with a damaged inode is not mounted: here, the first block of
+    // the root directory (whose inode follows the 4 KiB superblock, with its
+    // block map 16 bytes in) is past the end of the image.
+    int32_t bad_block = INT32_MAX;
+    FILE *file = fopen(IMAGE, "r+");
+    assert(file != NULL);
+    assert(fseek(file, 4096 + 16, SEEK_SET) == 0);
+    assert(fwrite(&bad_block, sizeof(bad_block), 1, file) == 1);
+    assert(fclose(file) == 0);
+    assert(tfs_init(&params) == -1);
+
+    // A file that holds something else is not mounted.
+    file = fopen(IMAGE, "w");
+    assert(file != NULL);
+    assert(fputs("not an image", file) != EOF);
+    assert(fclose(file) == 0);
+    assert(tfs_init(&params) == -1);
+
+    // The FS without an image is unaffected.
+    assert(tfs_init(NULL) != -1);
+    assert(tfs_open("/box/new", 0) == -1);
+    assert(tfs_sync() != -1);
+    assert(tfs_destroy() != -1);
+
+    unlink(IMAGE);
+    unlink(IMAGE ".journal");
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,278 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+This test takes snapshots of the FS and mounts them. A mounted snapshot keeps
+the files as they were when it was taken (inline, in fragments, in indirect
+blocks, with holes, and with hard links between them), whatever happens to
+them afterwards, and changing it does not change the FS or the snapshot. The
+blocks that only a deleted snapshot referred to are freed, and mounted copies
+still share their blocks correctly after the FS is loaded from an image.
+Writes go on while a snapshot is taken, and it sees each of them whole.
+*/
+
+#define BLOCK 1024
+#define BIG (20 * BLOCK)
+#define FAR (40 * BLOCK)
+#define IMAGE "/tmp/tfs_snapshots.img"
+#define FILES 100
+#define INODE_NS 200000
+
+static char buffer[BIG];
+static atomic_int writes;
+static atomic_bool stop;
+
+static void write_file(char const *path, char c, size_t len) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    memset(buffer, c, len);
+    assert(tfs_write(f, buffer, len) == (ssize_t)len);
+    assert(tfs_close(f) != -1);
+}
+
+static void check_file(char const *path, char c, size_t len) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)len);
+    for (size_t i = 0; i < len; i++) {
+        assert(buffer[i] == c);
+    }
+    assert(tfs_close(f) != -1);
+}
+
+static void check_byte(char const *path, size_t offset, char c) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    char byte;
+    assert(tfs_pread(f, &byte, 1, offset) == 1 && byte == c);
+    assert(tfs_close(f) != -1);
+}
+
+static void write_byte(char const *path, size_t offset, char c) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_pwrite(f, &c, 1, offset) == 1);
+    assert(tfs_close(f) != -1);
+}
+
+static void test_mount(void) {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK;
+    params.max_block_count = 64;
+    assert(tfs_init(&params) != -1);
+
+    assert(tfs_mkdir("/d") != -1);
+    write_file("/d/small", 's', 5);
+    write_file("/d/frag", 'f', 300);
+    write_file("/big", 'b', BIG);
+    assert(tfs_link("/big", "/d/hard") != -1);
+    assert(tfs_sym_link("/big", "/d/ln") != -1);
+    int f = tfs_open("/sparse", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_pwrite(f, "head", 4, 0) == 4);
+    assert(tfs_pwrite(f, "tail", 4, FAR) == 4);
+    assert(tfs_close(f) != -1);
+
+    int s = tfs_snapshot_create();
+    assert(s != -1);
+
+    // Changes after the snapshot.
+    write_byte("/big", 15 * BLOCK + 10, 'B');
+    write_byte("/big", 3, 'B');
+    write_file("/d/small", 'S', 5);
+    f = tfs_open("/d/frag", 0);
+    assert(f != -1);
+    assert(tfs_pwrite(f, "F", 1, 0) == 1);
+    assert(tfs_pwrite(f, "F", 1, 300) == 1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/d/hard") != -1);
+    f = tfs_open("/sparse", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_mkdir("/new") != -1);
+    write_file("/d/later", 'l', 10);
+
+    // The mounted snapshot has the files as they were.
+    assert(tfs_snapshot_mount(s, "/snap") != -1);
+    check_file("/snap/big", 'b', BIG);
+    check_file("/snap/d/hard", 'b', BIG);
+    check_file("/snap/d/small", 's', 5);
+    check_file("/snap/d/frag", 'f', 300);
+    f = tfs_open("/snap/sparse", 0);
+    assert(f != -1);
+    assert(tfs_pread(f, buffer, 4, 0) == 4 && memcmp(buffer, "head", 4) == 0);
+    assert(tfs_pread(f, buffer, 4, FAR) == 4 && memcmp(buffer, "tail", 4) == 0);
+    assert(tfs_pread(f, buffer, 1, FAR / 2) == 1 && buffer[0] == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_open("/snap/new", 0) == -1);
+    assert(tfs_open("/snap/d/later", 0) == -1);
+    assert(tfs_open("/snap/snap", 0) == -1);
+
+    // The FS has the changes (the symbolic link names a path of the FS).
+    check_byte("/big", 15 * BLOCK + 10, 'B');
+    check_byte("/d/ln", 3, 'B');
+    check_file("/d/small", 'S', 5);
+    check_byte("/d/frag", 300, 'F');
+    assert(tfs_open("/d/hard", 0) == -1);
+    check_file("/sparse", 0, 0);
+
+    // The mounted copy changes on its own, and keeps its hard links.
+    write_byte("/snap/d/hard", 15 * BLOCK + 20, 'X');
+    check_byte("/snap/big", 15 * BLOCK + 20, 'X');
+    check_byte("/big", 15 * BLOCK + 20, 'b');
+    write_byte("/snap/d/frag", 0, 'X');
+    check_byte("/d/frag", 0, 'F');
+    assert(tfs_unlink("/snap/big") != -1);
+    check_byte("/snap/d/hard", 0, 'b');
+
+    // The snapshot itself does not change.
+    assert(tfs_snapshot_mount(s, "/snap") == -1);
+    assert(tfs_snapshot_mount(s, "/new/snap") != -1);
+    check_file("/new/snap/big", 'b', BIG);
+    check_file("/new/snap/d/frag", 'f', 300);
+
+    assert(tfs_snapshot_delete(s) != -1);
+    assert(tfs_snapshot_delete(s) == -1);
+    assert(tfs_snapshot_mount(s, "/other") == -1);
+    check_file("/new/snap/big", 'b', BIG);
+    check_byte("/snap/d/hard", 15 * BLOCK + 20, 'X');
+
+    assert(tfs_destroy() != -1);
+}
+
+static void test_blocks_freed(void) {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK;
+    params.max_block_count = 12;
+    assert(tfs_init(&params) != -1);
+
+    // 8 blocks for the file and 1 for the root directory leave 3 free, so
+    // only 3 blocks can be copied while the snapshot holds the old ones.
+    write_file("/a", 'a', 8 * BLOCK);
+    int s = tfs_snapshot_create();
+    assert(s != -1);
+    int f = tfs_open("/a", 0);
+    assert(f != -1);
+    memset(buffer, 'A', 8 * BLOCK);
+    assert(tfs_pwrite(f, buffer, 8 * BLOCK, 0) == 3 * BLOCK);
+
+    assert(tfs_snapshot_delete(s) != -1);
+    assert(tfs_pwrite(f, buffer, 8 * BLOCK, 0) == 8 * BLOCK);
+    assert(tfs_close(f) != -1);
+    check_file("/a", 'A', 8 * BLOCK);
+
+    // There is room for MAX_SNAPSHOTS snapshots.
+    int ids[MAX_SNAPSHOTS];
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        ids[i] = tfs_snapshot_create();
+        assert(ids[i] != -1);
+    }
+    assert(tfs_snapshot_create() == -1);
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        assert(tfs_snapshot_delete(ids[i]) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+}
+
+static void test_image(void) {
+    unlink(IMAGE);
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK;
+    params.max_block_count = 64;
+    params.image_path = IMAGE;
+    assert(tfs_init(&params) != -1);
+
+    write_file("/big", 'b', BIG);
+    int s = tfs_snapshot_create();
+    assert(s != -1);
+    assert(tfs_snapshot_mount(s, "/snap") != -1);
+    write_byte("/big", 0, 'B');
+    assert(tfs_destroy() != -1);
+
+    // The blocks /snap/big shares with /big are counted again.
+    assert(tfs_init(&params) != -1);
+    assert(tfs_snapshot_mount(s, "/other") == -1);
+    check_file("/snap/big", 'b', BIG);
+    check_byte("/big", 0, 'B');
+    write_byte("/snap/big", 15 * BLOCK, 'X');
+    check_byte("/big", 15 * BLOCK, 'b');
+    assert(tfs_unlink("/snap/big") != -1);
+    check_byte("/big", BIG - 1, 'b');
+    assert(tfs_destroy() != -1);
+
+    unlink(IMAGE);
+}
+
+static void *writer(void *arg) {
+    int f = *(int *)arg;
+    char block[BLOCK];
+    for (int i = 0; !atomic_load(&stop); i++) {
+        memset(block, 'a' + i % 26, sizeof(block));
+        assert(tfs_pwrite(f, block, sizeof(block), 0) == sizeof(block));
+        atomic_fetch_add(&writes, 1);
+    }
+    return NULL;
+}
+
+static void test_concurrent_writes(void) {
+    tfs_params params = tfs_default_params();
+    params.block_size = 8 * BLOCK; // room for the files in the root directory
+    params.max_inode_count = 3 * FILES;
+    params.latency = tfs_fixed_latency(TFS_LATENCY_SLEEP, 0);
+    params.latency.inode_ns = INODE_NS; // copying the inodes takes a while
+    assert(tfs_init(&params) != -1);
+
+    char path[16];
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/f%d", i);
+        write_file(path, 'x', 1);
+    }
+    write_file("/w", 'a', BLOCK);
+
+    int f = tfs_open("/w", 0);
+    assert(f != -1);
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, writer, &f) == 0);
+    while (atomic_load(&writes) == 0) {
+    }
+
+    // The writer is not held back while the inodes are copied.
+    int before = atomic_load(&writes);
+    int s = tfs_snapshot_create();
+    assert(s != -1);
+    assert(atomic_load(&writes) - before >= 10);
+
+    atomic_store(&stop, true);
+    assert(pthread_join(tid, NULL) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_snapshot_mount(s, "/snap") != -1);
+    f = tfs_open("/snap/w", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == BLOCK);
+    for (size_t i = 0; i < BLOCK; i++) {
+        assert(buffer[i] == buffer[0]);
+    }
+    assert(tfs_close(f) != -1);
+    check_file("/snap/f0", 'x', 1);
+    sprintf(path, "/snap/f%d", FILES - 1);
+    check_file(path, 'x', 1);
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    test_mount();
+    test_blocks_freed();
+    test_image();
+    test_concurrent_writes();
+
+    printf("Successful test.\n");
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+This test checks that writing past the end of a file leaves a hole: with 10
+data blocks, a file can have bytes 100 blocks in, and the gap reads as zeros
+(even where the blocks reused had other bytes in them). tfs_lseek finds the
+data and the holes, and writing into a hole allocates only the blocks written.
+*/
+
+#define BLOCK 1024
+#define FAR (100 * BLOCK)
+
+static void check_zeros(int f, size_t offset, size_t len) {
+    char buffer[BLOCK];
+    while (len > 0) {
+        size_t chunk = len < sizeof(buffer) ? len : sizeof(buffer);
+        memset(buffer, 'z', sizeof(buffer));
+        assert(tfs_pread(f, buffer, chunk, offset) == (ssize_t)chunk);
+        for (size_t i = 0; i < chunk; i++) {
+            assert(buffer[i] == 0);
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+}
+
+int main() {
+    char buffer[3 * BLOCK];
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK;
+    params.max_block_count = 10;
+    assert(tfs_init(&params) != -1);
+
+    // Blocks with stale bytes, reused by the file below.
+    int f = tfs_open("/stale", TFS_O_CREAT);
+    assert(f != -1);
+    memset(buffer, 'x', sizeof(buffer));
+    assert(tfs_write(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/stale") != -1);
+
+    f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    memset(buffer, 'y', sizeof(buffer));
+    assert(tfs_write(f, buffer, BLOCK + 500) == BLOCK + 500);
+
+    // Seeking past the end and writing there leaves a hole.
+    assert(tfs_lseek(f, FAR, TFS_SEEK_SET) == FAR);
+    assert(tfs_write(f, "tail", 4) == 4);
+    assert(tfs_lseek(f, 0, TFS_SEEK_END) == FAR + 4);
+    assert(tfs_pwrite(f, "far", 3, 2 * FAR) == 3);
+    assert(tfs_lseek(f, 0, TFS_SEEK_END) == 2 * FAR + 3);
+
+    check_zeros(f, BLOCK + 500, FAR - BLOCK - 500);
+    check_zeros(f, FAR + 4, FAR - 4);
+    assert(tfs_pread(f, buffer, 4, FAR) == 4 && memcmp(buffer, "tail", 4) == 0);
+    assert(tfs_pread(f, buffer, 10, 2 * FAR) == 3 && memcmp(buffer, "far", 3) == 0);
+
+    // Data and holes.
+    assert(tfs_lseek(f, 0, TFS_SEEK_DATA) == 0);
+    assert(tfs_lseek(f, 0, TFS_SEEK_HOLE) == 2 * BLOCK);
+    assert(tfs_lseek(f, 3 * BLOCK, TFS_SEEK_DATA) == FAR);
+    assert(tfs_lseek(f, FAR + 1, TFS_SEEK_DATA) == FAR + 1);
+    assert(tfs_lseek(f, FAR, TFS_SEEK_HOLE) == FAR + BLOCK);
+    assert(tfs_lseek(f, 2 * FAR, TFS_SEEK_HOLE) == 2 * FAR + 3);
+    assert(tfs_lseek(f, 2 * FAR + 3, TFS_SEEK_DATA) == -1);
+    assert(tfs_lseek(f, -1, TFS_SEEK_HOLE) == -1);
+
+    // Failed seeks leave the offset alone.
+    assert(tfs_lseek(f, 10, TFS_SEEK_SET) == 10);
+    assert(tfs_lseek(f, -11, TFS_SEEK_CUR) == -1);
+    assert(tfs_lseek(f, 5, TFS_SEEK_CUR) == 15);
+    assert(tfs_lseek(f, -3, TFS_SEEK_END) == 2 * FAR);
+
+    // Writing into a hole zeros the rest of its block.
+    assert(tfs_pwrite(f, "mid", 3, 50 * BLOCK + 300) == 3);
+    check_zeros(f, 50 * BLOCK, 300);
+    check_zeros(f, 50 * BLOCK + 303, BLOCK - 303);
+    assert(tfs_pread(f, buffer, 3, 50 * BLOCK + 300) == 3 && memcmp(buffer, "mid", 3) == 0);
+    assert(tfs_lseek(f, BLOCK, TFS_SEEK_HOLE) == 2 * BLOCK);
+    assert(tfs_lseek(f, 2 * BLOCK, TFS_SEEK_DATA) == 50 * BLOCK);
+    assert(tfs_lseek(f, 50 * BLOCK, TFS_SEEK_HOLE) == 51 * BLOCK);
+
+    // A view of a hole is made of zeros.
+    assert(tfs_lseek(f, FAR - 10, TFS_SEEK_SET) == FAR - 10);
+    tfs_view_t view;
+    assert(tfs_read_view(f, 14, &view) == 14);
+    size_t viewed = 0;
+    for (int i = 0; i < view.tv_count; i++) {
+        memcpy(buffer + viewed, view.tv_segments[i].iov_base, view.tv_segments[i].iov_len);
+        viewed += view.tv_segments[i].iov_len;
+    }
+    assert(tfs_release_view(&view) != -1);
+    assert(viewed == 14);
+    for (size_t i = 0; i < 10; i++) {
+        assert(buffer[i] == 0);
+    }
+    assert(memcmp(buffer + 10, "tail", 4) == 0);
+    assert(tfs_close(f) != -1);
+
+    // Small files move to a block of their own when they get a hole.
+    f = tfs_open("/small", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "hello", 5) == 5);
+    assert(tfs_pwrite(f, "!", 1, 10 * BLOCK) == 1);
+    assert(tfs_pread(f, buffer, 5, 0) == 5 && memcmp(buffer, "hello", 5) == 0);
+    check_zeros(f, 5, 10 * BLOCK - 5);
+    assert(tfs_lseek(f, 5, TFS_SEEK_HOLE) == BLOCK);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -5,7 +5,9 @@
 #include <stdio.h>
 #include <string.h>
 
-uint8_t const file_contents[] = "AAA!";
+// Too large to be kept inline in an inode or in fragments of a shared block,
+// so each file takes a whole data block.
+uint8_t const file_contents[1000] = "AAA!";
 char const target_path1[] = "/f1";
 char const target_path2[] = "/f2";
 char const target_path3[] = "/f3";
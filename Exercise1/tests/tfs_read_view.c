@@ -0,0 +1,74 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILE_SIZE (5000)
+
+/*
+This test reads a multi-block file through views (without copying it), and
+checks that the file can be changed again once the views are released.
+*/
+
+static char expected_byte(size_t offset) {
+    return (char)('a' + offset % 26);
+}
+
+int main() {
+    char buffer[FILE_SIZE];
+    tfs_view_t view;
+
+    assert(tfs_init(NULL) != -1);
+
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        buffer[i] = expected_byte(i);
+    }
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, buffer, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/f1", 0);
+    assert(f != -1);
+
+    // Views of at most 1500 bytes, checked segment by segment.
+    size_t offset = 0;
+    ssize_t r;
+    while ((r = tfs_read_view(f, 1500, &view)) > 0) {
+        assert(r <= 1500);
+        assert(view.tv_count >= 1);
+
+        size_t total = 0;
+        for (int s = 0; s < view.tv_count; s++) {
+            char const *data = view.tv_segments[s].iov_base;
+            for (size_t i = 0; i < view.tv_segments[s].iov_len; i++) {
+                assert(data[i] == expected_byte(offset + total + i));
+            }
+            total += view.tv_segments[s].iov_len;
+        }
+        assert(total == (size_t)r);
+        offset += total;
+
+        assert(tfs_release_view(&view) != -1);
+        assert(tfs_release_view(&view) == -1);
+    }
+    assert(r == 0);
+    assert(offset == FILE_SIZE);
+    assert(view.tv_count == 0);
+    assert(tfs_release_view(&view) != -1);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_read_view(f, 1, &view) == -1);
+
+    // Nothing is left pinned.
+    f = tfs_open("/f1", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/f1") != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+This test writes a header and a payload with tfs_writev, and reads them back
+into separate buffers with tfs_readv (including a read that reaches the end of
+the file part way through the vector).
+*/
+
+int main() {
+    char header[8] = "HEADER:";
+    char payload[2000];
+    memset(payload, 'p', sizeof(payload));
+
+    assert(tfs_init(NULL) != -1);
+
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+
+    struct iovec out[] = {
+        {.iov_base = header, .iov_len = sizeof(header)},
+        {.iov_base = payload, .iov_len = sizeof(payload)},
+    };
+    assert(tfs_writev(f, out, 2) == sizeof(header) + sizeof(payload));
+    assert(tfs_writev(f, out, 1) == sizeof(header));
+    assert(tfs_writev(f, out, 0) == 0);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/f1", 0);
+    assert(f != -1);
+
+    char header_in[8];
+    char payload_in[2000];
+    char trailer_in[16];
+    char extra_in[16];
+    struct iovec in[] = {
+        {.iov_base = header_in, .iov_len = sizeof(header_in)},
+        {.iov_base = payload_in, .iov_len = sizeof(payload_in)},
+        {.iov_base = trailer_in, .iov_len = sizeof(trailer_in)},
+        {.iov_base = extra_in, .iov_len = sizeof(extra_in)},
+    };
+    assert(tfs_readv(f, in, 4) ==
+           sizeof(header) + sizeof(payload) + sizeof(header));
+    assert(memcmp(header_in, header, sizeof(header)) == 0);
+    assert(memcmp(payload_in, payload, sizeof(payload)) == 0);
+    assert(memcmp(trailer_in, header, sizeof(header)) == 0);
+    assert(tfs_readv(f, in, 4) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_readv(f, in, 4) == -1);
+    assert(tfs_writev(f, out, 2) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
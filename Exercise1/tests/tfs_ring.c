@@ -0,0 +1,122 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+This test opens files, writes and reads them back through a ring: operations
+are submitted in batches, possibly more than the ring has room for, and their
+completions (which may arrive in any order) are matched by user data.
+*/
+
+#define FILES 8
+#define BLOCK 256
+#define WRITES 4
+
+static void reap_all(tfs_ring_t *ring, size_t count, ssize_t *results) {
+    tfs_cqe_t cqes[FILES * WRITES];
+    size_t reaped = 0;
+    while (reaped < count) {
+        size_t got = tfs_ring_reap(ring, cqes, FILES * WRITES, 1);
+        assert(got > 0);
+        for (size_t i = 0; i < got; i++) {
+            assert(cqes[i].cqe_user_data < FILES * WRITES);
+            results[cqes[i].cqe_user_data] = cqes[i].cqe_result;
+        }
+        reaped += got;
+    }
+    assert(reaped == count);
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    tfs_ring_t *ring = tfs_ring_create(FILES, 4);
+    assert(ring != NULL);
+
+    char names[FILES][16];
+    tfs_sqe_t sqes[FILES * WRITES];
+    ssize_t results[FILES * WRITES];
+
+    // Open every file.
+    for (size_t i = 0; i < FILES; i++) {
+        snprintf(names[i], sizeof(names[i]), "/f%zu", i);
+        sqes[i] = (tfs_sqe_t){.sqe_op = TFS_OP_OPEN,
+                              .sqe_name = names[i],
+                              .sqe_mode = TFS_O_CREAT,
+                              .sqe_user_data = i};
+    }
+    assert(tfs_ring_submit(ring, sqes, FILES) == FILES);
+    reap_all(ring, FILES, results);
+    int fhandles[FILES];
+    for (size_t i = 0; i < FILES; i++) {
+        assert(results[i] != -1);
+        fhandles[i] = (int)results[i];
+    }
+
+    // Write every block of every file at its own offset; there are more
+    // operations than the ring has room for.
+    char out[FILES * WRITES][BLOCK];
+    for (size_t i = 0; i < FILES * WRITES; i++) {
+        memset(out[i], 'a' + (int)(i % 26), BLOCK);
+        sqes[i] = (tfs_sqe_t){.sqe_op = TFS_OP_PWRITE,
+                              .sqe_fhandle = fhandles[i % FILES],
+                              .sqe_buffer = out[i],
+                              .sqe_len = BLOCK,
+                              .sqe_offset = (i / FILES) * BLOCK,
+                              .sqe_user_data = i};
+    }
+    size_t submitted = tfs_ring_submit(ring, sqes, FILES * WRITES);
+    assert(submitted == FILES);
+    while (submitted < FILES * WRITES) {
+        tfs_cqe_t cqe;
+        assert(tfs_ring_reap(ring, &cqe, 1, 1) == 1);
+        assert(cqe.cqe_result == BLOCK);
+        submitted += tfs_ring_submit(ring, sqes + submitted, FILES * WRITES - submitted);
+    }
+    tfs_cqe_t cqes[FILES];
+    size_t reaped = 0;
+    while (reaped < FILES) {
+        size_t got = tfs_ring_reap(ring, cqes, FILES, FILES - reaped);
+        for (size_t i = 0; i < got; i++) {
+            assert(cqes[i].cqe_result == BLOCK);
+        }
+        reaped += got;
+    }
+    // Nothing is in flight: reaping does not wait.
+    assert(tfs_ring_reap(ring, cqes, FILES, FILES) == 0);
+
+    // Read everything back.
+    char in[FILES * WRITES][BLOCK];
+    for (size_t i = 0; i < FILES * WRITES; i += FILES) {
+        for (size_t j = i; j < i + FILES; j++) {
+            sqes[j].sqe_op = TFS_OP_PREAD;
+            sqes[j].sqe_buffer = in[j];
+        }
+        assert(tfs_ring_submit(ring, sqes + i, FILES) == FILES);
+        reap_all(ring, FILES, results);
+    }
+    for (size_t i = 0; i < FILES * WRITES; i++) {
+        assert(results[i] == BLOCK);
+        assert(memcmp(in[i], out[i], BLOCK) == 0);
+    }
+
+    // Close every file, and leave the completions for tfs_ring_destroy.
+    for (size_t i = 0; i < FILES; i++) {
+        sqes[i] = (tfs_sqe_t){.sqe_op = TFS_OP_CLOSE,
+                              .sqe_fhandle = fhandles[i],
+                              .sqe_user_data = i};
+    }
+    assert(tfs_ring_submit(ring, sqes, FILES) == FILES);
+    tfs_ring_destroy(ring);
+
+    for (size_t i = 0; i < FILES; i++) {
+        assert(tfs_read(fhandles[i], in[0], BLOCK) == -1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -10,8 +10,15 @@
 This test creates 10 files at once to see if no inodes are
 overriden, making sure that the tfs_open function is 
 thread-safe.
+It then has STRESS_THREADS threads create, close and unlink
+files STRESS_ROUNDS times each, and checks that every inode
+is still available afterwards (none leaked or handed out twice).
 */
 
+#define STRESS_THREADS 32
+#define STRESS_ROUNDS 100
+#define STRESS_INODES 64
+
 void* create(void* num) {
     int number = *(int*)num;
     char path[10] = "/";
@@ -26,6 +33,58 @@ void* create(void* num) {
     return NULL;
 }
 
+void* create_and_unlink(void* num) {
+    int number = *(int*)num;
+    char path[16];
+
+    sprintf(path, "/s%d", number);
+
+    for (int round = 0; round < STRESS_ROUNDS; round++) {
+        int fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+
+        assert(tfs_write(fd, path, strlen(path)) == strlen(path));
+        assert(tfs_close(fd) == 0);
+
+        assert(tfs_unlink(path) == 0);
+    }
+
+    return NULL;
+}
+
+void stress() {
+    int numbers[STRESS_THREADS];
+    pthread_t tid[STRESS_THREADS];
+    char path[16];
+
+    // Larger blocks so that the root directory has an entry for each inode.
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = STRESS_INODES;
+    params.max_open_files_count = STRESS_THREADS;
+    params.block_size = 4096;
+    assert(tfs_init(&params) != -1);
+
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        numbers[i] = i;
+        pthread_create(&tid[i], NULL, create_and_unlink, &numbers[i]);
+    }
+
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    // Every inode but the root's must be free again.
+    for (int i = 0; i < STRESS_INODES - 1; i++) {
+        sprintf(path, "/c%d", i);
+        int fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_close(fd) == 0);
+    }
+    assert(tfs_open("/full", TFS_O_CREAT) == -1);
+
+    tfs_destroy();
+}
+
 int main() {
     int i_table[10] = {1,2,3,4,5,6,7,8,9,0};
     pthread_t tid[10];
@@ -50,6 +109,8 @@ int main() {
 
     tfs_destroy();
 
+    stress();
+
     printf("Successful test.\n");
 
     return 0;
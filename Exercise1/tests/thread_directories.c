@@ -0,0 +1,79 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define THREADS 8
+#define ROUNDS 50
+
+/*
+This test has THREADS threads work in their own directories at the same time
+(creating, writing, reading and removing files and sub directories), to check
+that operations in disjoint subtrees do not interfere with each other.
+*/
+
+void* work(void* num) {
+    int number = *(int*)num;
+    char dir[32];
+    char sub_dir[48];
+    char file[64];
+    char buffer[64];
+
+    sprintf(dir, "/d%d", number);
+    sprintf(sub_dir, "%s/sub", dir);
+    sprintf(file, "%s/file", sub_dir);
+
+    for (int round = 0; round < ROUNDS; round++) {
+        assert(tfs_mkdir(sub_dir) != -1);
+
+        int fd = tfs_open(file, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_write(fd, file, strlen(file)) == strlen(file));
+        assert(tfs_close(fd) == 0);
+
+        fd = tfs_open(file, 0);
+        assert(fd != -1);
+        assert(tfs_read(fd, buffer, sizeof(buffer)) == strlen(file));
+        assert(memcmp(buffer, file, strlen(file)) == 0);
+        assert(tfs_close(fd) == 0);
+
+        assert(tfs_unlink(file) == 0);
+        assert(tfs_rmdir(sub_dir) == 0);
+    }
+
+    return NULL;
+}
+
+int main() {
+    int numbers[THREADS];
+    pthread_t tid[THREADS];
+    char dir[32];
+
+    assert(tfs_init(NULL) != -1);
+
+    for (int i = 0; i < THREADS; i++) {
+        sprintf(dir, "/d%d", i);
+        assert(tfs_mkdir(dir) != -1);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        numbers[i] = i;
+        pthread_create(&tid[i], NULL, work, &numbers[i]);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        sprintf(dir, "/d%d", i);
+        assert(tfs_rmdir(dir) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
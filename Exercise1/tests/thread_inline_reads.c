@@ -0,0 +1,78 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define READERS 4
+#define ROUNDS 300
+#define INLINE_SIZE (100)
+#define SIZE (600)
+
+/*
+This test has a writer repeatedly truncate a file, write it inline and then
+grow it out of the inode (into fragments), while READERS threads read it with
+tfs_pread. Every read must see the whole file as it was at some point: empty,
+or a single pattern either inline or grown, never more than was written.
+*/
+
+int fd;
+
+void* write_rounds(void* arg) {
+    (void)arg;
+    char buffer[SIZE];
+
+    for (int round = 0; round < ROUNDS; round++) {
+        memset(buffer, 'A' + round % 26, SIZE);
+
+        int own_fd = tfs_open("/file", TFS_O_TRUNC);
+        assert(own_fd != -1);
+        assert(tfs_write(own_fd, buffer, INLINE_SIZE) == INLINE_SIZE);
+        assert(tfs_close(own_fd) != -1);
+
+        assert(tfs_pwrite(fd, buffer, SIZE, 0) == SIZE);
+    }
+
+    return NULL;
+}
+
+void* read_rounds(void* arg) {
+    (void)arg;
+    char buffer[SIZE + 1];
+
+    for (int round = 0; round < ROUNDS; round++) {
+        ssize_t size = tfs_pread(fd, buffer, sizeof(buffer), 0);
+        assert(size == 0 || size == INLINE_SIZE || size == SIZE);
+        for (ssize_t i = 1; i < size; i++) {
+            assert(buffer[i] == buffer[0]);
+        }
+    }
+
+    return NULL;
+}
+
+int main() {
+    pthread_t writer;
+    pthread_t readers[READERS];
+
+    assert(tfs_init(NULL) != -1);
+
+    fd = tfs_open("/file", TFS_O_CREAT);
+    assert(fd != -1);
+
+    pthread_create(&writer, NULL, write_rounds, NULL);
+    for (int i = 0; i < READERS; i++) {
+        pthread_create(&readers[i], NULL, read_rounds, NULL);
+    }
+    pthread_join(writer, NULL);
+    for (int i = 0; i < READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    assert(tfs_close(fd) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
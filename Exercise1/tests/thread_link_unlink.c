@@ -0,0 +1,121 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS 4
+#define ROUNDS 300
+#define TARGET "/target"
+#define CONTENTS "target contents"
+#define OTHER "other contents!"
+
+/*
+This test has threads link to and unlink a file while another one removes it
+and creates it again, along with other files that may take its inode. A link
+that is made always names the file it was made to (never a deleted file, nor
+another file that took its inode), and every name can be removed in the end.
+*/
+
+static atomic_int linked;
+
+static void write_file(char const *path, char const *contents) {
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, strlen(contents)) == strlen(contents));
+    assert(tfs_close(fd) != -1);
+}
+
+void *link_unlink(void *num) {
+    int number = *(int *)num;
+    char link[32];
+    char buffer[32];
+    sprintf(link, "/link%d", number);
+
+    for (int round = 0; round < ROUNDS; round++) {
+        if (tfs_link(TARGET, link) == -1) {
+            sched_yield(); // The target was not there.
+            continue;
+        }
+        atomic_fetch_add(&linked, 1);
+
+        int fd = tfs_open(link, 0);
+        assert(fd != -1);
+        assert(tfs_read(fd, buffer, sizeof(buffer)) == strlen(CONTENTS));
+        assert(memcmp(buffer, CONTENTS, strlen(CONTENTS)) == 0);
+        assert(tfs_close(fd) != -1);
+        while (tfs_unlink(link) == -1) {
+            sched_yield(); // The last name, while another thread links to it.
+        }
+    }
+    return NULL;
+}
+
+void *recreate(void *arg) {
+    (void)arg;
+    char other[32];
+
+    for (int round = 0; round < ROUNDS; round++) {
+        write_file(TARGET, CONTENTS);
+        for (int i = 0; i < THREADS; i++) {
+            sched_yield(); // Gives the others a chance to link to it.
+        }
+
+        // The last name of a file being linked to can not be removed (until
+        // it is linked).
+        while (tfs_unlink(TARGET) == -1) {
+            sched_yield();
+        }
+
+        // Other files take the inodes that were freed.
+        sprintf(other, "/other%d", round % 4);
+        tfs_unlink(other);
+        write_file(other, OTHER);
+    }
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    pthread_t tid[THREADS + 1];
+    int numbers[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        numbers[i] = i;
+        assert(pthread_create(&tid[i], NULL, link_unlink, &numbers[i]) == 0);
+    }
+    assert(pthread_create(&tid[THREADS], NULL, recreate, NULL) == 0);
+    for (int i = 0; i <= THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+    assert(atomic_load(&linked) > 0);
+
+    // No name was left behind, nor inode lost.
+    char path[32];
+    for (int i = 0; i < 4; i++) {
+        sprintf(path, "/other%d", i);
+        assert(tfs_unlink(path) != -1);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        sprintf(path, "/link%d", i);
+        assert(tfs_open(path, 0) == -1);
+    }
+    assert(tfs_open(TARGET, 0) == -1);
+    // Every inode (of the default 64) is free again but the root's.
+    for (int d = 0; d < 3; d++) {
+        sprintf(path, "/d%d", d);
+        assert(tfs_mkdir(path) != -1);
+        for (int i = 0; i < 20; i++) {
+            sprintf(path, "/d%d/f%d", d, i);
+            write_file(path, OTHER);
+        }
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
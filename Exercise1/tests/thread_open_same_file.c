@@ -0,0 +1,67 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define THREADS 16
+#define ROUNDS 100
+
+/*
+This test has THREADS threads open the same files at once: an existing file,
+which they read, and a missing one, which they all try to create. The file
+must be created exactly once.
+*/
+
+char const contents[] = "shared contents";
+
+void* open_files(void* arg) {
+    (void)arg;
+    char buffer[sizeof(contents)];
+
+    for (int round = 0; round < ROUNDS; round++) {
+        int f = tfs_open("/existing", 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(contents));
+        assert(memcmp(buffer, contents, sizeof(contents)) == 0);
+        assert(tfs_close(f) != -1);
+    }
+
+    int f = tfs_open("/created", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+
+    return NULL;
+}
+
+int main() {
+    pthread_t tid[THREADS];
+
+    tfs_params params = tfs_default_params();
+    params.max_open_files_count = THREADS;
+    assert(tfs_init(&params) != -1);
+
+    int f = tfs_open("/existing", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&tid[i], NULL, open_files, NULL);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    // If the file had been created more than once, another entry would
+    // remain after unlinking it.
+    assert(tfs_unlink("/created") != -1);
+    assert(tfs_open("/created", 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define READERS 6
+#define ROUNDS 200
+#define SIZE (600)
+
+/*
+This test has a writer repeatedly rewrite a small file (smaller than a block)
+with one of two patterns, while READERS threads read it with tfs_pread and
+tfs_read. Every read must see a single pattern, never a mix of both.
+*/
+
+int fd;
+
+static void fill(char *buffer, int round) {
+    memset(buffer, round % 2 == 0 ? 'A' : 'B', SIZE);
+}
+
+void* write_rounds(void* arg) {
+    (void)arg;
+    char buffer[SIZE];
+
+    for (int round = 0; round < ROUNDS; round++) {
+        fill(buffer, round);
+        assert(tfs_pwrite(fd, buffer, SIZE, 0) == SIZE);
+    }
+
+    return NULL;
+}
+
+static void check_uniform(char const *buffer) {
+    for (size_t i = 1; i < SIZE; i++) {
+        assert(buffer[i] == buffer[0]);
+    }
+    assert(buffer[0] == 'A' || buffer[0] == 'B');
+}
+
+void* read_rounds(void* arg) {
+    (void)arg;
+    char buffer[SIZE];
+
+    int own_fd = tfs_open("/small", 0);
+    assert(own_fd != -1);
+
+    for (int round = 0; round < ROUNDS; round++) {
+        assert(tfs_pread(fd, buffer, SIZE, 0) == SIZE);
+        check_uniform(buffer);
+
+        assert(tfs_read(own_fd, buffer, SIZE) == SIZE);
+        check_uniform(buffer);
+        assert(tfs_read(own_fd, buffer, SIZE) == 0);
+        assert(tfs_close(own_fd) != -1);
+        own_fd = tfs_open("/small", 0);
+        assert(own_fd != -1);
+    }
+
+    assert(tfs_close(own_fd) != -1);
+    return NULL;
+}
+
+int main() {
+    pthread_t writer;
+    pthread_t readers[READERS];
+    char buffer[SIZE];
+
+    assert(tfs_init(NULL) != -1);
+
+    fd = tfs_open("/small", TFS_O_CREAT);
+    assert(fd != -1);
+    fill(buffer, 0);
+    assert(tfs_pwrite(fd, buffer, SIZE, 0) == SIZE);
+
+    pthread_create(&writer, NULL, write_rounds, NULL);
+    for (int i = 0; i < READERS; i++) {
+        pthread_create(&readers[i], NULL, read_rounds, NULL);
+    }
+    pthread_join(writer, NULL);
+    for (int i = 0; i < READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    // The last round left the second pattern behind.
+    assert(tfs_pread(fd, buffer, SIZE, 0) == SIZE);
+    check_uniform(buffer);
+    assert(buffer[0] == 'B');
+
+    // Truncating the file is seen by readers that do not lock it.
+    assert(tfs_close(fd) != -1);
+    fd = tfs_open("/small", TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_pread(fd, buffer, SIZE, 0) == 0);
+
+    assert(tfs_close(fd) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define THREADS 8
+#define SLICE (3000)
+
+/*
+This test has THREADS threads write and then read their own slice of a file
+through the same file handle with tfs_pwrite and tfs_pread, and checks that
+the handle's offset is not affected. It also checks writes past the end of
+the file.
+*/
+
+int fd;
+
+static char slice_byte(int thread, size_t i) {
+    return (char)('a' + (thread + (int)(i % 7)) % 26);
+}
+
+void* write_slice(void* num) {
+    int number = *(int*)num;
+    char buffer[SLICE];
+
+    for (size_t i = 0; i < SLICE; i++) {
+        buffer[i] = slice_byte(number, i);
+    }
+    assert(tfs_pwrite(fd, buffer, SLICE, (size_t)number * SLICE) == SLICE);
+
+    return NULL;
+}
+
+void* read_slice(void* num) {
+    int number = *(int*)num;
+    char buffer[SLICE];
+
+    for (int round = 0; round < 10; round++) {
+        assert(tfs_pread(fd, buffer, SLICE, (size_t)number * SLICE) == SLICE);
+        for (size_t i = 0; i < SLICE; i++) {
+            assert(buffer[i] == slice_byte(number, i));
+        }
+    }
+
+    return NULL;
+}
+
+int main() {
+    int numbers[THREADS];
+    pthread_t tid[THREADS];
+    char buffer[16];
+
+    assert(tfs_init(NULL) != -1);
+
+    fd = tfs_open("/f1", TFS_O_CREAT);
+    assert(fd != -1);
+
+    // Writes in reverse order, so most of them start past the end of the file.
+    for (int i = THREADS - 1; i >= 0; i--) {
+        numbers[i] = i;
+        pthread_create(&tid[i], NULL, write_slice, &numbers[i]);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&tid[i], NULL, read_slice, &numbers[i]);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    // The handle's offset is still at the start of the file.
+    assert(tfs_read(fd, buffer, 1) == 1);
+    assert(buffer[0] == slice_byte(0, 0));
+
+    // Reads at or past the end of the file return nothing.
+    assert(tfs_pread(fd, buffer, sizeof(buffer), THREADS * SLICE) == 0);
+    assert(tfs_pread(fd, buffer, sizeof(buffer), THREADS * SLICE + 100) == 0);
+
+    // A write past the end leaves zeros behind it.
+    assert(tfs_pwrite(fd, "end", 3, THREADS * SLICE + 5) == 3);
+    assert(tfs_pread(fd, buffer, sizeof(buffer), THREADS * SLICE) == 8);
+    assert(memcmp(buffer, "\0\0\0\0\0end", 8) == 0);
+
+    assert(tfs_close(fd) != -1);
+    assert(tfs_pread(fd, buffer, sizeof(buffer), 0) == -1);
+    assert(tfs_pwrite(fd, buffer, sizeof(buffer), 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILES (3)
+#define CHUNK_SIZE (1500)
+#define CHUNKS (40)
+
+/*
+This test appends to several files in turns, so that their blocks end up
+interleaved (each file getting many short extents), and checks that every
+file reads back correctly.
+*/
+
+int main() {
+    char const *paths[FILES] = {"/f1", "/f2", "/f3"};
+    int fds[FILES];
+    char buffer[CHUNK_SIZE];
+
+    assert(tfs_init(NULL) != -1);
+
+    for (int i = 0; i < FILES; i++) {
+        fds[i] = tfs_open(paths[i], TFS_O_CREAT);
+        assert(fds[i] != -1);
+    }
+
+    for (int c = 0; c < CHUNKS; c++) {
+        for (int i = 0; i < FILES; i++) {
+            memset(buffer, 'a' + (c + i) % 26, sizeof(buffer));
+            assert(tfs_write(fds[i], buffer, sizeof(buffer)) == sizeof(buffer));
+        }
+    }
+
+    for (int i = 0; i < FILES; i++) {
+        assert(tfs_close(fds[i]) != -1);
+    }
+
+    for (int i = 0; i < FILES; i++) {
+        int f = tfs_open(paths[i], 0);
+        assert(f != -1);
+
+        for (int c = 0; c < CHUNKS; c++) {
+            assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+            for (size_t j = 0; j < sizeof(buffer); j++) {
+                assert(buffer[j] == 'a' + (c + i) % 26);
+            }
+        }
+        assert(tfs_read(f, buffer, sizeof(buffer)) == 0);
+
+        assert(tfs_close(f) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILE_SIZE (4 * 1024 * 1024)
+#define CHUNK_SIZE (3000)
+
+/*
+This test writes a file large enough to need the direct, single indirect and
+double indirect blocks of its inode, reads it back, and checks that
+truncating it releases every block.
+*/
+
+static char expected_byte(size_t offset) {
+    return (char)('a' + (offset * 7 + offset / 1024) % 26);
+}
+
+static void write_file(char const *path) {
+    char buffer[CHUNK_SIZE];
+
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+
+    for (size_t offset = 0; offset < FILE_SIZE; offset += CHUNK_SIZE) {
+        size_t len = CHUNK_SIZE;
+        if (len > FILE_SIZE - offset) {
+            len = FILE_SIZE - offset;
+        }
+        for (size_t i = 0; i < len; i++) {
+            buffer[i] = expected_byte(offset + i);
+        }
+        assert(tfs_write(f, buffer, len) == len);
+    }
+
+    assert(tfs_close(f) != -1);
+}
+
+static void check_file(char const *path) {
+    char buffer[CHUNK_SIZE];
+
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+
+    size_t offset = 0;
+    ssize_t r;
+    while ((r = tfs_read(f, buffer, sizeof(buffer))) > 0) {
+        for (size_t i = 0; i < r; i++) {
+            assert(buffer[i] == expected_byte(offset + i));
+        }
+        offset += (size_t)r;
+    }
+    assert(r == 0);
+    assert(offset == FILE_SIZE);
+
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    // Room for one large file (data plus indirect blocks) and the root
+    // directory, but not for two.
+    params.max_block_count = FILE_SIZE / 1024 + 64;
+    assert(tfs_init(&params) != -1);
+
+    write_file("/f1");
+    check_file("/f1");
+
+    // Rewriting with TFS_O_TRUNC only works if all blocks were freed.
+    write_file("/f1");
+    check_file("/f1");
+
+    // Writing past the available blocks returns a short write.
+    int f = tfs_open("/f2", TFS_O_CREAT);
+    assert(f != -1);
+    char buffer[CHUNK_SIZE];
+    memset(buffer, 'x', sizeof(buffer));
+    ssize_t w;
+    size_t total = 0;
+    while ((w = tfs_write(f, buffer, sizeof(buffer))) > 0) {
+        total += (size_t)w;
+    }
+    assert(w == -1);
+    assert(total < FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}